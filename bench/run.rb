@@ -0,0 +1,190 @@
+# Throughput benchmarks of holycorn scans, run against the local cluster and
+# redis-server set up by bench/run.sh. Prints one JSON object per benchmark on
+# stdout, to be compared across commits:
+#
+#   {"benchmark":"ints","table":"ints","rows":1000000,"iterations":5,
+#    "rows_per_sec":...,"latency_ms":{"min":...,"p50":...,"p90":...,"p99":...,"max":...},
+#    "backend_rss_kb":...,"backend_peak_rss_kb":...,"pg_version":...,"commit":...}
+#
+# Scans run as EXPLAIN ANALYZE (without per-node timing), so that rows aren't
+# sent to the client: latencies are those of the query, measured by the
+# client. Each benchmark runs once before being measured, which fills the VM
+# pool and the bytecode cache, except for startup_cold which starts a new
+# backend for each iteration.
+#
+# Environment:
+#
+# * ITERATIONS (default 5): measured scans per benchmark
+# * REDIS_KEYS (default "10000 1000000 10000000"): sizes of the Redis keyspaces
+# * BENCHMARKS: comma-separated names of the benchmarks to run (default: all)
+# * HOLYCORN_COMMIT: reported commit, `git rev-parse HEAD` when unset
+require 'json'
+require 'open3'
+
+PSQL = ENV['PSQL'] || 'psql -p 5433'
+ITERATIONS = (ENV['ITERATIONS'] || 5).to_i
+REDIS_KEYS = (ENV['REDIS_KEYS'] || '10000 1000000 10000000').split.map(&:to_i)
+ONLY = ENV['BENCHMARKS'] ? ENV['BENCHMARKS'].split(',') : nil
+
+# Conversion of each type of values, with the tables of bench/setup.sql
+CONVERSIONS = ['ints', 'floats', 'short_texts', 'long_texts', 'times', 'arrays', 'hashes']
+
+# A psql session, i.e. a backend
+class Session
+  SENTINEL = '__holycorn_bench__'
+
+  attr_reader :pid
+
+  def initialize
+    @stdin, @stdout, @wait = Open3.popen2('su', '-c', "#{PSQL} -XAtq -v ON_ERROR_STOP=1", '-', 'postgres')
+    @pid = query('SELECT pg_backend_pid()').to_i
+  end
+
+  # What psql prints for sql
+  def query(sql)
+    @stdin.puts(sql.end_with?(';') ? sql : "#{sql};")
+    @stdin.puts("\\echo #{SENTINEL}")
+    @stdin.flush
+
+    lines = []
+    while (line = @stdout.gets)
+      line = line.chomp
+      return lines.join("\n") if line == SENTINEL
+      lines << line
+    end
+    raise "psql exited while running: #{sql}"
+  end
+
+  # Rows returned by a scan of table, and the time it took in seconds
+  def scan(table)
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    plan = JSON.parse(query("EXPLAIN (ANALYZE, TIMING OFF, FORMAT JSON) SELECT * FROM holycorn_bench.#{table}"))
+    [plan[0]['Plan']['Actual Rows'].to_i, Process.clock_gettime(Process::CLOCK_MONOTONIC) - start]
+  end
+
+  # Resident set size of the backend, current and peak, in kB
+  def rss
+    status = File.read("/proc/#{@pid}/status")
+    [status[/^VmRSS:\s+(\d+)/, 1].to_i, status[/^VmHWM:\s+(\d+)/, 1].to_i]
+  end
+
+  def close
+    @stdin.close
+    @wait.value
+  end
+end
+
+def commit
+  return ENV['HOLYCORN_COMMIT'] if ENV['HOLYCORN_COMMIT']
+
+  sha = `git -C #{File.dirname(__FILE__)} rev-parse HEAD 2>/dev/null`.strip
+  sha.empty? ? nil : sha
+end
+
+# Nearest-rank percentile of sorted values
+def percentile(sorted, p)
+  sorted[[(p / 100.0 * sorted.size).ceil - 1, 0].max]
+end
+
+def report(name, table, rows, times, rss)
+  sorted = times.sort.map { |t| (t * 1000).round(3) }
+  total = times.inject(0.0) { |sum, t| sum + t }
+
+  puts JSON.generate(
+    'benchmark'           => name,
+    'table'               => table,
+    'rows'                => rows,
+    'iterations'          => times.size,
+    'rows_per_sec'        => total > 0 ? (rows * times.size / total).round : nil,
+    'latency_ms'          => {
+      'min' => sorted.first,
+      'p50' => percentile(sorted, 50),
+      'p90' => percentile(sorted, 90),
+      'p99' => percentile(sorted, 99),
+      'max' => sorted.last,
+    },
+    'backend_rss_kb'      => rss[0],
+    'backend_peak_rss_kb' => rss[1],
+    'pg_version'          => $pg_version,
+    'commit'              => $commit,
+    'time'                => Time.now.utc.strftime('%Y-%m-%dT%H:%M:%SZ')
+  )
+  $stdout.flush
+end
+
+def wanted?(name)
+  ONLY.nil? || ONLY.include?(name)
+end
+
+# Scans of a warm backend
+def benchmark(name, table)
+  return unless wanted?(name)
+
+  $stderr.puts "[bench] #{name}"
+  session = Session.new
+  session.scan(table)
+
+  rows = 0
+  times = Array.new(ITERATIONS) do
+    rows, time = session.scan(table)
+    time
+  end
+
+  report(name, table, rows, times, session.rss)
+  session.close
+end
+
+# Scans of a new backend each time: VM creation and script compilation
+def benchmark_cold(name, table)
+  return unless wanted?(name)
+
+  $stderr.puts "[bench] #{name}"
+  rows = 0
+  rss = nil
+  times = Array.new(ITERATIONS) do
+    session = Session.new
+    rows, time = session.scan(table)
+    rss = session.rss
+    session.close
+    time
+  end
+
+  report(name, table, rows, times, rss)
+end
+
+# Fills Redis with keys key:0 to key:<keys - 1>, by MSETs of 1000 keys
+def load_redis(keys)
+  system('redis-cli', 'flushall', out: File::NULL) or raise 'redis-cli flushall failed'
+
+  IO.popen(['redis-cli', '--pipe'], 'w', out: File::NULL) do |pipe|
+    (0...keys).each_slice(1000) do |slice|
+      command = "*#{slice.size * 2 + 1}\r\n$4\r\nMSET\r\n"
+      slice.each do |i|
+        key = "key:#{i}"
+        value = i.to_s
+        command << "$#{key.bytesize}\r\n#{key}\r\n$#{value.bytesize}\r\n#{value}\r\n"
+      end
+      pipe.write(command)
+    end
+  end
+  raise 'redis-cli --pipe failed' unless $?.success?
+end
+
+$commit = commit
+session = Session.new
+$pg_version = session.query('SHOW server_version_num').to_i
+session.close
+
+CONVERSIONS.each { |table| benchmark(table, table) }
+
+benchmark_cold('startup_cold', 'startup')
+benchmark('startup_warm', 'startup')
+
+REDIS_KEYS.each do |keys|
+  name = "redis_#{keys}"
+  next unless wanted?(name)
+
+  $stderr.puts "[bench] loading #{keys} Redis keys"
+  load_redis(keys)
+  benchmark(name, 'redis')
+end
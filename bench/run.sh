@@ -0,0 +1,11 @@
+#!/usr/bin/env bash
+# Runs the benchmarks in the test image: bench/run.sh <PostgreSQL version>
+source $(dirname $0)/../tests/helpers.sh
+
+# Create and start services; Redis doesn't snapshot the benchmark keys
+pg_ctlcluster $1 my_cluster start
+redis-server --daemonize yes --save '' --appendonly no
+
+exec_psql /holycorn/bench/setup.sql
+
+exec ruby /holycorn/bench/run.rb
@@ -0,0 +1,55 @@
+CREATE EXTENSION holycorn;
+CREATE SCHEMA holycorn_bench;
+CREATE SERVER holycorn_bench_server
+  FOREIGN DATA WRAPPER holycorn;
+
+CREATE FOREIGN TABLE holycorn_bench.ints
+  ( c1 bigint, c2 bigint, c3 bigint, c4 bigint )
+  SERVER holycorn_bench_server
+  OPTIONS ( wrapper_path '/holycorn/bench/wrappers/synthetic.rb', kind 'int' );
+
+CREATE FOREIGN TABLE holycorn_bench.floats
+  ( c1 float8, c2 float8, c3 float8, c4 float8 )
+  SERVER holycorn_bench_server
+  OPTIONS ( wrapper_path '/holycorn/bench/wrappers/synthetic.rb', kind 'float' );
+
+CREATE FOREIGN TABLE holycorn_bench.short_texts
+  ( c1 text, c2 text, c3 text, c4 text )
+  SERVER holycorn_bench_server
+  OPTIONS ( wrapper_path '/holycorn/bench/wrappers/synthetic.rb', kind 'short_text' );
+
+CREATE FOREIGN TABLE holycorn_bench.long_texts
+  ( c1 text, c2 text, c3 text, c4 text )
+  SERVER holycorn_bench_server
+  OPTIONS ( wrapper_path '/holycorn/bench/wrappers/synthetic.rb', kind 'long_text', rows '100000' );
+
+CREATE FOREIGN TABLE holycorn_bench.times
+  ( c1 timestamptz, c2 timestamptz, c3 timestamptz, c4 timestamptz )
+  SERVER holycorn_bench_server
+  OPTIONS ( wrapper_path '/holycorn/bench/wrappers/synthetic.rb', kind 'time' );
+
+CREATE FOREIGN TABLE holycorn_bench.arrays
+  ( c1 integer[], c2 integer[], c3 integer[], c4 integer[] )
+  SERVER holycorn_bench_server
+  OPTIONS ( wrapper_path '/holycorn/bench/wrappers/synthetic.rb', kind 'array', rows '100000' );
+
+CREATE FOREIGN TABLE holycorn_bench.hashes
+  ( c1 jsonb, c2 jsonb, c3 jsonb, c4 jsonb )
+  SERVER holycorn_bench_server
+  OPTIONS ( wrapper_path '/holycorn/bench/wrappers/synthetic.rb', kind 'hash', rows '100000' );
+
+-- A single row: scans are mostly VM startup and wrapper construction
+CREATE FOREIGN TABLE holycorn_bench.startup
+  ( c1 bigint, c2 bigint, c3 bigint, c4 bigint )
+  SERVER holycorn_bench_server
+  OPTIONS ( wrapper_path '/holycorn/bench/wrappers/synthetic.rb', kind 'int', rows '1' );
+
+CREATE FOREIGN TABLE holycorn_bench.redis
+  ( key text, value text )
+  SERVER holycorn_bench_server
+  OPTIONS ( wrapper_class 'HolycornRedis'
+          , host '127.0.0.1'
+          , port '6379'
+          , db '0'
+          , batch_size '1000'
+          );
@@ -0,0 +1,38 @@
+# Rows of four columns holding values of the kind given by the `kind` option,
+# `rows` of them. The same row object is returned over and over, so that what
+# is measured is the scan and the conversion of values into datums rather than
+# the building of the values.
+class Synthetic
+  VALUES = {
+    'int'         => lambda { 42 },
+    'float'       => lambda { 3.14159 },
+    'short_text'  => lambda { 'holycorn' },
+    'long_text'   => lambda { 'x' * 4096 },
+    'time'        => lambda { Time.at(1_500_000_000) },
+    'array'       => lambda { (1..10).to_a },
+    'hash'        => lambda { { 'id' => 1, 'name' => 'holycorn', 'tags' => ['a', 'b'] } },
+  }
+
+  def initialize(env = {})
+    kind = env['kind'] || 'int'
+    raise ArgumentError, "unknown kind #{kind}" unless VALUES.key?(kind)
+
+    value = VALUES[kind].call
+    @row = [value, value, value, value]
+    @total = (env['rows'] || 1_000_000).to_i
+    @left = @total
+  end
+
+  def rewind(env)
+    @left = @total
+  end
+
+  def each_batch(n)
+    return nil if @left <= 0
+
+    n = @left if n > @left
+    @left -= n
+    Array.new(n, @row)
+  end
+  self
+end
@@ -0,0 +1,227 @@
+# Known limitations
+#
+# 1. Files are read as they are when the scan reaches them: rows appended
+#    during a scan may or may not be returned
+# 2. CSV files are scanned in parallel one file per worker, as quoted fields
+#    may span lines
+# 3. With mmap 'true', files are mapped in memory rather than read. A file
+#    truncated while it is scanned (by log rotation with copytruncate, say)
+#    then makes the backend crash with SIGBUS when it reads the missing
+#    pages, which restarts every backend. Truncation between two batches is
+#    detected and raises an error, but not during a batch: only map files
+#    that are replaced or appended to
+# 4. Files are read as the server's OS user: the path option can only be set
+#    by superusers and members of pg_read_server_files (see
+#    holycorn_validator)
+class HolycornFile
+  EXTENSIONS = {
+    '.csv'    => 'csv',
+    '.tsv'    => 'tsv',
+    '.ndjson' => 'ndjson',
+    '.jsonl'  => 'ndjson',
+  }
+
+  DELIMITERS = { 'csv' => ',', 'tsv' => "\t" }
+
+  # How the parser hands values over, from the type of their column: others
+  # are Strings given to the type's input function
+  KINDS = {
+    'smallint'         => 'int',
+    'integer'          => 'int',
+    'bigint'           => 'int',
+    'real'             => 'float',
+    'double precision' => 'float',
+    'boolean'          => 'bool',
+  }
+
+  # TSV and NDJSON files are split into ranges of this many bytes, scanned by
+  # parallel workers
+  PARTITION_SIZE = 64 * 1024 * 1024
+
+  # Planner guesses: the size of a record, and the cost of parsing it
+  BYTES_PER_ROW = 100.0
+  PER_ROW_COST = 0.005
+
+  TRUTHY = ['true', 'on', 'yes', '1']
+
+  def self.files(env)
+    pattern = env.fetch('path') { raise ArgumentError, 'path not provided' }
+    HolycornFile.glob(pattern)
+  end
+
+  # The format option, or the one of the file's extension
+  def self.format(env, path)
+    format = env['format']
+    if format
+      raise ArgumentError, "unknown format #{format}" unless ['csv', 'tsv', 'ndjson'].include?(format)
+      return format
+    end
+
+    dot = path.rindex('.')
+    format = EXTENSIONS[dot ? path[dot..-1].downcase : '']
+    raise ArgumentError, "unknown format of #{path}, set the format option" unless format
+    format
+  end
+
+  def self.delimiter(env, format)
+    delimiter = env['delimiter'] || DELIMITERS[format]
+    raise ArgumentError, 'the delimiter must be a single character' if delimiter && delimiter.size != 1
+    delimiter
+  end
+
+  # [path, start, stop] byte ranges, stop being nil for the end of the file
+  def self.partitions(env)
+    units = []
+    files(env).each do |path|
+      size = HolycornFile.size(path)
+
+      if format(env, path) == 'csv' || size <= PARTITION_SIZE
+        units << [path, 0, nil]
+        next
+      end
+
+      start = 0
+      while start < size
+        units << [path, start, start + PARTITION_SIZE]
+        start += PARTITION_SIZE
+      end
+    end
+    units
+  end
+
+  def self.estimate(env, quals)
+    bytes = files(env).inject(0) { |sum, path| sum + HolycornFile.size(path) }
+    { 'rows' => (bytes / BYTES_PER_ROW).ceil, 'startup_cost' => 0.0, 'per_row_cost' => PER_ROW_COST }
+  end
+
+  # Files are parsed in C, which turns only the fields of the columns the query
+  # uses into Ruby values: Integers, Floats and booleans for the columns of
+  # these types, Strings otherwise.
+  #
+  # Fields of CSV and TSV files go to the columns of the same name in the
+  # header (with header 'true') or in the fields option, or else to the
+  # columns in table order. NDJSON values go to the columns of their key.
+  def initialize(env = {})
+    @env = env
+    @header = TRUTHY.include?(env['header'].to_s.downcase)
+    @mmap = TRUTHY.include?(env['mmap'].to_s.downcase)
+    @fields = env['fields'] ? env['fields'].split(',').map(&:strip) : nil
+    @attributes = env['attributes'] || []
+    @columns = env['columns'] || @attributes.compact.map(&:first)
+    @names = {}
+    rewind(env)
+  end
+
+  def rewind(env)
+    close_reader
+    @units = nil
+  end
+
+  def partition(unit)
+    close_reader
+    @units = [unit]
+  end
+
+  def each_batch(n)
+    # Scans that don't claim partitions read them all
+    @units ||= HolycornFile.partitions(@env)
+
+    loop do
+      unless @reader
+        unit = @units.shift
+        return nil unless unit
+        @reader = open(*unit)
+      end
+
+      rows = @reader.read(n)
+      return rows if rows
+
+      close_reader
+    end
+  end
+
+  def self.import_schema(args)
+    path = files(args).first
+    raise ArgumentError, "no file matches #{args['path']}" unless path
+
+    format = format(args, path)
+    unless format != 'ndjson' && TRUTHY.include?(args['header'].to_s.downcase)
+      raise ArgumentError, 'IMPORT FOREIGN SCHEMA needs CSV or TSV files with a header'
+    end
+
+    reader = Reader.new(path, format, delimiter(args, format), 0, nil)
+    names = reader.fields || []
+    reader.close
+
+    columns = names.map { |name| "\"#{name.gsub('"', '""')}\" text" }.join("\n        , ")
+    options = ['path', 'format', 'header', 'delimiter'].select { |key| args[key] }.map do |key|
+      ", #{key} '#{args[key].gsub("'", "''")}'"
+    end.join("\n\t        ")
+<<-SCHEMA
+	CREATE FOREIGN TABLE #{args['local_schema']}.#{args['prefix']}file_table
+        ( #{columns}
+        )
+	SERVER #{args['server_name']}
+	OPTIONS ( wrapper_class 'HolycornFile'
+	        #{options}
+	);
+SCHEMA
+  end
+
+  private
+
+  def close_reader
+    @reader.close if @reader
+    @reader = nil
+  end
+
+  def open(path, start, stop)
+    format = HolycornFile.format(@env, path)
+    reader = Reader.new(path, format, HolycornFile.delimiter(@env, format), start, stop, @mmap)
+
+    names = nil
+    if format != 'ndjson' && @header
+      # Ranges after the first one don't start with the header
+      names = start == 0 ? reader.fields : header(path, format)
+    end
+    names = @fields if @fields && format != 'ndjson'
+
+    reader.layout(layout(format, names), @attributes.size)
+    reader
+  end
+
+  def header(path, format)
+    @names[path] ||= begin
+      reader = Reader.new(path, format, HolycornFile.delimiter(@env, format), 0, nil)
+      names = reader.fields
+      reader.close
+      names
+    end
+  end
+
+  # [source, position, kind] of the columns the query uses, the source being
+  # the index of the field or the key of the value. Columns missing from the
+  # file are NULL.
+  def layout(format, names)
+    layout = []
+    index = 0
+
+    @attributes.each_with_index do |attribute, position|
+      next unless attribute
+
+      name, type = attribute
+      source = if format == 'ndjson'
+                 name
+               elsif names
+                 names.index(name)
+               else
+                 index
+               end
+      index += 1
+
+      next unless source && @columns.include?(name)
+      layout << [source, position, KINDS[type] || 'text']
+    end
+    layout
+  end
+end
@@ -0,0 +1,1098 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "mruby/array.h"
+#include "mruby/class.h"
+#include "mruby/data.h"
+#include "mruby/string.h"
+#include "holycorn_file.h"
+
+/* Size of the first read when files are streamed rather than mapped */
+#define STREAM_CHUNK (1024 * 1024)
+
+/* Longest number parsed in C, longer ones are left to PostgreSQL */
+#define NUMBER_LEN 64
+
+typedef enum FileFormat {
+  FORMAT_CSV,
+  FORMAT_TSV,
+  FORMAT_NDJSON
+} FileFormat;
+
+/* How values are handed to the scan, from the type of their column */
+typedef enum ValueKind {
+  KIND_TEXT,   /* String, parsed by the column's input function if needed */
+  KIND_INT,    /* Integer when it fits a fixnum */
+  KIND_FLOAT,
+  KIND_BOOL
+} ValueKind;
+
+/* A column the query uses, and where its value comes from */
+typedef struct FileColumn {
+  mrb_int   field;     /* CSV/TSV: index of the field */
+  char      *key;      /* NDJSON: key of the value */
+  size_t    key_len;
+  mrb_int   position;  /* index of the value in rows */
+  ValueKind kind;
+} FileColumn;
+
+/*
+ * Reads the records of a file that start in [start, stop). Files are read
+ * through a buffer that grows to hold the longest record, or mapped as a
+ * whole when asked to: reading a mapped page the file no longer has (it was
+ * truncated) raises SIGBUS, which crashes the backend.
+ */
+typedef struct FileReader {
+  char        *path;
+  int         fd;
+  FileFormat  format;
+  char        delimiter;
+
+  char        *data;
+  size_t      len;       /* bytes of the file in data */
+  size_t      pos;       /* start of the next record in data */
+  off_t       offset;    /* offset of data[0] in the file */
+  off_t       stop;
+  size_t      capacity;  /* of the buffer */
+  mrb_bool    mapped;
+  mrb_bool    eof;       /* data ends with the end of the file */
+  mrb_bool    done;
+
+  FileColumn  *columns;
+  mrb_int     ncolumns;
+  mrb_int     width;     /* number of values of rows */
+  mrb_int     *fields;   /* CSV/TSV: index in columns of each field, or -1 */
+  mrb_int     nfields;
+
+  char        *scratch;  /* unescaped values */
+  size_t      scratch_len;
+  size_t      scratch_capacity;
+} FileReader;
+
+static void reader_free(mrb_state *mrb, void *ptr);
+
+static const struct mrb_data_type reader_type = {
+  "HolycornFile::Reader", reader_free
+};
+
+static void reader_close(mrb_state *mrb, FileReader *reader) {
+  if (reader->data != NULL) {
+    if (reader->mapped)
+      munmap(reader->data, reader->len);
+    else
+      mrb_free(mrb, reader->data);
+    reader->data = NULL;
+  }
+
+  if (reader->fd >= 0) {
+    close(reader->fd);
+    reader->fd = -1;
+  }
+}
+
+static void reader_free(mrb_state *mrb, void *ptr) {
+  FileReader *reader = (FileReader *) ptr;
+
+  reader_close(mrb, reader);
+  for (mrb_int i = 0; i < reader->ncolumns; i++)
+    mrb_free(mrb, reader->columns[i].key);
+  mrb_free(mrb, reader->columns);
+  mrb_free(mrb, reader->fields);
+  mrb_free(mrb, reader->scratch);
+  mrb_free(mrb, reader->path);
+  mrb_free(mrb, reader);
+}
+
+static FileReader *get_reader(mrb_state *mrb, mrb_value self) {
+  FileReader *reader = (FileReader *) mrb_data_get_ptr(mrb, self, &reader_type);
+
+  if (reader == NULL || reader->fd < 0)
+    mrb_raise(mrb, E_RUNTIME_ERROR, "closed reader");
+
+  return reader;
+}
+
+static void raise_errno(mrb_state *mrb, const char *action, const char *path) {
+  mrb_raisef(mrb, E_RUNTIME_ERROR, "could not %S %S: %S",
+      mrb_str_new_cstr(mrb, action), mrb_str_new_cstr(mrb, path), mrb_str_new_cstr(mrb, strerror(errno)));
+}
+
+/*
+ * First of a or b in [p, end), or NULL. This is where parsing spends its
+ * time, so SSE2 compares 16 bytes at once when the compiler targets it.
+ */
+static const char *find2(const char *p, const char *end, char a, char b) {
+#ifdef __SSE2__
+  __m128i va = _mm_set1_epi8(a);
+  __m128i vb = _mm_set1_epi8(b);
+
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *) p);
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)));
+
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+
+  for (; p < end; p++) {
+    if (*p == a || *p == b)
+      return p;
+  }
+
+  return NULL;
+}
+
+/*
+ * Raises an error when a mapped file was truncated, before its missing pages
+ * are read. This only narrows the window: the file may still be truncated
+ * while a batch is being read.
+ */
+static void reader_check_size(mrb_state *mrb, FileReader *reader) {
+  struct stat st;
+
+  if (!reader->mapped)
+    return;
+
+  if (fstat(reader->fd, &st) < 0)
+    raise_errno(mrb, "stat", reader->path);
+  if ((uintmax_t) st.st_size < (uintmax_t) reader->len)
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "%S was truncated while being read", mrb_str_new_cstr(mrb, reader->path));
+}
+
+/* Reads more of the file into the buffer. False at the end of the file. */
+static mrb_bool reader_fill(mrb_state *mrb, FileReader *reader) {
+  ssize_t n;
+
+  if (reader->mapped || reader->eof)
+    return FALSE;
+
+  if (reader->pos > 0) {
+    memmove(reader->data, reader->data + reader->pos, reader->len - reader->pos);
+    reader->offset += reader->pos;
+    reader->len -= reader->pos;
+    reader->pos = 0;
+  }
+
+  if (reader->len == reader->capacity) {
+    reader->capacity *= 2;
+    reader->data = (char *) mrb_realloc(mrb, reader->data, reader->capacity);
+  }
+
+  do {
+    n = read(reader->fd, reader->data + reader->len, reader->capacity - reader->len);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0)
+    raise_errno(mrb, "read", reader->path);
+
+  if (n == 0) {
+    reader->eof = TRUE;
+    return FALSE;
+  }
+
+  reader->len += n;
+  return TRUE;
+}
+
+/* Moves past the end of the current line: partitions start on a new line */
+static void reader_skip_line(mrb_state *mrb, FileReader *reader) {
+  for (;;) {
+    const char *nl = memchr(reader->data + reader->pos, '\n', reader->len - reader->pos);
+
+    if (nl != NULL) {
+      reader->pos = nl - reader->data + 1;
+      return;
+    }
+
+    reader->pos = reader->len;
+    if (!reader_fill(mrb, reader))
+      return;
+  }
+}
+
+/*
+ * End of the record starting at p: its newline, NULL when data doesn't hold
+ * all of it. Quoted CSV fields may contain newlines.
+ */
+static const char *record_end(FileReader *reader, const char *p, const char *end) {
+  mrb_bool quoted = FALSE;
+
+  if (reader->format != FORMAT_CSV)
+    return memchr(p, '\n', end - p);
+
+  for (;;) {
+    p = quoted ? memchr(p, '"', end - p) : find2(p, end, '"', '\n');
+    if (p == NULL)
+      return NULL;
+
+    if (*p == '\n')
+      return p;
+
+    /* Doubled quotes inside quoted fields toggle twice */
+    quoted = !quoted;
+    p++;
+  }
+}
+
+static void scratch_reset(FileReader *reader) {
+  reader->scratch_len = 0;
+}
+
+static void scratch_append(mrb_state *mrb, FileReader *reader, const char *p, size_t len) {
+  if (reader->scratch_len + len > reader->scratch_capacity) {
+    size_t capacity = reader->scratch_capacity ? reader->scratch_capacity : 256;
+
+    while (capacity < reader->scratch_len + len)
+      capacity *= 2;
+    reader->scratch = (char *) mrb_realloc(mrb, reader->scratch, capacity);
+    reader->scratch_capacity = capacity;
+  }
+
+  memcpy(reader->scratch + reader->scratch_len, p, len);
+  reader->scratch_len += len;
+}
+
+static mrb_bool parse_int(const char *p, size_t len, mrb_int *result) {
+  const char *end = p + len;
+  mrb_bool negative = FALSE;
+  mrb_int value = 0;
+
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+
+  if (p == end)
+    return FALSE;
+
+  for (; p < end; p++) {
+    int digit = *p - '0';
+
+    if (digit < 0 || digit > 9)
+      return FALSE;
+
+    if (negative) {
+      if (value < (MRB_INT_MIN + digit) / 10)
+        return FALSE;
+      value = value * 10 - digit;
+    } else {
+      if (value > (MRB_INT_MAX - digit) / 10)
+        return FALSE;
+      value = value * 10 + digit;
+    }
+  }
+
+  *result = value;
+  return TRUE;
+}
+
+static mrb_bool parse_float(const char *p, size_t len, double *result) {
+  char buffer[NUMBER_LEN];
+  char *end;
+
+  if (len == 0 || len >= NUMBER_LEN)
+    return FALSE;
+
+  memcpy(buffer, p, len);
+  buffer[len] = '\0';
+  *result = strtod(buffer, &end);
+
+  return end == buffer + len;
+}
+
+static mrb_bool parse_bool(const char *p, size_t len, mrb_bool *result) {
+  static const char *truthy[] = {"t", "true", "y", "yes", "on", "1"};
+  static const char *falsy[] = {"f", "false", "n", "no", "off", "0"};
+
+  for (size_t i = 0; i < sizeof(truthy) / sizeof(truthy[0]); i++) {
+    if (strlen(truthy[i]) == len && strncasecmp(p, truthy[i], len) == 0) {
+      *result = TRUE;
+      return TRUE;
+    }
+    if (strlen(falsy[i]) == len && strncasecmp(p, falsy[i], len) == 0) {
+      *result = FALSE;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/*
+ * The value of a column out of its text. Numbers and booleans are immediate
+ * values; text that doesn't parse is handed over as a String, for the type's
+ * input function to accept or reject.
+ */
+static mrb_value make_value(mrb_state *mrb, ValueKind kind, const char *p, size_t len) {
+  mrb_int i;
+  double d;
+  mrb_bool b;
+
+  switch (kind) {
+    case KIND_INT:
+      if (parse_int(p, len, &i))
+        return mrb_fixnum_value(i);
+      break;
+    case KIND_FLOAT:
+      if (parse_float(p, len, &d))
+        return mrb_float_value(mrb, d);
+      break;
+    case KIND_BOOL:
+      if (parse_bool(p, len, &b))
+        return mrb_bool_value(b);
+      break;
+    case KIND_TEXT:
+      break;
+  }
+
+  return mrb_str_new(mrb, p, len);
+}
+
+/*
+ * Splits a CSV record (without its newline) into fields, calling emit for
+ * those in columns (or all of them when reader is NULL). Unquoted empty
+ * fields are NULL, quoted ones are empty strings.
+ */
+typedef void (*EmitFn)(mrb_state *mrb, FileReader *reader, mrb_value row, mrb_int field,
+    const char *p, size_t len, mrb_bool null);
+
+static void split_csv(mrb_state *mrb, FileReader *reader, mrb_value row, const char *p, const char *end,
+    char delimiter, mrb_int nfields, EmitFn emit) {
+  for (mrb_int field = 0; field < nfields; field++) {
+    mrb_bool wanted = reader->fields == NULL || reader->fields[field] >= 0;
+
+    if (p < end && *p == '"') {
+      const char *start = ++p;
+      const char *segment = start;
+      const char *stop;
+      mrb_bool escaped = FALSE;
+
+      scratch_reset(reader);
+      for (;;) {
+        const char *quote = memchr(p, '"', end - p);
+
+        /* Unterminated fields run to the end of the record */
+        if (quote == NULL) {
+          stop = p = end;
+          break;
+        }
+
+        if (quote + 1 < end && quote[1] == '"') {
+          if (wanted)
+            scratch_append(mrb, reader, segment, quote + 1 - segment);
+          segment = p = quote + 2;
+          escaped = TRUE;
+          continue;
+        }
+
+        stop = quote;
+        p = quote + 1;
+        break;
+      }
+
+      if (wanted && escaped) {
+        scratch_append(mrb, reader, segment, stop - segment);
+        emit(mrb, reader, row, field, reader->scratch, reader->scratch_len, FALSE);
+      } else if (wanted) {
+        emit(mrb, reader, row, field, start, stop - start, FALSE);
+      }
+
+      /* Anything between the closing quote and the delimiter is ignored */
+      p = memchr(p, delimiter, end - p);
+    } else {
+      const char *next = memchr(p, delimiter, end - p);
+      const char *stop = next ? next : end;
+
+      if (wanted)
+        emit(mrb, reader, row, field, p, stop - p, stop == p);
+      p = next;
+    }
+
+    if (p == NULL)
+      return;
+    p++;
+  }
+}
+
+/*
+ * Same for TSV, in PostgreSQL's text format: \N is NULL, and \t, \n, \r and
+ * \\ are escapes.
+ */
+static void split_tsv(mrb_state *mrb, FileReader *reader, mrb_value row, const char *p, const char *end,
+    char delimiter, mrb_int nfields, EmitFn emit) {
+  for (mrb_int field = 0; field < nfields; field++) {
+    const char *start = p;
+    const char *stop;
+    mrb_bool escaped = FALSE;
+
+    for (;;) {
+      stop = find2(p, end, delimiter, '\\');
+      if (stop == NULL || *stop == delimiter)
+        break;
+      escaped = TRUE;
+      p = stop + 2 < end ? stop + 2 : end;
+    }
+    if (stop == NULL)
+      stop = end;
+
+    if (reader->fields == NULL || reader->fields[field] >= 0) {
+      if (!escaped) {
+        emit(mrb, reader, row, field, start, stop - start, FALSE);
+      } else if (stop - start == 2 && start[1] == 'N') {
+        emit(mrb, reader, row, field, start, 0, TRUE);
+      } else {
+        scratch_reset(reader);
+        for (const char *c = start; c < stop; c++) {
+          char unescaped = *c;
+
+          if (*c == '\\' && c + 1 < stop) {
+            c++;
+            switch (*c) {
+              case 't': unescaped = '\t'; break;
+              case 'n': unescaped = '\n'; break;
+              case 'r': unescaped = '\r'; break;
+              default:  unescaped = *c; break;
+            }
+          }
+          scratch_append(mrb, reader, &unescaped, 1);
+        }
+        emit(mrb, reader, row, field, reader->scratch, reader->scratch_len, FALSE);
+      }
+    }
+
+    if (stop == end)
+      return;
+    p = stop + 1;
+  }
+}
+
+static void emit_column(mrb_state *mrb, FileReader *reader, mrb_value row, mrb_int field,
+    const char *p, size_t len, mrb_bool null) {
+  FileColumn *column = &reader->columns[reader->fields[field]];
+
+  if (!null)
+    mrb_ary_set(mrb, row, column->position, make_value(mrb, column->kind, p, len));
+}
+
+static void emit_string(mrb_state *mrb, FileReader *reader, mrb_value row, mrb_int field,
+    const char *p, size_t len, mrb_bool null) {
+  mrb_ary_set(mrb, row, field, null ? mrb_nil_value() : mrb_str_new(mrb, p, len));
+}
+
+static void json_error(mrb_state *mrb, FileReader *reader, const char *p) {
+  mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid JSON in %S at byte %S",
+      mrb_str_new_cstr(mrb, reader->path),
+      mrb_float_value(mrb, (double) (reader->offset + (p - reader->data))));
+}
+
+static const char *json_space(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+    p++;
+  return p;
+}
+
+static void scratch_append_utf8(mrb_state *mrb, FileReader *reader, unsigned long c) {
+  char utf8[4];
+  size_t len;
+
+  if (c < 0x80) {
+    utf8[0] = (char) c;
+    len = 1;
+  } else if (c < 0x800) {
+    utf8[0] = (char) (0xC0 | (c >> 6));
+    utf8[1] = (char) (0x80 | (c & 0x3F));
+    len = 2;
+  } else if (c < 0x10000) {
+    utf8[0] = (char) (0xE0 | (c >> 12));
+    utf8[1] = (char) (0x80 | ((c >> 6) & 0x3F));
+    utf8[2] = (char) (0x80 | (c & 0x3F));
+    len = 3;
+  } else {
+    utf8[0] = (char) (0xF0 | (c >> 18));
+    utf8[1] = (char) (0x80 | ((c >> 12) & 0x3F));
+    utf8[2] = (char) (0x80 | ((c >> 6) & 0x3F));
+    utf8[3] = (char) (0x80 | (c & 0x3F));
+    len = 4;
+  }
+
+  scratch_append(mrb, reader, utf8, len);
+}
+
+static mrb_bool json_hex4(const char *p, const char *end, unsigned long *result) {
+  char hex[5];
+  char *stop;
+
+  if (end - p < 4)
+    return FALSE;
+
+  memcpy(hex, p, 4);
+  hex[4] = '\0';
+  *result = strtoul(hex, &stop, 16);
+
+  return stop == hex + 4;
+}
+
+/*
+ * Parses the JSON string at p (on its opening quote). Strings without escapes
+ * are pointed to in place, others are unescaped into the scratch buffer.
+ * Returns what follows the closing quote.
+ */
+static const char *json_string(mrb_state *mrb, FileReader *reader, const char *p, const char *end,
+    const char **value, size_t *len) {
+  const char *start = ++p;
+  const char *c = find2(p, end, '"', '\\');
+
+  if (c == NULL)
+    json_error(mrb, reader, start - 1);
+
+  if (*c == '"') {
+    *value = start;
+    *len = c - start;
+    return c + 1;
+  }
+
+  scratch_reset(reader);
+  for (;;) {
+    unsigned long code, low;
+
+    c = find2(p, end, '"', '\\');
+    if (c == NULL)
+      json_error(mrb, reader, start - 1);
+
+    scratch_append(mrb, reader, p, c - p);
+    if (*c == '"')
+      break;
+
+    if (c + 1 >= end)
+      json_error(mrb, reader, c);
+
+    p = c + 2;
+    switch (c[1]) {
+      case 'b': scratch_append(mrb, reader, "\b", 1); break;
+      case 'f': scratch_append(mrb, reader, "\f", 1); break;
+      case 'n': scratch_append(mrb, reader, "\n", 1); break;
+      case 'r': scratch_append(mrb, reader, "\r", 1); break;
+      case 't': scratch_append(mrb, reader, "\t", 1); break;
+      case 'u':
+        if (!json_hex4(p, end, &code))
+          json_error(mrb, reader, c);
+        p += 4;
+
+        /* Characters beyond the BMP are UTF-16 surrogate pairs */
+        if (code >= 0xD800 && code <= 0xDBFF && end - p >= 6 && p[0] == '\\' && p[1] == 'u' &&
+            json_hex4(p + 2, end, &low) && low >= 0xDC00 && low <= 0xDFFF) {
+          code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+          p += 6;
+        }
+        scratch_append_utf8(mrb, reader, code);
+        break;
+      default:
+        scratch_append(mrb, reader, c + 1, 1);
+        break;
+    }
+  }
+
+  *value = reader->scratch;
+  *len = reader->scratch_len;
+  return c + 1;
+}
+
+/* Returns what follows the JSON value at p, without building it */
+static const char *json_skip(mrb_state *mrb, FileReader *reader, const char *p, const char *end) {
+  int depth = 0;
+
+  do {
+    const char *value;
+    size_t len;
+
+    p = json_space(p, end);
+    if (p == end)
+      json_error(mrb, reader, p);
+
+    switch (*p) {
+      case '"':
+        p = json_string(mrb, reader, p, end, &value, &len);
+        break;
+      case '{':
+      case '[':
+        depth++;
+        p++;
+        break;
+      case '}':
+      case ']':
+        depth--;
+        p++;
+        break;
+      case ',':
+      case ':':
+        if (depth == 0)
+          json_error(mrb, reader, p);
+        p++;
+        break;
+      default:
+        while (p < end && !strchr(",:{}[]\" \t\r\n", *p))
+          p++;
+        break;
+    }
+  } while (depth > 0);
+
+  return p;
+}
+
+/*
+ * Parses the value at p into the column. Objects and arrays are handed over
+ * as their JSON text, for json and jsonb columns.
+ */
+static const char *json_value(mrb_state *mrb, FileReader *reader, FileColumn *column, mrb_value row,
+    const char *p, const char *end) {
+  const char *value, *next;
+  size_t len;
+
+  switch (*p) {
+    case '"':
+      next = json_string(mrb, reader, p, end, &value, &len);
+      mrb_ary_set(mrb, row, column->position, make_value(mrb, column->kind, value, len));
+      return next;
+    case '{':
+    case '[':
+      next = json_skip(mrb, reader, p, end);
+      mrb_ary_set(mrb, row, column->position, mrb_str_new(mrb, p, next - p));
+      return next;
+    case 't':
+    case 'f':
+    case 'n':
+      next = json_skip(mrb, reader, p, end);
+      if (next - p == 4 && strncmp(p, "true", 4) == 0)
+        mrb_ary_set(mrb, row, column->position, mrb_true_value());
+      else if (next - p == 5 && strncmp(p, "false", 5) == 0)
+        mrb_ary_set(mrb, row, column->position, mrb_false_value());
+      else if (next - p != 4 || strncmp(p, "null", 4) != 0)
+        json_error(mrb, reader, p);
+      return next;
+    default:
+      next = json_skip(mrb, reader, p, end);
+      /* Numbers go to boolean columns as Integers */
+      mrb_ary_set(mrb, row, column->position,
+          make_value(mrb, column->kind == KIND_BOOL ? KIND_INT : column->kind, p, next - p));
+      return next;
+  }
+}
+
+/* Fills row out of the JSON object of a record. False for blank lines. */
+static mrb_bool parse_ndjson(mrb_state *mrb, FileReader *reader, mrb_value row, const char *p, const char *end) {
+  p = json_space(p, end);
+  if (p == end)
+    return FALSE;
+
+  if (*p != '{')
+    json_error(mrb, reader, p);
+  p = json_space(p + 1, end);
+
+  if (p < end && *p == '}')
+    return TRUE;
+
+  for (;;) {
+    FileColumn *column = NULL;
+    const char *key;
+    size_t key_len;
+
+    if (p == end || *p != '"')
+      json_error(mrb, reader, p);
+    p = json_string(mrb, reader, p, end, &key, &key_len);
+
+    for (mrb_int i = 0; i < reader->ncolumns; i++) {
+      if (reader->columns[i].key_len == key_len && memcmp(reader->columns[i].key, key, key_len) == 0) {
+        column = &reader->columns[i];
+        break;
+      }
+    }
+
+    p = json_space(p, end);
+    if (p == end || *p != ':')
+      json_error(mrb, reader, p);
+    p = json_space(p + 1, end);
+    if (p == end)
+      json_error(mrb, reader, p);
+
+    p = column ? json_value(mrb, reader, column, row, p, end) : json_skip(mrb, reader, p, end);
+
+    p = json_space(p, end);
+    if (p < end && *p == '}')
+      return TRUE;
+    if (p == end || *p != ',')
+      json_error(mrb, reader, p);
+    p = json_space(p + 1, end);
+  }
+}
+
+/*
+ * Finds the next record of the reader's range: sets p and end around it
+ * (without its newline) and moves past it. False once there are none left.
+ */
+static mrb_bool next_record(mrb_state *mrb, FileReader *reader, const char **p, const char **end) {
+  for (;;) {
+    const char *start, *stop;
+
+    if (reader->done || reader->offset + (off_t) reader->pos >= reader->stop) {
+      reader->done = TRUE;
+      return FALSE;
+    }
+
+    start = reader->data + reader->pos;
+    stop = record_end(reader, start, reader->data + reader->len);
+
+    if (stop == NULL) {
+      if (reader_fill(mrb, reader))
+        continue;
+
+      /* The last record may have no newline */
+      if (reader->pos == reader->len) {
+        reader->done = TRUE;
+        return FALSE;
+      }
+      start = reader->data + reader->pos;
+      stop = reader->data + reader->len;
+      reader->pos = reader->len;
+    } else {
+      reader->pos = stop - reader->data + 1;
+    }
+
+    if (stop > start && stop[-1] == '\r')
+      stop--;
+
+    *p = start;
+    *end = stop;
+    return TRUE;
+  }
+}
+
+static off_t to_offset(mrb_state *mrb, mrb_value value, off_t default_value) {
+  if (mrb_nil_p(value))
+    return default_value;
+  if (mrb_fixnum_p(value))
+    return (off_t) mrb_fixnum(value);
+  return (off_t) mrb_to_flo(mrb, value);
+}
+
+/*
+ * HolycornFile::Reader.new(path, format, delimiter, start, stop, map = false):
+ * map the file rather than read it, which only files that aren't truncated
+ * while they are read can be.
+ */
+static mrb_value reader_initialize(mrb_state *mrb, mrb_value self) {
+  char *path, *format;
+  mrb_value delimiter, start_value, stop_value;
+  mrb_bool map = FALSE;
+  FileReader *reader;
+  struct stat st;
+  off_t start;
+
+  mrb_get_args(mrb, "zzooo|b", &path, &format, &delimiter, &start_value, &stop_value, &map);
+
+  reader = (FileReader *) DATA_PTR(self);
+  if (reader != NULL)
+    reader_free(mrb, reader);
+  mrb_data_init(self, NULL, &reader_type);
+
+  reader = (FileReader *) mrb_calloc(mrb, 1, sizeof(FileReader));
+  reader->fd = -1;
+  reader->path = (char *) mrb_malloc(mrb, strlen(path) + 1);
+  strcpy(reader->path, path);
+  mrb_data_init(self, reader, &reader_type);
+
+  if (strcmp(format, "csv") == 0)
+    reader->format = FORMAT_CSV;
+  else if (strcmp(format, "tsv") == 0)
+    reader->format = FORMAT_TSV;
+  else if (strcmp(format, "ndjson") == 0)
+    reader->format = FORMAT_NDJSON;
+  else
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown format %S", mrb_str_new_cstr(mrb, format));
+
+  if (mrb_string_p(delimiter) && RSTRING_LEN(delimiter) == 1)
+    reader->delimiter = RSTRING_PTR(delimiter)[0];
+  else if (reader->format != FORMAT_NDJSON)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "the delimiter must be a single character");
+
+  reader->fd = open(path, O_RDONLY);
+  if (reader->fd < 0)
+    raise_errno(mrb, "open", path);
+  if (fstat(reader->fd, &st) < 0)
+    raise_errno(mrb, "stat", path);
+
+  start = to_offset(mrb, start_value, 0);
+  reader->stop = to_offset(mrb, stop_value, st.st_size);
+  if (reader->stop > st.st_size)
+    reader->stop = st.st_size;
+
+  /* Big files may not fit the address space of 32-bit builds: they're streamed */
+  if (map && st.st_size > 0 && (uintmax_t) st.st_size <= (uintmax_t) SIZE_MAX) {
+    void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+
+    if (data != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+      madvise(data, (size_t) st.st_size, MADV_SEQUENTIAL);
+#endif
+      reader->data = (char *) data;
+      reader->len = (size_t) st.st_size;
+      reader->mapped = TRUE;
+      reader->eof = TRUE;
+    }
+  }
+
+  if (!reader->mapped) {
+    reader->capacity = STREAM_CHUNK;
+    reader->data = (char *) mrb_malloc(mrb, reader->capacity);
+    reader->eof = st.st_size == 0;
+  }
+
+  if (start > 0 && start < reader->stop) {
+    /* Records are those starting in the range: skip the one it starts in */
+    if (reader->mapped) {
+      reader->pos = (size_t) (start - 1);
+    } else {
+      if (lseek(reader->fd, start - 1, SEEK_SET) < 0)
+        raise_errno(mrb, "seek", path);
+      reader->offset = start - 1;
+    }
+    reader_skip_line(mrb, reader);
+  } else if (start > 0) {
+    reader->done = TRUE;
+  }
+
+  return self;
+}
+
+/*
+ * #layout(columns, width): columns are [source, position, kind] arrays, the
+ * source being the index of the field (CSV, TSV) or its key (NDJSON), and
+ * kind one of "text", "int", "float" and "bool". Rows have width values.
+ */
+static mrb_value reader_layout(mrb_state *mrb, mrb_value self) {
+  FileReader *reader = get_reader(mrb, self);
+  mrb_value columns;
+  mrb_int width;
+
+  mrb_get_args(mrb, "Ai", &columns, &width);
+
+  for (mrb_int i = 0; i < reader->ncolumns; i++)
+    mrb_free(mrb, reader->columns[i].key);
+  mrb_free(mrb, reader->columns);
+  mrb_free(mrb, reader->fields);
+  reader->fields = NULL;
+  reader->nfields = 0;
+
+  reader->ncolumns = RARRAY_LEN(columns);
+  reader->columns = (FileColumn *) mrb_calloc(mrb, reader->ncolumns ? reader->ncolumns : 1, sizeof(FileColumn));
+  reader->width = width;
+
+  for (mrb_int i = 0; i < reader->ncolumns; i++) {
+    mrb_value spec = mrb_ary_entry(columns, i);
+    FileColumn *column = &reader->columns[i];
+    mrb_value source;
+    const char *kind;
+
+    if (!mrb_array_p(spec) || RARRAY_LEN(spec) != 3)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "columns must be [source, position, kind] arrays");
+
+    source = mrb_ary_entry(spec, 0);
+    column->position = mrb_fixnum(mrb_to_int(mrb, mrb_ary_entry(spec, 1)));
+    if (column->position < 0 || column->position >= width)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "column position out of the row");
+
+    kind = mrb_str_to_cstr(mrb, mrb_ary_entry(spec, 2));
+    if (strcmp(kind, "int") == 0)
+      column->kind = KIND_INT;
+    else if (strcmp(kind, "float") == 0)
+      column->kind = KIND_FLOAT;
+    else if (strcmp(kind, "bool") == 0)
+      column->kind = KIND_BOOL;
+    else
+      column->kind = KIND_TEXT;
+
+    if (reader->format == FORMAT_NDJSON) {
+      source = mrb_str_to_str(mrb, source);
+      column->key_len = RSTRING_LEN(source);
+      column->key = (char *) mrb_malloc(mrb, column->key_len + 1);
+      memcpy(column->key, RSTRING_PTR(source), column->key_len);
+    } else {
+      column->field = mrb_fixnum(mrb_to_int(mrb, source));
+      if (column->field < 0)
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "field indexes must be positive");
+      if (column->field >= reader->nfields)
+        reader->nfields = column->field + 1;
+    }
+  }
+
+  /* Fields past the last one used are never split */
+  if (reader->format != FORMAT_NDJSON) {
+    reader->fields = (mrb_int *) mrb_malloc(mrb, sizeof(mrb_int) * (reader->nfields ? reader->nfields : 1));
+    for (mrb_int i = 0; i < reader->nfields; i++)
+      reader->fields[i] = -1;
+    for (mrb_int i = 0; i < reader->ncolumns; i++)
+      reader->fields[reader->columns[i].field] = i;
+  }
+
+  return self;
+}
+
+/*
+ * #read(n): up to n rows, nil once the range has been read. Only the fields of
+ * the layout's columns are turned into Ruby values.
+ */
+static mrb_value reader_read(mrb_state *mrb, mrb_value self) {
+  FileReader *reader = get_reader(mrb, self);
+  mrb_int n;
+  mrb_value rows;
+  int ai;
+
+  mrb_get_args(mrb, "i", &n);
+
+  if (reader->columns == NULL)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "#layout must be called before #read");
+
+  reader_check_size(mrb, reader);
+
+  rows = mrb_ary_new_capa(mrb, n);
+  ai = mrb_gc_arena_save(mrb);
+
+  while (RARRAY_LEN(rows) < n) {
+    const char *p, *end;
+    mrb_value row;
+    mrb_bool keep;
+
+    if (!next_record(mrb, reader, &p, &end))
+      break;
+
+    row = mrb_ary_new_capa(mrb, reader->width);
+    if (reader->width > 0)
+      mrb_ary_set(mrb, row, reader->width - 1, mrb_nil_value());
+
+    /* Blank lines are no records */
+    keep = p < end;
+    switch (reader->format) {
+      case FORMAT_CSV:
+        if (keep)
+          split_csv(mrb, reader, row, p, end, reader->delimiter, reader->nfields, emit_column);
+        break;
+      case FORMAT_TSV:
+        if (keep)
+          split_tsv(mrb, reader, row, p, end, reader->delimiter, reader->nfields, emit_column);
+        break;
+      case FORMAT_NDJSON:
+        keep = parse_ndjson(mrb, reader, row, p, end);
+        break;
+    }
+
+    if (keep)
+      mrb_ary_push(mrb, rows, row);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+  return RARRAY_LEN(rows) == 0 ? mrb_nil_value() : rows;
+}
+
+/* #fields: the fields of the next CSV or TSV record as Strings (for headers) */
+static mrb_value reader_fields(mrb_state *mrb, mrb_value self) {
+  FileReader *reader = get_reader(mrb, self);
+  mrb_int *fields = reader->fields;
+  const char *p, *end;
+  mrb_value row;
+
+  if (reader->format == FORMAT_NDJSON)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "NDJSON records have no fields");
+
+  reader_check_size(mrb, reader);
+  if (!next_record(mrb, reader, &p, &end))
+    return mrb_nil_value();
+
+  row = mrb_ary_new(mrb);
+  reader->fields = NULL;
+  if (reader->format == FORMAT_CSV)
+    split_csv(mrb, reader, row, p, end, reader->delimiter, MRB_INT_MAX, emit_string);
+  else
+    split_tsv(mrb, reader, row, p, end, reader->delimiter, MRB_INT_MAX, emit_string);
+  reader->fields = fields;
+
+  return row;
+}
+
+static mrb_value reader_close_m(mrb_state *mrb, mrb_value self) {
+  FileReader *reader = (FileReader *) mrb_data_get_ptr(mrb, self, &reader_type);
+
+  if (reader != NULL)
+    reader_close(mrb, reader);
+
+  return mrb_nil_value();
+}
+
+/* HolycornFile.glob(pattern): the matching paths, sorted */
+static mrb_value file_glob(mrb_state *mrb, mrb_value self) {
+  char *pattern;
+  glob_t matches;
+  mrb_value paths;
+  int rc;
+
+  mrb_get_args(mrb, "z", &pattern);
+
+  rc = glob(pattern, 0, NULL, &matches);
+  if (rc == GLOB_NOMATCH)
+    return mrb_ary_new(mrb);
+  if (rc != 0)
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "could not expand %S", mrb_str_new_cstr(mrb, pattern));
+
+  paths = mrb_ary_new_capa(mrb, matches.gl_pathc);
+  for (size_t i = 0; i < matches.gl_pathc; i++)
+    mrb_ary_push(mrb, paths, mrb_str_new_cstr(mrb, matches.gl_pathv[i]));
+  globfree(&matches);
+
+  return paths;
+}
+
+/* HolycornFile.size(path): a Float when it doesn't fit a fixnum */
+static mrb_value file_size(mrb_state *mrb, mrb_value self) {
+  char *path;
+  struct stat st;
+
+  mrb_get_args(mrb, "z", &path);
+
+  if (stat(path, &st) < 0)
+    raise_errno(mrb, "stat", path);
+
+  if ((intmax_t) st.st_size > (intmax_t) MRB_INT_MAX)
+    return mrb_float_value(mrb, (double) st.st_size);
+
+  return mrb_fixnum_value((mrb_int) st.st_size);
+}
+
+void mrb_holycorn_file_gem_init(mrb_state *mrb) {
+  struct RClass *holycorn_file, *reader;
+
+  holycorn_file = mrb_define_class(mrb, "HolycornFile", mrb->object_class);
+  mrb_define_class_method(mrb, holycorn_file, "glob", file_glob, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, holycorn_file, "size", file_size, MRB_ARGS_REQ(1));
+
+  reader = mrb_define_class_under(mrb, holycorn_file, "Reader", mrb->object_class);
+  MRB_SET_INSTANCE_TT(reader, MRB_TT_DATA);
+  mrb_define_method(mrb, reader, "initialize", reader_initialize, MRB_ARGS_ARG(5, 1));
+  mrb_define_method(mrb, reader, "layout", reader_layout, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, reader, "read", reader_read, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, reader, "fields", reader_fields, MRB_ARGS_NONE());
+  mrb_define_method(mrb, reader, "close", reader_close_m, MRB_ARGS_NONE());
+}
+
+void mrb_holycorn_file_gem_final(mrb_state *mrb) {
+}
@@ -0,0 +1,8 @@
+#ifndef HOLYCORN_FILE_H
+#define HOLYCORN_FILE_H
+
+#include "mruby.h"
+void mrb_holycorn_file_gem_init(mrb_state *mrb);
+void mrb_holycorn_file_gem_final(mrb_state *mrb);
+
+#endif
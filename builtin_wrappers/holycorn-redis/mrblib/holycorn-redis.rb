@@ -1,39 +1,454 @@
 # Known limitations
 #
-# 1. We should use SCAN instead of KEYS (PR accepted :-D)
-# 2. Hashes, Sets and Sorted Sets are not supported yet (ditto)
+# 1. SCAN returns a key more than once when Redis rehashes its keyspace
+#    during the scan, so does the table
+# 2. Tables of hashes, sets, sorted sets and lists need Redis 6 (SCAN ... TYPE)
 class HolycornRedis
-  def initialize(env = {})
+  # Planner costs of a round trip to Redis, and of transferring a key
+  ROUND_TRIP_COST = 1.0
+  PER_KEY_COST = 0.05
+
+  # Planner guess of the number of elements of hashes, sets, zsets and lists
+  ELEMENTS_PER_KEY = 10
+
+  DEFAULT_SCAN_COUNT = 1000
+
+  # Columns of the table for each type of value (the `type` option)
+  SHAPES = {
+    'string' => [['key', 'text'], ['value', 'text']],
+    'hash'   => [['key', 'text'], ['field', 'text'], ['value', 'text']],
+    'set'    => [['key', 'text'], ['member', 'text']],
+    'zset'   => [['key', 'text'], ['member', 'text'], ['score', 'float8']],
+    'list'   => [['key', 'text'], ['idx', 'bigint'], ['value', 'text']],
+  }
+
+  # Types of score columns whose order is the order of the scores
+  NUMERIC_TYPES = ['smallint', 'integer', 'bigint', 'real', 'double precision', 'numeric']
+
+  def self.connect(env)
     host = env.fetch('host') { raise ArgumentError, 'host not provided' }
     port = env.fetch('port') { raise ArgumentError, 'port not provided' }
     db   = env.fetch('db')   { raise ArgumentError, 'db not provided' }
 
-    @r = Redis.new host, port.to_i
-    @r.select db.to_i
-    @values = (@r.keys('*') || []).to_enum
+    r = Redis.new host, port.to_i
+    r.select db.to_i
+    r
+  end
+
+  # Keys are streamed with SCAN (or are the looked up keys for key = ... and
+  # key IN (...)). The values of strings are fetched with one MGET per batch,
+  # pipelined with the next SCAN; elements of other types are read key by key
+  # with HSCAN, SSCAN, ZSCAN (ZRANGEBYSCORE for score ranges and ordered
+  # scans, ZREVRANGEBYSCORE for descending ones) and LRANGE.
+  def initialize(env = {})
+    @type = env['type'] || 'string'
+    raise ArgumentError, "unknown type #{@type}" unless SHAPES.key?(@type)
+
+    @r = HolycornRedis.connect(env)
+    rewind(env)
+  end
+
+  # Rescans (such as the lookups of nested loops joining on key) keep the
+  # connection
+  def rewind(env)
+    quals = env['quals'] || []
+
+    @lookup = HolycornRedis.lookup_keys(quals)
+    @fetch_values = !!@lookup || (env['columns'] || ['value']).include?('value')
+    @count = (env['scan_count'] || DEFAULT_SCAN_COUNT).to_i
+    @match = env['match'] || HolycornRedis.match_pattern(quals) || '*'
+    @limit = env['limit'] + env['offset'] if env['limit']
+
+    if @type == 'zset'
+      @scores = HolycornRedis.score_range(quals)
+      @descending = HolycornRedis.descending_scores?(env['order_by'])
+      @scores ||= ['-inf', '+inf'] if env['order_by']
+    end
+
+    @pending = @lookup ? @lookup.dup : []
+    @cursor = @lookup ? nil : '0'
+    @buffer = []
+    @key = nil
   end
 
-  def each
-    if (val = @values.next)
-      [val.to_s, @r.get(val).to_s]
+  def each_batch(n)
+    @type == 'string' ? string_batch(n) : element_batch(n)
+  end
+
+  # ANALYZE samples random keys with pipelined RANDOMKEYs rather than scanning
+  # the whole keyspace. Keys of other types are left out, and each sampled key
+  # gives its first elements, so the sample may be smaller than n.
+  def sample(n)
+    keys = pipeline(Array.new(n) { ['RANDOMKEY'] }).compact.uniq
+    return [] if keys.empty?
+
+    if @type == 'string'
+      values = command('MGET', *keys)
+      return keys.zip(values).reject { |_, value| value.nil? }
+    end
+
+    types = pipeline(keys.map { |key| ['TYPE', key] })
+    rows = []
+    keys.zip(types).each do |key, type|
+      break if rows.size >= n
+      next unless type == @type
+
+      rows.concat(read_elements(key, nil)[0])
+    end
+    rows.first(n)
+  end
+
+  # Writes: each batch is sent as one MSET/DEL for strings, and as pipelined
+  # commands for the other types
+  def insert_batch(rows)
+    if @type == 'string'
+      command('MSET', *rows.map { |row| [row['key'], row['value'].to_s] }.flatten)
     else
-      nil
+      pipeline(rows.map { |row| add_element(row) })
+    end
+  end
+
+  def update_batch(rows)
+    return update_list(rows) if @type == 'list'
+
+    # Changing what identifies an element means removing the old one
+    moved = rows.select { |old, new| identity(old) != identity(new) }.map { |old, _| old }
+    delete_batch(moved) unless moved.empty?
+    insert_batch(rows.map { |_, new| new })
+  end
+
+  def delete_batch(rows)
+    case @type
+    when 'string' then command('DEL', *rows.map { |row| row['key'] })
+    when 'list' then delete_list(rows)
+    else pipeline(rows.map { |row| remove_element(row) })
     end
   end
 
+  def self.key_lookup?(qual)
+    qual['column'] == 'key' && ['=', 'in'].include?(qual['operator'])
+  end
+
+  # Keys matching all the key quals, nil when there are none
+  def self.lookup_keys(quals)
+    keys = nil
+    quals.each do |qual|
+      next unless key_lookup?(qual)
+
+      values = qual['operator'] == '=' ? [qual['value']] : qual['value'].to_a
+      values = values.compact.map(&:to_s)
+      keys = keys ? keys & values : values.uniq
+    end
+    keys
+  end
+
+  # A SCAN MATCH pattern for key LIKE '...'. It may match more keys than LIKE
+  # (_ matches a single character but Redis only knows about bytes), so the
+  # qual is still checked by PostgreSQL.
+  def self.match_pattern(quals)
+    qual = quals.find { |q| q['column'] == 'key' && q['operator'] == 'like' && q['value'].is_a?(String) }
+    return nil unless qual
+
+    glob = ''
+    escaped = false
+    qual['value'].each_char do |c|
+      if escaped
+        glob << glob_escape(c)
+        escaped = false
+      elsif c == '\\'
+        escaped = true
+      elsif c == '%'
+        glob << '*'
+      elsif c == '_'
+        glob << '?*'
+      else
+        glob << glob_escape(c)
+      end
+    end
+    glob
+  end
+
+  def self.glob_escape(c)
+    '*?[]\\'.include?(c) ? "\\#{c}" : c
+  end
+
+  # ZRANGEBYSCORE bounds for the conditions on score, nil when there are none
+  def self.score_range(quals)
+    lower = upper = nil
+
+    quals.each do |qual|
+      value = qual['value']
+      next unless qual['column'] == 'score' && value.is_a?(Numeric)
+
+      case qual['operator']
+      when '>', '>=' then lower = tighter(lower, value, qual['operator'] == '>', true)
+      when '<', '<=' then upper = tighter(upper, value, qual['operator'] == '<', false)
+      when '='
+        lower = tighter(lower, value, false, true)
+        upper = tighter(upper, value, false, false)
+      end
+    end
+
+    return nil unless lower || upper
+    [score_bound(lower, '-inf'), score_bound(upper, '+inf')]
+  end
+
+  def self.tighter(bound, value, exclusive, lower)
+    return [value, exclusive] if bound.nil?
+    return [value, exclusive] if lower ? value > bound[0] : value < bound[0]
+    return [value, exclusive] if value == bound[0] && exclusive
+    bound
+  end
+
+  def self.score_bound(bound, infinite)
+    return infinite unless bound
+    bound[1] ? "(#{bound[0]}" : bound[0].to_s
+  end
+
+  # The elements of a single sorted set are read in score order, either way.
+  # Scores in a text column would sort differently than they are read.
+  def self.orderings(env, quals)
+    return [] unless env['type'] == 'zset'
+
+    keys = lookup_keys(quals)
+    return [] unless keys && keys.size == 1
+
+    score = (env['attributes'] || []).compact.find { |name, _| name == 'score' }
+    return [] unless score && NUMERIC_TYPES.include?(score[1].split('(').first)
+
+    [['score'], ['score DESC']]
+  end
+
+  def self.descending_scores?(order)
+    !!order && order.first == ['score', 'desc']
+  end
+
+  # Point lookups return at most one string per key; scans return every key
+  def self.estimate(env, quals)
+    lookups = quals.select { |qual| key_lookup?(qual) }
+    elements = (env['type'] || 'string') == 'string' ? 1 : ELEMENTS_PER_KEY
+
+    unless lookups.empty?
+      rows = lookups.map { |qual| qual['operator'] == '=' ? 1 : (qual['value'] || [nil]).size }.min
+      return { 'rows' => rows * elements, 'startup_cost' => ROUND_TRIP_COST, 'per_row_cost' => PER_KEY_COST }
+    end
+
+    r = connect(env)
+    r.queue 'DBSIZE'
+    rows = r.bulk_reply.to_i
+    r.close
+
+    { 'rows' => rows * elements, 'startup_cost' => ROUND_TRIP_COST, 'per_row_cost' => PER_KEY_COST }
+  end
+
+  # Joins on key can look keys up for each outer row rather than scanning
+  def self.indexed_columns(env)
+    ['key']
+  end
+
+  def self.handled_quals(env, quals)
+    handled = []
+    quals.each_with_index do |qual, i|
+      handled << i if key_lookup?(qual)
+    end
+    handled
+  end
+
   def self.import_schema(args)
+    type = args['type'] || 'string'
+    raise ArgumentError, "unknown type #{type}" unless SHAPES.key?(type)
+
+    columns = SHAPES[type].map { |name, sql_type| "#{name} #{sql_type}" }.join("\n        , ")
 <<-SCHEMA
 	CREATE FOREIGN TABLE #{args['local_schema']}.#{args['prefix']}redis_table
-        ( key text
-        , value text
+        ( #{columns}
         )
 	SERVER #{args['server_name']}
 	OPTIONS ( wrapper_class 'HolycornRedis'
 	        , host '#{args['host']}'
 	        , port '#{args['port']}'
 	        , db '#{args['db']}'
+	        , type '#{type}'
 	);
 SCHEMA
   end
-  self
+
+  private
+
+  def command(*args)
+    @r.queue(*args.map(&:to_s))
+    @r.bulk_reply
+  end
+
+  # Sends all the commands before reading their replies
+  def pipeline(commands)
+    commands.each { |args| @r.queue(*args.map(&:to_s)) }
+    commands.map { @r.bulk_reply }
+  end
+
+  def identity(row)
+    case @type
+    when 'string' then [row['key']]
+    when 'hash' then [row['key'], row['field']]
+    when 'set', 'zset' then [row['key'], row['member']]
+    end
+  end
+
+  def add_element(row)
+    case @type
+    when 'hash' then ['HSET', row['key'], row['field'], row['value']]
+    when 'set' then ['SADD', row['key'], row['member']]
+    when 'zset' then ['ZADD', row['key'], row['score'] || 0, row['member']]
+    when 'list' then ['RPUSH', row['key'], row['value']]
+    end
+  end
+
+  def remove_element(row)
+    case @type
+    when 'hash' then ['HDEL', row['key'], row['field']]
+    when 'set' then ['SREM', row['key'], row['member']]
+    when 'zset' then ['ZREM', row['key'], row['member']]
+    end
+  end
+
+  # List elements are addressed by index: updates set them in place
+  def update_list(rows)
+    rows.each do |old, new|
+      if old['key'] != new['key'] || old['idx'] != new['idx']
+        raise ArgumentError, 'key and idx of list elements can not be changed'
+      end
+    end
+    pipeline(rows.map { |_, new| ['LSET', new['key'], new['idx'], new['value']] })
+  end
+
+  # Deleted list elements are marked, and the marks removed once the statement
+  # ends: removing them shifts the elements that follow, whose indexes the
+  # scan and later batches still rely on. The mark is unique to the statement,
+  # so that elements can't be taken for it.
+  def delete_list(rows)
+    @tombstone ||= "holycorn:deleted:#{Time.now.to_f}:#{rand(1 << 30)}:#{rand(1 << 30)}"
+    @tombstoned ||= {}
+    pipeline(rows.map { |row| ['LSET', row['key'], row['idx'], @tombstone] })
+    rows.each { |row| @tombstoned[row['key']] = true }
+  end
+
+  def finish_writes
+    return unless @tombstoned
+
+    pipeline(@tombstoned.keys.map { |key| ['LREM', key, 0, @tombstone] })
+    @tombstoned = nil
+    @tombstone = nil
+  end
+
+  def queue_scan
+    args = ['SCAN', @cursor, 'MATCH', @match, 'COUNT', @count.to_s]
+    args.concat(['TYPE', @type]) unless @type == 'string'
+    @r.queue(*args)
+  end
+
+  def read_scan
+    cursor, keys = @r.bulk_reply
+    @cursor = cursor == '0' ? nil : cursor
+    @pending.concat(keys)
+  end
+
+  def scan
+    queue_scan
+    read_scan
+  end
+
+  def string_batch(n)
+    until @pending.empty? && @cursor.nil?
+      scan while @pending.empty? && @cursor
+      break if @pending.empty?
+
+      keys = @pending.shift(n)
+      rows = fetch(keys, @cursor && @pending.size < n)
+      return rows unless rows.empty?
+    end
+    nil
+  end
+
+  # Rows of keys, values fetched along with the next SCAN when prefetch is set.
+  # Looked up keys that don't exist (or don't hold a string) give no row.
+  def fetch(keys, prefetch)
+    @r.queue('MGET', *keys) if @fetch_values
+    queue_scan if prefetch
+
+    values = @fetch_values ? @r.bulk_reply : []
+    read_scan if prefetch
+
+    rows = []
+    keys.each_with_index do |key, i|
+      next rows << [key] unless @fetch_values
+      next if values[i].nil? && @lookup
+
+      rows << [key, values[i]]
+    end
+    rows
+  end
+
+  # Next key holding a value of the table's type, nil at the end
+  def next_key
+    loop do
+      scan while @pending.empty? && @cursor
+      key = @pending.shift
+      return nil if key.nil?
+
+      # SCAN ... TYPE only returns matching keys, looked up ones are checked
+      return key unless @lookup && command('TYPE', key) != @type
+    end
+  end
+
+  def element_batch(n)
+    while @buffer.size < n
+      unless @key
+        @key = next_key
+        break unless @key
+        @position = nil
+      end
+
+      rows, @position = read_elements(@key, @position)
+      @buffer.concat(rows)
+      @key = nil if @position.nil?
+    end
+
+    @buffer.empty? ? nil : @buffer.shift(n)
+  end
+
+  # Reads a chunk of the elements of key, starting at position (a cursor or
+  # an offset, nil for the first chunk). Returns the rows and the position of
+  # the next chunk, nil after the last one.
+  def read_elements(key, position)
+    case @type
+    when 'hash'
+      cursor, flat = command('HSCAN', key, position || '0', 'COUNT', @count)
+      rows = flat.each_slice(2).map { |field, value| [key, field, value] }
+      [rows, cursor == '0' ? nil : cursor]
+    when 'set'
+      cursor, members = command('SSCAN', key, position || '0', 'COUNT', @count)
+      [members.map { |member| [key, member] }, cursor == '0' ? nil : cursor]
+    when 'zset'
+      if @scores
+        # No key gives more rows than the scan needs
+        offset = position || 0
+        count = @limit ? [@count, @limit - offset].min : @count
+        return [[], nil] if count <= 0
+
+        range = @descending ? ['ZREVRANGEBYSCORE', key, @scores[1], @scores[0]] : ['ZRANGEBYSCORE', key, *@scores]
+        flat = command(*range, 'WITHSCORES', 'LIMIT', offset, count)
+        rows = flat.each_slice(2).map { |member, score| [key, member, score.to_f] }
+        [rows, rows.size < count ? nil : offset + count]
+      else
+        cursor, flat = command('ZSCAN', key, position || '0', 'COUNT', @count)
+        rows = flat.each_slice(2).map { |member, score| [key, member, score.to_f] }
+        [rows, cursor == '0' ? nil : cursor]
+      end
+    when 'list'
+      start = position || 0
+      values = command('LRANGE', key, start, start + @count - 1)
+      rows = values.each_with_index.map { |value, i| [key, start + i, value] }
+      [rows, values.size < @count ? nil : start + @count]
+    end
+  end
 end
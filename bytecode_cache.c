@@ -0,0 +1,283 @@
+#include "postgres.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "mruby.h"
+#include "mruby/compile.h"
+#include "mruby/dump.h"
+#include "mruby/irep.h"
+#include "mruby/proc.h"
+#include "mruby/string.h"
+#include "mruby/version.h"
+
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#elif PG_VERSION_NUM >= 120000
+#include "utils/hashutils.h"
+#else
+#include "access/hash.h"
+#endif
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "bytecode_cache.h"
+
+/*
+ * Compiled wrapper scripts, keyed by path. An entry is only valid for the
+ * mtime/size it was compiled from; the mruby version is part of the on-disk
+ * header so .mrb files written by another build are never loaded.
+ */
+typedef struct BytecodeCacheEntry {
+  char     path[MAXPGPATH];
+  time_t   mtime;
+  off_t    size;
+  uint8_t  *bin;
+  size_t   bin_size;
+} BytecodeCacheEntry;
+
+#define BYTECODE_CACHE_VERSION "holycorn-mrb " MRUBY_RUBY_VERSION " " MRUBY_VERSION
+
+char *holycorn_bytecode_cache_dir = NULL;
+
+static HTAB *bytecode_cache = NULL;
+
+static void bytecode_cache_header(StringInfo header, const char *path, struct stat *st);
+static char *bytecode_cache_file(const char *path, struct stat *st);
+static bool bytecode_cache_read(BytecodeCacheEntry *entry, struct stat *st);
+static void bytecode_cache_write(BytecodeCacheEntry *entry, struct stat *st);
+static bool bytecode_cache_compile(mrb_state *mrb, BytecodeCacheEntry *entry);
+
+void holycorn_bytecode_cache_init(void) {
+  DefineCustomStringVariable("holycorn.bytecode_cache_dir",
+      "Directory where compiled wrapper scripts are persisted.",
+      "Compiled scripts are always cached in backend memory. When set, they "
+      "are also written to this directory as .mrb files and shared by all backends.",
+      &holycorn_bytecode_cache_dir,
+      "",
+      PGC_SUSET, 0,
+      NULL, NULL, NULL);
+}
+
+/*
+ * Loads and runs a wrapper script, returning the value of its last expression
+ * (the wrapper class). The script is only parsed when it changed since it was
+ * last compiled.
+ */
+mrb_value holycorn_load_wrapper_script(mrb_state *mrb, const char *path) {
+  BytecodeCacheEntry *entry;
+  struct stat st;
+  bool found;
+
+  if (strlen(path) >= MAXPGPATH)
+    elog(ERROR, "[holycorn] wrapper path \"%s\" is too long", path);
+
+  if (stat(path, &st) != 0)
+    ereport(ERROR,
+        (errcode_for_file_access(),
+         errmsg("[holycorn] could not open wrapper \"%s\": %m", path)));
+
+  if (bytecode_cache == NULL) {
+    HASHCTL ctl;
+
+    MemSet(&ctl, 0, sizeof(ctl));
+    ctl.keysize = MAXPGPATH;
+    ctl.entrysize = sizeof(BytecodeCacheEntry);
+    bytecode_cache = hash_create("holycorn bytecode cache", 16, &ctl,
+#if PG_VERSION_NUM >= 140000
+        HASH_ELEM | HASH_STRINGS
+#else
+        HASH_ELEM
+#endif
+        );
+  }
+
+  entry = (BytecodeCacheEntry *) hash_search(bytecode_cache, path, HASH_ENTER, &found);
+
+  if (!found)
+    entry->bin = NULL;
+
+  if (entry->bin != NULL && (entry->mtime != st.st_mtime || entry->size != st.st_size)) {
+    pfree(entry->bin);
+    entry->bin = NULL;
+  }
+
+  if (entry->bin == NULL) {
+    entry->mtime = st.st_mtime;
+    entry->size = st.st_size;
+
+    if (!bytecode_cache_read(entry, &st)) {
+      if (!bytecode_cache_compile(mrb, entry)) {
+        /* The script doesn't dump (or doesn't parse): let mruby report it */
+        FILE *source = AllocateFile(path, "r");
+        mrb_value class;
+
+        if (source == NULL)
+          ereport(ERROR,
+              (errcode_for_file_access(),
+               errmsg("[holycorn] could not open wrapper \"%s\": %m", path)));
+
+        class = mrb_load_file(mrb, source);
+        FreeFile(source);
+        return class;
+      }
+
+      bytecode_cache_write(entry, &st);
+    }
+  }
+
+  return mrb_load_irep(mrb, entry->bin);
+}
+
+static bool bytecode_cache_compile(mrb_state *mrb, BytecodeCacheEntry *entry) {
+  mrbc_context *cxt;
+  mrb_value proc;
+  uint8_t *bin = NULL;
+  size_t bin_size = 0;
+  FILE *source;
+  int ai = mrb_gc_arena_save(mrb);
+
+  source = AllocateFile(entry->path, "r");
+  if (source == NULL)
+    return false;
+
+  cxt = mrbc_context_new(mrb);
+  mrbc_filename(mrb, cxt, entry->path);
+  cxt->no_exec = TRUE;
+
+  proc = mrb_load_file_cxt(mrb, source, cxt);
+
+  FreeFile(source);
+  mrbc_context_free(mrb, cxt);
+
+  if (mrb->exc || mrb_type(proc) != MRB_TT_PROC) {
+    mrb->exc = NULL;
+    mrb_gc_arena_restore(mrb, ai);
+    return false;
+  }
+
+  if (mrb_dump_irep(mrb, mrb_proc_ptr(proc)->body.irep, 0, &bin, &bin_size) != MRB_DUMP_OK) {
+    mrb_gc_arena_restore(mrb, ai);
+    return false;
+  }
+
+  entry->bin = (uint8_t *) MemoryContextAlloc(TopMemoryContext, bin_size);
+  entry->bin_size = bin_size;
+  memcpy(entry->bin, bin, bin_size);
+
+  mrb_free(mrb, bin);
+  mrb_gc_arena_restore(mrb, ai);
+
+  return true;
+}
+
+static void bytecode_cache_header(StringInfo header, const char *path, struct stat *st) {
+  appendStringInfo(header, "%s\n%s\n%ld %ld\n",
+      BYTECODE_CACHE_VERSION,
+      path,
+      (long) st->st_mtime,
+      (long) st->st_size);
+}
+
+static char *bytecode_cache_file(const char *path, struct stat *st) {
+  uint32 hash = DatumGetUInt32(hash_any((const unsigned char *) path, strlen(path)));
+
+  return psprintf("%s/%08x-%ld-%ld.mrb",
+      holycorn_bytecode_cache_dir,
+      hash,
+      (long) st->st_mtime,
+      (long) st->st_size);
+}
+
+static bool bytecode_cache_read(BytecodeCacheEntry *entry, struct stat *st) {
+  StringInfoData expected;
+  char *filename;
+  FILE *file;
+  char *header;
+  long file_size;
+  bool ok = false;
+
+  if (holycorn_bytecode_cache_dir == NULL || holycorn_bytecode_cache_dir[0] == '\0')
+    return false;
+
+  filename = bytecode_cache_file(entry->path, st);
+  file = AllocateFile(filename, PG_BINARY_R);
+  pfree(filename);
+
+  if (file == NULL)
+    return false;
+
+  initStringInfo(&expected);
+  bytecode_cache_header(&expected, entry->path, st);
+
+  header = palloc(expected.len);
+
+  if (fseek(file, 0, SEEK_END) == 0 &&
+      (file_size = ftell(file)) > expected.len &&
+      fseek(file, 0, SEEK_SET) == 0 &&
+      fread(header, 1, expected.len, file) == (size_t) expected.len &&
+      memcmp(header, expected.data, expected.len) == 0) {
+    size_t bin_size = file_size - expected.len;
+    uint8_t *bin = (uint8_t *) MemoryContextAlloc(TopMemoryContext, bin_size);
+
+    if (fread(bin, 1, bin_size, file) == bin_size) {
+      entry->bin = bin;
+      entry->bin_size = bin_size;
+      ok = true;
+    } else {
+      pfree(bin);
+    }
+  }
+
+  FreeFile(file);
+  pfree(header);
+  pfree(expected.data);
+
+  return ok;
+}
+
+/* Persisting is best effort: failures only cost a compilation in other backends */
+static void bytecode_cache_write(BytecodeCacheEntry *entry, struct stat *st) {
+  StringInfoData header;
+  char *filename;
+  char *tmpname;
+  FILE *file;
+  bool ok;
+
+  if (holycorn_bytecode_cache_dir == NULL || holycorn_bytecode_cache_dir[0] == '\0')
+    return;
+
+  filename = bytecode_cache_file(entry->path, st);
+  tmpname = psprintf("%s.%d.tmp", filename, MyProcPid);
+
+  file = AllocateFile(tmpname, PG_BINARY_W);
+  if (file == NULL) {
+    ereport(WARNING,
+        (errcode_for_file_access(),
+         errmsg("[holycorn] could not create \"%s\": %m", tmpname)));
+    return;
+  }
+
+  initStringInfo(&header);
+  bytecode_cache_header(&header, entry->path, st);
+
+  ok = fwrite(header.data, 1, header.len, file) == (size_t) header.len &&
+    fwrite(entry->bin, 1, entry->bin_size, file) == entry->bin_size;
+
+  if (FreeFile(file) != 0)
+    ok = false;
+
+  if (!ok || rename(tmpname, filename) != 0) {
+    ereport(WARNING,
+        (errcode_for_file_access(),
+         errmsg("[holycorn] could not write \"%s\": %m", filename)));
+    unlink(tmpname);
+  }
+
+  pfree(header.data);
+  pfree(tmpname);
+  pfree(filename);
+}
@@ -0,0 +1,11 @@
+#ifndef HOLYCORN_BYTECODE_CACHE_H
+#define HOLYCORN_BYTECODE_CACHE_H
+
+#include "mruby.h"
+
+extern char *holycorn_bytecode_cache_dir;
+
+void holycorn_bytecode_cache_init(void);
+mrb_value holycorn_load_wrapper_script(mrb_state *mrb, const char *path);
+
+#endif
@@ -7,6 +7,7 @@ def embed_gems(conf)
 
   # Builtin Foreign Data Wrappers
   conf.gem '../../builtin_wrappers/holycorn-redis'
+  conf.gem '../../builtin_wrappers/holycorn-file'
 
   # Include the default GEMs
   conf.gembox 'default'
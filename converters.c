@@ -0,0 +1,970 @@
+#include "postgres.h"
+
+#include <limits.h>
+#include <math.h>
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/class.h"
+#include "mruby/hash.h"
+#include "mruby/string.h"
+
+#include "catalog/pg_type.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/date.h"
+#include "utils/json.h"
+#include "utils/jsonb.h"
+#include "utils/lsyscache.h"
+#include "utils/numeric.h"
+#include "utils/rangetypes.h"
+#include "utils/timestamp.h"
+#include "utils/uuid.h"
+#include "vm_pool.h"
+#include "row.h"
+#include "converters.h"
+
+#define POSTGRES_TO_UNIX_EPOCH_DAYS (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE)
+#define POSTGRES_TO_UNIX_EPOCH_USECS (POSTGRES_TO_UNIX_EPOCH_DAYS * USECS_PER_DAY)
+
+#ifndef IS_VALID_TIMESTAMP
+/* Range of timestamps, as defined by PostgreSQL 9.6 */
+#define MIN_TIMESTAMP INT64CONST(-211813488000000000)
+#define END_TIMESTAMP INT64CONST(9223371331200000000)
+#define IS_VALID_TIMESTAMP(t) (MIN_TIMESTAMP <= (t) && (t) < END_TIMESTAMP)
+#endif
+
+/* Far out of the range of timestamps, yet small enough to count in microseconds */
+#define MAX_UNIX_SECONDS INT64CONST(8000000000000)
+
+static Datum convert_null(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull);
+static Datum convert_input(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull);
+static Datum convert_text(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull);
+static Datum convert_int(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull);
+static Datum convert_float(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull);
+static Datum convert_numeric(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull);
+static Datum convert_bool(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull);
+static Datum convert_bytea(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull);
+static Datum convert_time(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull);
+static Datum convert_uuid(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull);
+static Datum convert_array(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull);
+static Datum convert_jsonb(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull);
+static Datum convert_json(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull);
+static Datum convert_range(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull);
+
+static Datum input_datum(HolycornConverter *conv, const char *ptr, Size len);
+static Datum text_datum(HolycornConverter *conv, const char *ptr, int len);
+static Datum int_datum(HolycornConverter *conv, int64 result);
+static Datum float_datum(HolycornConverter *conv, double result);
+static Datum bytea_datum(const char *ptr, Size len);
+static Datum time_datum(HolycornConverter *conv, TimestampTz result);
+static void convert_native_row(mrb_state *mrb, HolycornRowConverter *converters, mrb_value row,
+    HolycornRow *native, Datum *values, bool *isnull);
+
+static HolycornConvertFn converter_for(Oid typid) {
+  switch (typid) {
+    case TEXTOID:
+    case VARCHAROID:
+      return convert_text;
+    case INT2OID:
+    case INT4OID:
+    case INT8OID:
+      return convert_int;
+    case FLOAT4OID:
+    case FLOAT8OID:
+      return convert_float;
+    case NUMERICOID:
+      return convert_numeric;
+    case BOOLOID:
+      return convert_bool;
+    case BYTEAOID:
+      return convert_bytea;
+    case DATEOID:
+    case TIMESTAMPOID:
+    case TIMESTAMPTZOID:
+      return convert_time;
+    case UUIDOID:
+      return convert_uuid;
+    case JSONBOID:
+      return convert_jsonb;
+    case JSONOID:
+      return convert_json;
+    default:
+      /* Anything else (including domains) goes through the type's input function */
+      return convert_input;
+  }
+}
+
+static void init_converter(HolycornConverter *conv, Oid typid, int32 typmod, struct RClass *time_class) {
+  Oid infunc;
+  Oid elemtype;
+
+  conv->typid = typid;
+  conv->typmod = typmod;
+  conv->time_class = time_class;
+  conv->convert = converter_for(typid);
+
+  getTypeInputInfo(typid, &infunc, &conv->ioparam);
+  fmgr_info(infunc, &conv->input);
+
+  if ((elemtype = get_element_type(typid)) != InvalidOid) {
+    /* Array elements share the column's typmod, as in varchar(10)[] */
+    conv->element = (HolycornConverter *) palloc0(sizeof(HolycornConverter));
+    init_converter(conv->element, elemtype, typmod, time_class);
+    get_typlenbyvalalign(elemtype, &conv->elmlen, &conv->elmbyval, &conv->elmalign);
+    conv->convert = convert_array;
+  } else if (type_is_range(typid)) {
+    conv->typcache = lookup_type_cache(typid, TYPECACHE_RANGE_INFO);
+    conv->element = (HolycornConverter *) palloc0(sizeof(HolycornConverter));
+    init_converter(conv->element, conv->typcache->rngelemtype->type_id, -1, time_class);
+    conv->convert = convert_range;
+  }
+}
+
+HolycornRowConverter *holycorn_build_converters(mrb_state *mrb, TupleDesc tupdesc) {
+  HolycornRowConverter *converters = (HolycornRowConverter *) palloc(sizeof(HolycornRowConverter));
+  struct RClass *time_class = NULL;
+
+  if (mrb_class_defined(mrb, "Time"))
+    time_class = mrb_class_get(mrb, "Time");
+
+  converters->natts = tupdesc->natts;
+  converters->columns = (HolycornConverter *) palloc0(sizeof(HolycornConverter) * tupdesc->natts);
+
+  for (int i = 0; i < tupdesc->natts; i++) {
+    Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+    HolycornConverter *conv = &converters->columns[i];
+
+    if (attr->attisdropped) {
+      conv->convert = convert_null;
+      continue;
+    }
+
+    conv->name = pstrdup(NameStr(attr->attname));
+    conv->projected = true;
+    init_converter(conv, attr->atttypid, attr->atttypmod, time_class);
+  }
+
+  return converters;
+}
+
+/*
+ * Converts a row into the slot's values/isnull arrays. Rows are either an
+ * Array of values in column order, where missing trailing values are NULL, a
+ * Hash keyed by column name, where missing columns are NULL, or a
+ * Holycorn::Row. Columns the query doesn't use are left NULL without looking
+ * at their value.
+ */
+void holycorn_convert_row(mrb_state *mrb, HolycornRowConverter *converters, mrb_value row,
+    Datum *values, bool *isnull) {
+  HolycornRow *native = holycorn_row_get(mrb, row);
+  bool by_name;
+  mrb_int len;
+
+  if (native != NULL) {
+    convert_native_row(mrb, converters, row, native, values, isnull);
+    return;
+  }
+
+  by_name = mrb_hash_p(row);
+  len = by_name ? 0 : RARRAY_LEN(row);
+
+  if (len > converters->natts)
+    ereport(ERROR,
+        (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+         errmsg("[holycorn] row has %d values but the foreign table has %d columns",
+           (int) len, converters->natts)));
+
+  for (int i = 0; i < converters->natts; i++) {
+    HolycornConverter *conv = &converters->columns[i];
+    mrb_value value = mrb_nil_value();
+
+    values[i] = (Datum) 0;
+    isnull[i] = true;
+
+    if (!conv->projected)
+      continue;
+
+    if (by_name)
+      value = mrb_hash_get(mrb, row, mrb_str_new_static(mrb, conv->name, strlen(conv->name)));
+    else if (i < len)
+      value = mrb_ary_ref(mrb, row, i);
+
+    if (mrb_nil_p(value))
+      continue;
+
+    isnull[i] = false;
+    values[i] = conv->convert(mrb, conv, value, &isnull[i]);
+  }
+}
+
+/*
+ * A value of a Holycorn::Row: when its kind is the one the column's converter
+ * expects, the datum is built from the C value, and strings are copied once,
+ * straight from the String they were set from. Otherwise the value goes
+ * through the converter as the Ruby value it stands for.
+ */
+static Datum convert_native_value(mrb_state *mrb, HolycornConverter *conv, mrb_value row, mrb_int i,
+    HolycornRowValue *value, bool *isnull) {
+  switch (value->kind) {
+    case HOLYCORN_ROW_INT:
+      if (conv->convert == convert_int)
+        return int_datum(conv, (int64) value->u.i);
+      if (conv->convert == convert_float)
+        return float_datum(conv, (double) value->u.i);
+      return conv->convert(mrb, conv, mrb_fixnum_value(value->u.i), isnull);
+
+    case HOLYCORN_ROW_FLOAT:
+      if (conv->convert == convert_float)
+        return float_datum(conv, (double) value->u.f);
+      return conv->convert(mrb, conv, mrb_float_value(mrb, value->u.f), isnull);
+
+    case HOLYCORN_ROW_BOOL:
+      if (conv->convert == convert_bool)
+        return BoolGetDatum(value->u.b);
+      return conv->convert(mrb, conv, mrb_bool_value(value->u.b), isnull);
+
+    case HOLYCORN_ROW_TEXT:
+    case HOLYCORN_ROW_BYTES:
+      {
+        mrb_value str = holycorn_row_string(mrb, row, i);
+        const char *ptr;
+
+        if (!mrb_string_p(str) || value->u.str.start + value->u.str.len > RSTRING_LEN(str))
+          ereport(ERROR,
+              (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+               errmsg("[holycorn] the string of column %s was shortened after being set", conv->name)));
+
+        ptr = RSTRING_PTR(str) + value->u.str.start;
+
+        if (conv->convert == convert_text)
+          return text_datum(conv, ptr, (int) value->u.str.len);
+        if (conv->convert == convert_bytea)
+          return bytea_datum(ptr, (Size) value->u.str.len);
+        if (value->kind == HOLYCORN_ROW_TEXT)
+          return input_datum(conv, ptr, (Size) value->u.str.len);
+
+        /* Bytes may mean something else than text, as raw UUIDs do */
+        return conv->convert(mrb, conv, mrb_str_new(mrb, ptr, value->u.str.len), isnull);
+      }
+
+    case HOLYCORN_ROW_TIME:
+      if (conv->convert == convert_time)
+        return time_datum(conv, (TimestampTz) value->u.usecs - POSTGRES_TO_UNIX_EPOCH_USECS);
+      if (conv->time_class != NULL) {
+        int64 seconds = value->u.usecs / USECS_PER_SEC;
+        int64 usec = value->u.usecs % USECS_PER_SEC;
+        mrb_value time;
+
+        if (usec < 0) {
+          usec += USECS_PER_SEC;
+          seconds--;
+        }
+
+        time = mrb_funcall(mrb, mrb_obj_value(conv->time_class), "at", 2,
+            mrb_fixnum_value((mrb_int) seconds), mrb_fixnum_value((mrb_int) usec));
+        holycorn_check_exception(mrb, "building a Time");
+        return conv->convert(mrb, conv, time, isnull);
+      }
+      return conv->convert(mrb, conv, mrb_float_value(mrb, (mrb_float) value->u.usecs / USECS_PER_SEC), isnull);
+
+    default:
+      *isnull = true;
+      return (Datum) 0;
+  }
+}
+
+/* Holycorn::Row values are in column order, like Array rows */
+static void convert_native_row(mrb_state *mrb, HolycornRowConverter *converters, mrb_value row,
+    HolycornRow *native, Datum *values, bool *isnull) {
+  if (native->size > converters->natts)
+    ereport(ERROR,
+        (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+         errmsg("[holycorn] row has %d values but the foreign table has %d columns",
+           (int) native->size, converters->natts)));
+
+  for (int i = 0; i < converters->natts; i++) {
+    HolycornConverter *conv = &converters->columns[i];
+
+    values[i] = (Datum) 0;
+    isnull[i] = true;
+
+    if (!conv->projected || i >= native->size || native->values[i].kind == HOLYCORN_ROW_NULL)
+      continue;
+
+    isnull[i] = false;
+    values[i] = convert_native_value(mrb, conv, row, i, &native->values[i], &isnull[i]);
+  }
+}
+
+static mrb_value as_string(mrb_state *mrb, mrb_value value) {
+  if (mrb_string_p(value))
+    return value;
+
+  value = mrb_obj_as_string(mrb, value);
+  holycorn_check_exception(mrb, "converting a value to a string");
+
+  return value;
+}
+
+static bool is_time(mrb_state *mrb, HolycornConverter *conv, mrb_value value) {
+  return conv->time_class != NULL && mrb_obj_is_kind_of(mrb, value, conv->time_class);
+}
+
+static Datum convert_null(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull) {
+  *isnull = true;
+  return (Datum) 0;
+}
+
+static Datum input_datum(HolycornConverter *conv, const char *ptr, Size len) {
+  return InputFunctionCall(&conv->input, pnstrdup(ptr, len), conv->ioparam, conv->typmod);
+}
+
+static Datum convert_input(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull) {
+  mrb_value str = as_string(mrb, value);
+
+  return input_datum(conv, RSTRING_PTR(str), RSTRING_LEN(str));
+}
+
+static Datum text_datum(HolycornConverter *conv, const char *ptr, int len) {
+  pg_verifymbstr(ptr, len, false);
+
+  if (conv->typid == VARCHAROID && conv->typmod >= (int32) VARHDRSZ) {
+    int maxlen = conv->typmod - VARHDRSZ;
+
+    if (len > maxlen && pg_mbstrlen_with_len(ptr, len) > maxlen)
+      ereport(ERROR,
+          (errcode(ERRCODE_STRING_DATA_RIGHT_TRUNCATION),
+           errmsg("value too long for type character varying(%d)", maxlen)));
+  }
+
+  return PointerGetDatum(cstring_to_text_with_len(ptr, len));
+}
+
+static Datum convert_text(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull) {
+  mrb_value str = as_string(mrb, value);
+
+  return text_datum(conv, RSTRING_PTR(str), (int) RSTRING_LEN(str));
+}
+
+static Datum convert_int(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull) {
+  int64 result;
+
+  if (mrb_fixnum_p(value)) {
+    result = (int64) mrb_fixnum(value);
+  } else if (mrb_float_p(value)) {
+    double d = rint(mrb_float(value));
+
+    if (isnan(d) || d < -9223372036854775808.0 || d >= 9223372036854775808.0)
+      ereport(ERROR,
+          (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+           errmsg("[holycorn] %g is out of range for type %s", mrb_float(value), format_type_be(conv->typid))));
+
+    result = (int64) d;
+  } else {
+    return convert_input(mrb, conv, value, isnull);
+  }
+
+  return int_datum(conv, result);
+}
+
+static Datum int_datum(HolycornConverter *conv, int64 result) {
+  if ((conv->typid == INT2OID && (result < SHRT_MIN || result > SHRT_MAX)) ||
+      (conv->typid == INT4OID && (result < INT_MIN || result > INT_MAX)))
+    ereport(ERROR,
+        (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+         errmsg("[holycorn] " INT64_FORMAT " is out of range for type %s", result, format_type_be(conv->typid))));
+
+  switch (conv->typid) {
+    case INT2OID:
+      return Int16GetDatum((int16) result);
+    case INT4OID:
+      return Int32GetDatum((int32) result);
+    default:
+      return Int64GetDatum(result);
+  }
+}
+
+static Datum convert_float(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull) {
+  double result;
+
+  if (mrb_fixnum_p(value))
+    result = (double) mrb_fixnum(value);
+  else if (mrb_float_p(value))
+    result = (double) mrb_float(value);
+  else
+    return convert_input(mrb, conv, value, isnull);
+
+  return float_datum(conv, result);
+}
+
+static Datum float_datum(HolycornConverter *conv, double result) {
+  if (conv->typid == FLOAT4OID) {
+    float4 narrowed = (float4) result;
+
+    if (isinf(narrowed) && !isinf(result))
+      ereport(ERROR,
+          (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+           errmsg("[holycorn] %g is out of range for type real", result)));
+
+    return Float4GetDatum(narrowed);
+  }
+
+  return Float8GetDatum(result);
+}
+
+static Datum convert_numeric(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull) {
+  Datum result;
+
+  if (mrb_fixnum_p(value))
+    result = DirectFunctionCall1(int8_numeric, Int64GetDatum((int64) mrb_fixnum(value)));
+  else if (mrb_float_p(value))
+    result = DirectFunctionCall1(float8_numeric, Float8GetDatum((double) mrb_float(value)));
+  else
+    return convert_input(mrb, conv, value, isnull);
+
+  /* Apply the column's precision and scale, as numeric_in would */
+  if (conv->typmod >= (int32) VARHDRSZ)
+    result = DirectFunctionCall2(numeric, result, Int32GetDatum(conv->typmod));
+
+  return result;
+}
+
+static Datum convert_bool(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull) {
+  switch (mrb_type(value)) {
+    case MRB_TT_TRUE:
+      return BoolGetDatum(true);
+    case MRB_TT_FALSE:
+      return BoolGetDatum(false);
+    case MRB_TT_FIXNUM:
+      return BoolGetDatum(mrb_fixnum(value) != 0);
+    default:
+      return convert_input(mrb, conv, value, isnull);
+  }
+}
+
+static Datum bytea_datum(const char *ptr, Size len) {
+  bytea *result = (bytea *) palloc(len + VARHDRSZ);
+
+  SET_VARSIZE(result, len + VARHDRSZ);
+  memcpy(VARDATA(result), ptr, len);
+
+  return PointerGetDatum(result);
+}
+
+static Datum convert_bytea(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull) {
+  mrb_value str = as_string(mrb, value);
+
+  return bytea_datum(RSTRING_PTR(str), (Size) RSTRING_LEN(str));
+}
+
+bool holycorn_unix_usecs(int64 seconds, int64 usec, int64 *usecs) {
+  if (seconds < -MAX_UNIX_SECONDS || seconds > MAX_UNIX_SECONDS)
+    return false;
+
+  seconds += usec / USECS_PER_SEC;
+  usec %= USECS_PER_SEC;
+
+  if (seconds < -MAX_UNIX_SECONDS || seconds > MAX_UNIX_SECONDS)
+    return false;
+
+  *usecs = seconds * USECS_PER_SEC + usec;
+  return IS_VALID_TIMESTAMP(*usecs - POSTGRES_TO_UNIX_EPOCH_USECS);
+}
+
+/* NaN and infinities are out of range too: they can't be cast to integers */
+bool holycorn_unix_usecs_float(double seconds, int64 *usecs) {
+  double d;
+
+  if (!isfinite(seconds))
+    return false;
+
+  d = rint(seconds * USECS_PER_SEC) - POSTGRES_TO_UNIX_EPOCH_USECS;
+  if (d < (double) MIN_TIMESTAMP || d >= (double) END_TIMESTAMP)
+    return false;
+
+  *usecs = (int64) d + POSTGRES_TO_UNIX_EPOCH_USECS;
+  return IS_VALID_TIMESTAMP(*usecs - POSTGRES_TO_UNIX_EPOCH_USECS);
+}
+
+/*
+ * Time objects, and integers/floats taken as seconds since the Unix epoch, are
+ * converted into a timestamptz. Returns false for any other value.
+ */
+static bool timestamptz_from_value(mrb_state *mrb, HolycornConverter *conv, mrb_value value, TimestampTz *result) {
+  int64 usecs;
+  bool valid;
+
+  if (mrb_fixnum_p(value)) {
+    valid = holycorn_unix_usecs((int64) mrb_fixnum(value), 0, &usecs);
+  } else if (mrb_float_p(value)) {
+    valid = holycorn_unix_usecs_float(mrb_float(value), &usecs);
+  } else if (is_time(mrb, conv, value)) {
+    mrb_value seconds = mrb_funcall(mrb, value, "to_i", 0);
+    mrb_value usec;
+    holycorn_check_exception(mrb, "converting a Time");
+    usec = mrb_funcall(mrb, value, "usec", 0);
+    holycorn_check_exception(mrb, "converting a Time");
+
+    valid = holycorn_unix_usecs((int64) mrb_fixnum(seconds), (int64) mrb_fixnum(usec), &usecs);
+  } else {
+    return false;
+  }
+
+  if (!valid)
+    ereport(ERROR,
+        (errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+         errmsg("[holycorn] timestamp out of range for type %s", format_type_be(conv->typid))));
+
+  *result = (TimestampTz) usecs - POSTGRES_TO_UNIX_EPOCH_USECS;
+  return true;
+}
+
+/*
+ * Instants are turned into local (session time zone) timestamps and dates,
+ * rounded to the precision of the column as in timestamp(0)
+ */
+static Datum time_datum(HolycornConverter *conv, TimestampTz result) {
+  Datum datum;
+
+  switch (conv->typid) {
+    case TIMESTAMPOID:
+      datum = DirectFunctionCall1(timestamptz_timestamp, TimestampTzGetDatum(result));
+      if (conv->typmod >= 0)
+        datum = DirectFunctionCall2(timestamp_scale, datum, Int32GetDatum(conv->typmod));
+      return datum;
+    case DATEOID:
+      return DirectFunctionCall1(timestamptz_date, TimestampTzGetDatum(result));
+    default:
+      datum = TimestampTzGetDatum(result);
+      if (conv->typmod >= 0)
+        datum = DirectFunctionCall2(timestamptz_scale, datum, Int32GetDatum(conv->typmod));
+      return datum;
+  }
+}
+
+static Datum convert_time(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull) {
+  TimestampTz result;
+
+  if (!timestamptz_from_value(mrb, conv, value, &result))
+    return convert_input(mrb, conv, value, isnull);
+
+  return time_datum(conv, result);
+}
+
+/* 16-byte strings are taken as raw UUIDs, anything else as its text form */
+static Datum convert_uuid(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull) {
+  if (mrb_string_p(value) && RSTRING_LEN(value) == UUID_LEN) {
+    pg_uuid_t *uuid = (pg_uuid_t *) palloc(sizeof(pg_uuid_t));
+
+    memcpy(uuid->data, RSTRING_PTR(value), UUID_LEN);
+    return UUIDPGetDatum(uuid);
+  }
+
+  return convert_input(mrb, conv, value, isnull);
+}
+
+/*
+ * Nested Arrays become multidimensional arrays. They have to be rectangular,
+ * as PostgreSQL arrays are.
+ */
+static void collect_array_elements(mrb_state *mrb, HolycornConverter *conv, mrb_value value,
+    int depth, int ndims, int *dims, Datum *elems, bool *nulls, int *count) {
+  check_stack_depth();
+
+  if (RARRAY_LEN(value) != dims[depth])
+    ereport(ERROR,
+        (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+         errmsg("[holycorn] multidimensional arrays must have sub-arrays with matching dimensions")));
+
+  for (int i = 0; i < dims[depth]; i++) {
+    mrb_value item = mrb_ary_ref(mrb, value, i);
+
+    if (depth + 1 < ndims) {
+      if (!mrb_array_p(item))
+        ereport(ERROR,
+            (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+             errmsg("[holycorn] multidimensional arrays must have sub-arrays with matching dimensions")));
+
+      collect_array_elements(mrb, conv, item, depth + 1, ndims, dims, elems, nulls, count);
+      continue;
+    }
+
+    if (mrb_nil_p(item)) {
+      elems[*count] = (Datum) 0;
+      nulls[*count] = true;
+    } else {
+      nulls[*count] = false;
+      elems[*count] = conv->element->convert(mrb, conv->element, item, &nulls[*count]);
+    }
+    (*count)++;
+  }
+}
+
+static Datum convert_array(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull) {
+  int dims[MAXDIM];
+  int lbs[MAXDIM];
+  int ndims = 0;
+  int nitems = 1;
+  int count = 0;
+  mrb_value current = value;
+  Datum *elems;
+  bool *nulls;
+
+  /* '{1,2,3}' and friends */
+  if (!mrb_array_p(value))
+    return convert_input(mrb, conv, value, isnull);
+
+  /* Elements of json[]/jsonb[] arrays may be Arrays themselves */
+  bool nested = conv->element->convert != convert_json && conv->element->convert != convert_jsonb;
+
+  while (mrb_array_p(current) && ndims < MAXDIM) {
+    dims[ndims] = (int) RARRAY_LEN(current);
+    lbs[ndims] = 1;
+    nitems *= dims[ndims];
+    ndims++;
+
+    if (!nested || RARRAY_LEN(current) == 0)
+      break;
+
+    current = mrb_ary_ref(mrb, current, 0);
+  }
+
+  if (nitems == 0)
+    return PointerGetDatum(construct_empty_array(conv->element->typid));
+
+  elems = (Datum *) palloc(sizeof(Datum) * nitems);
+  nulls = (bool *) palloc(sizeof(bool) * nitems);
+
+  collect_array_elements(mrb, conv, value, 0, ndims, dims, elems, nulls, &count);
+
+  return PointerGetDatum(construct_md_array(elems, nulls, ndims, dims, lbs,
+        conv->element->typid, conv->elmlen, conv->elmbyval, conv->elmalign));
+}
+
+static Numeric numeric_from_value(mrb_state *mrb, mrb_value value) {
+  if (mrb_fixnum_p(value))
+    return DatumGetNumeric(DirectFunctionCall1(int8_numeric, Int64GetDatum((int64) mrb_fixnum(value))));
+
+  if (isnan(mrb_float(value)) || isinf(mrb_float(value)))
+    ereport(ERROR,
+        (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+         errmsg("[holycorn] %g can't be represented in JSON", mrb_float(value))));
+
+  return DatumGetNumeric(DirectFunctionCall1(float8_numeric, Float8GetDatum((double) mrb_float(value))));
+}
+
+static void jsonb_scalar(mrb_state *mrb, mrb_value value, JsonbValue *jbv) {
+  switch (mrb_type(value)) {
+    case MRB_TT_FALSE:
+      if (mrb_nil_p(value)) {
+        jbv->type = jbvNull;
+      } else {
+        jbv->type = jbvBool;
+        jbv->val.boolean = false;
+      }
+      break;
+    case MRB_TT_TRUE:
+      jbv->type = jbvBool;
+      jbv->val.boolean = true;
+      break;
+    case MRB_TT_FIXNUM:
+    case MRB_TT_FLOAT:
+      jbv->type = jbvNumeric;
+      jbv->val.numeric = numeric_from_value(mrb, value);
+      break;
+    default:
+      value = as_string(mrb, value);
+      pg_verifymbstr(RSTRING_PTR(value), (int) RSTRING_LEN(value), false);
+
+      /* The string is kept alive by the GC arena until the datum is built */
+      jbv->type = jbvString;
+      jbv->val.string.val = RSTRING_PTR(value);
+      jbv->val.string.len = (int) RSTRING_LEN(value);
+      break;
+  }
+}
+
+/*
+ * The Arrays and Hashes a value being converted to JSON is nested in, from
+ * the innermost one: a container holding itself would otherwise be converted
+ * until the stack runs out.
+ */
+typedef struct JsonNesting {
+  struct RBasic            *container;
+  const struct JsonNesting *parent;
+} JsonNesting;
+
+static void enter_json_container(mrb_value value, const JsonNesting *parent, JsonNesting *nesting) {
+  check_stack_depth();
+
+  for (const JsonNesting *outer = parent; outer != NULL; outer = outer->parent)
+    if (outer->container == mrb_basic_ptr(value))
+      ereport(ERROR,
+          (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+           errmsg("[holycorn] can't convert %s containing itself to JSON",
+             mrb_array_p(value) ? "an Array" : "a Hash")));
+
+  nesting->container = mrb_basic_ptr(value);
+  nesting->parent = parent;
+}
+
+/*
+ * Pushes a Ruby value into a jsonb being built. Returns the finished jsonb
+ * value once the outermost container (or top-level scalar) is closed.
+ */
+static JsonbValue *push_jsonb(mrb_state *mrb, JsonbParseState **state, mrb_value value, JsonbIteratorToken token,
+    const JsonNesting *parent) {
+  JsonbValue jbv;
+  JsonNesting nesting;
+
+  if (mrb_hash_p(value)) {
+    mrb_value keys = mrb_hash_keys(mrb, value);
+
+    enter_json_container(value, parent, &nesting);
+
+    pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+
+    for (mrb_int i = 0; i < RARRAY_LEN(keys); i++) {
+      mrb_value key = mrb_ary_ref(mrb, keys, i);
+      mrb_value name = as_string(mrb, key);
+
+      pg_verifymbstr(RSTRING_PTR(name), (int) RSTRING_LEN(name), false);
+
+      jbv.type = jbvString;
+      jbv.val.string.val = RSTRING_PTR(name);
+      jbv.val.string.len = (int) RSTRING_LEN(name);
+      pushJsonbValue(state, WJB_KEY, &jbv);
+
+      push_jsonb(mrb, state, mrb_hash_get(mrb, value, key), WJB_VALUE, &nesting);
+    }
+
+    return pushJsonbValue(state, WJB_END_OBJECT, NULL);
+  }
+
+  if (mrb_array_p(value)) {
+    enter_json_container(value, parent, &nesting);
+    pushJsonbValue(state, WJB_BEGIN_ARRAY, NULL);
+
+    for (mrb_int i = 0; i < RARRAY_LEN(value); i++)
+      push_jsonb(mrb, state, mrb_ary_ref(mrb, value, i), WJB_ELEM, &nesting);
+
+    return pushJsonbValue(state, WJB_END_ARRAY, NULL);
+  }
+
+  jsonb_scalar(mrb, value, &jbv);
+
+  if (*state == NULL) {
+    /* Top-level scalars are stored as a one-element "raw scalar" array */
+    JsonbValue array;
+
+    array.type = jbvArray;
+    array.val.array.rawScalar = true;
+    array.val.array.nElems = 1;
+
+    pushJsonbValue(state, WJB_BEGIN_ARRAY, &array);
+    pushJsonbValue(state, WJB_ELEM, &jbv);
+    return pushJsonbValue(state, WJB_END_ARRAY, NULL);
+  }
+
+  return pushJsonbValue(state, token, &jbv);
+}
+
+/* Strings are parsed as JSON documents, anything else is built as jsonb directly */
+static Datum convert_jsonb(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull) {
+  JsonbParseState *state = NULL;
+
+  if (mrb_string_p(value))
+    return convert_input(mrb, conv, value, isnull);
+
+  return PointerGetDatum(JsonbValueToJsonb(push_jsonb(mrb, &state, value, WJB_ELEM, NULL)));
+}
+
+static void append_json(mrb_state *mrb, StringInfo buf, mrb_value value, const JsonNesting *parent) {
+  JsonNesting nesting;
+
+  switch (mrb_type(value)) {
+    case MRB_TT_FALSE:
+      appendStringInfoString(buf, mrb_nil_p(value) ? "null" : "false");
+      return;
+    case MRB_TT_TRUE:
+      appendStringInfoString(buf, "true");
+      return;
+    case MRB_TT_FIXNUM:
+    case MRB_TT_FLOAT:
+      appendStringInfoString(buf, DatumGetCString(DirectFunctionCall1(numeric_out,
+              NumericGetDatum(numeric_from_value(mrb, value)))));
+      return;
+    case MRB_TT_HASH: {
+      mrb_value keys = mrb_hash_keys(mrb, value);
+
+      enter_json_container(value, parent, &nesting);
+      appendStringInfoChar(buf, '{');
+      for (mrb_int i = 0; i < RARRAY_LEN(keys); i++) {
+        mrb_value key = mrb_ary_ref(mrb, keys, i);
+
+        if (i > 0)
+          appendStringInfoChar(buf, ',');
+        append_json(mrb, buf, as_string(mrb, key), &nesting);
+        appendStringInfoChar(buf, ':');
+        append_json(mrb, buf, mrb_hash_get(mrb, value, key), &nesting);
+      }
+      appendStringInfoChar(buf, '}');
+      return;
+    }
+    case MRB_TT_ARRAY:
+      enter_json_container(value, parent, &nesting);
+      appendStringInfoChar(buf, '[');
+      for (mrb_int i = 0; i < RARRAY_LEN(value); i++) {
+        if (i > 0)
+          appendStringInfoChar(buf, ',');
+        append_json(mrb, buf, mrb_ary_ref(mrb, value, i), &nesting);
+      }
+      appendStringInfoChar(buf, ']');
+      return;
+    default:
+      value = as_string(mrb, value);
+      pg_verifymbstr(RSTRING_PTR(value), (int) RSTRING_LEN(value), false);
+      escape_json(buf, pnstrdup(RSTRING_PTR(value), RSTRING_LEN(value)));
+      return;
+  }
+}
+
+/* json is stored as text: strings are validated by json_in, other values serialized */
+static Datum convert_json(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull) {
+  StringInfoData buf;
+
+  if (mrb_string_p(value))
+    return convert_input(mrb, conv, value, isnull);
+
+  initStringInfo(&buf);
+  append_json(mrb, &buf, value, NULL);
+
+  return PointerGetDatum(cstring_to_text_with_len(buf.data, buf.len));
+}
+
+/* Ranges: nil bounds (endless/beginless ranges) are infinite */
+static Datum convert_range(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull) {
+  RangeBound lower, upper;
+  mrb_value first, last, exclusive;
+  bool unused;
+
+  if (mrb_type(value) != MRB_TT_RANGE)
+    return convert_input(mrb, conv, value, isnull);
+
+  first = mrb_funcall(mrb, value, "begin", 0);
+  last = mrb_funcall(mrb, value, "end", 0);
+  exclusive = mrb_funcall(mrb, value, "exclude_end?", 0);
+  holycorn_check_exception(mrb, "reading a Range");
+
+  lower.infinite = mrb_nil_p(first);
+  lower.val = lower.infinite ? (Datum) 0 : conv->element->convert(mrb, conv->element, first, &unused);
+  lower.inclusive = !lower.infinite;
+  lower.lower = true;
+
+  upper.infinite = mrb_nil_p(last);
+  upper.val = upper.infinite ? (Datum) 0 : conv->element->convert(mrb, conv->element, last, &unused);
+  upper.inclusive = !upper.infinite && !mrb_test(exclusive);
+  upper.lower = false;
+
+  return PointerGetDatum(make_range(conv->typcache, &lower, &upper, false
+#if PG_VERSION_NUM >= 160000
+        , NULL
+#endif
+        ));
+}
+
+/*
+ * Datums handed to wrappers (pushed down qual values): numbers, booleans and
+ * strings map to their Ruby counterparts, arrays to Arrays, timestamptz to
+ * Time. Any other type is given as its text representation.
+ */
+mrb_value holycorn_datum_to_mrb(mrb_state *mrb, Datum value, bool isnull, Oid typid) {
+  Oid elemtype;
+
+  if (isnull)
+    return mrb_nil_value();
+
+  switch (typid) {
+    case BOOLOID:
+      return mrb_bool_value(DatumGetBool(value));
+    case INT2OID:
+      return mrb_fixnum_value(DatumGetInt16(value));
+    case INT4OID:
+      return mrb_fixnum_value(DatumGetInt32(value));
+    case INT8OID:
+      return mrb_fixnum_value(DatumGetInt64(value));
+    case FLOAT4OID:
+      return mrb_float_value(mrb, DatumGetFloat4(value));
+    case FLOAT8OID:
+      return mrb_float_value(mrb, DatumGetFloat8(value));
+    case TEXTOID:
+    case VARCHAROID:
+    case BPCHAROID:
+    case BYTEAOID:
+      {
+        text *str = DatumGetTextPP(value);
+        return mrb_str_new(mrb, VARDATA_ANY(str), VARSIZE_ANY_EXHDR(str));
+      }
+    case NAMEOID:
+      return mrb_str_new_cstr(mrb, NameStr(*DatumGetName(value)));
+    case TIMESTAMPTZOID:
+      if (mrb_class_defined(mrb, "Time")) {
+        TimestampTz usecs = DatumGetTimestampTz(value) + POSTGRES_TO_UNIX_EPOCH_USECS;
+        mrb_value time = mrb_funcall(mrb, mrb_obj_value(mrb_class_get(mrb, "Time")), "at", 2,
+            mrb_fixnum_value(usecs / USECS_PER_SEC), mrb_fixnum_value(usecs % USECS_PER_SEC));
+        holycorn_check_exception(mrb, "building a Time");
+        return time;
+      }
+      break;
+  }
+
+  if ((elemtype = get_element_type(typid)) != InvalidOid) {
+    ArrayType *array = DatumGetArrayTypeP(value);
+    Datum *elems;
+    bool *nulls;
+    int nelems;
+    int16 elmlen;
+    bool elmbyval;
+    char elmalign;
+    mrb_value result;
+
+    get_typlenbyvalalign(elemtype, &elmlen, &elmbyval, &elmalign);
+    deconstruct_array(array, elemtype, elmlen, elmbyval, elmalign, &elems, &nulls, &nelems);
+
+    result = mrb_ary_new_capa(mrb, nelems);
+    for (int i = 0; i < nelems; i++)
+      mrb_ary_push(mrb, result, holycorn_datum_to_mrb(mrb, elems[i], nulls[i], elemtype));
+
+    return result;
+  }
+
+  {
+    Oid output;
+    bool isvarlena;
+    char *str;
+
+    getTypeOutputInfo(typid, &output, &isvarlena);
+    str = OidOutputFunctionCall(output, value);
+
+    return mrb_str_new_cstr(mrb, str);
+  }
+}
+
+/* A row given to wrappers (rows to write): a Hash keyed by column name */
+mrb_value holycorn_row_to_mrb(mrb_state *mrb, TupleDesc tupdesc, Datum *values, bool *isnull) {
+  mrb_value row = mrb_hash_new_capa(mrb, tupdesc->natts);
+
+  for (int i = 0; i < tupdesc->natts; i++) {
+    Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+
+    if (attr->attisdropped)
+      continue;
+
+    mrb_hash_set(mrb, row, mrb_str_new_cstr(mrb, NameStr(attr->attname)),
+        holycorn_datum_to_mrb(mrb, values[i], isnull[i], attr->atttypid));
+  }
+
+  return row;
+}
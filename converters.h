@@ -0,0 +1,58 @@
+#ifndef HOLYCORN_CONVERTERS_H
+#define HOLYCORN_CONVERTERS_H
+
+#include "mruby.h"
+#include "access/tupdesc.h"
+#include "fmgr.h"
+#include "utils/typcache.h"
+
+#ifndef TupleDescAttr
+#define TupleDescAttr(tupdesc, i) ((tupdesc)->attrs[(i)])
+#endif
+
+typedef struct HolycornConverter HolycornConverter;
+
+/* Builds a datum of the column's type out of a (non-nil) Ruby value */
+typedef Datum (*HolycornConvertFn)(mrb_state *mrb, HolycornConverter *conv, mrb_value value, bool *isnull);
+
+struct HolycornConverter {
+  HolycornConvertFn convert;
+  char              *name;       /* column name, for Hash rows */
+  bool              projected;   /* false when the query doesn't use the column */
+  Oid               typid;
+  int32             typmod;
+  FmgrInfo          input;       /* type input function, for values given as strings */
+  Oid               ioparam;
+  struct RClass     *time_class;
+
+  /* Arrays and ranges: how to build their elements */
+  HolycornConverter *element;
+  int16             elmlen;
+  bool              elmbyval;
+  char              elmalign;
+  TypeCacheEntry    *typcache;
+};
+
+/*
+ * Conversion plan of a scan, built once from the slot's TupleDesc: one
+ * converter per attribute, chosen from the column type.
+ */
+typedef struct HolycornRowConverter {
+  int               natts;
+  HolycornConverter *columns;
+} HolycornRowConverter;
+
+HolycornRowConverter *holycorn_build_converters(mrb_state *mrb, TupleDesc tupdesc);
+void holycorn_convert_row(mrb_state *mrb, HolycornRowConverter *converters, mrb_value row,
+    Datum *values, bool *isnull);
+mrb_value holycorn_datum_to_mrb(mrb_state *mrb, Datum value, bool isnull, Oid typid);
+mrb_value holycorn_row_to_mrb(mrb_state *mrb, TupleDesc tupdesc, Datum *values, bool *isnull);
+
+/*
+ * Microseconds since the Unix epoch of an instant given in seconds, false
+ * when it is out of the range of timestamps.
+ */
+bool holycorn_unix_usecs(int64 seconds, int64 usec, int64 *usecs);
+bool holycorn_unix_usecs_float(double seconds, int64 *usecs);
+
+#endif
@@ -1,14 +1,15 @@
 class Producer
+  def self.yields_rows
+    true
+  end
+
   def initialize(env = {}) # env contains informations provided by Holycorn
   end
 
   def each
-    @enum ||= Enumerator.new do |y|
-      10.times do |t|
-        y.yield [ "Hello #{t}" ]
-      end
+    10.times do |t|
+      yield [ "Hello #{t}" ]
     end
-    @enum.next
   end
   self
 end
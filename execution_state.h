@@ -1,9 +1,72 @@
+#if PG_VERSION_NUM >= 90600
+/* Shared by the participants of a parallel scan */
+typedef struct HolycornParallelState
+{
+  pg_atomic_uint32 next_partition;
+  int npartitions;
+} HolycornParallelState;
+#else
+typedef struct HolycornParallelState HolycornParallelState;
+#endif
+
 typedef struct HolycornExecutionState
 {
   char  *wrapper_path;
-  mrb_value * mrb_state;
+  char  *wrapper;  /* class or path, for EXPLAIN and holycorn_stat_wrappers */
+  HolycornVM *vm;
+  mrb_state * mrb_state;
+  HolycornPlanState *hps;
+  mrb_value class;
+  mrb_value env;
   mrb_value iterator;
+  bool started;  /* the wrapper has been given the quals of this (re)scan */
   List  *options;
   mrb_value options_hash;
   int passes;
+  HolycornRowConverter *converters;
+  int arena_idx;
+
+  /* #each_batch buffering */
+  bool batched;
+  bool streamed;      /* block-form #each, run by a Holycorn::Stream */
+  mrb_value stream;   /* nil until the first batch of the (re)scan or partition */
+  int batch_size;
+  mrb_value batch;
+  int batch_pos;
+  int batch_len;
+  bool exhausted;
+
+  /* Partitioned (parallel) scans */
+  bool partitioned;
+  mrb_value partitions;
+  int npartitions;
+  int next_partition;
+  bool in_partition;
+  HolycornParallelState *pstate;
+
+  /* Pushed down quals */
+  List *value_states;         /* ExprState of each value, in fdw_exprs order */
+  Bitmapset *value_params;    /* PARAM_EXEC ids the values depend on */
+
+  /* Pushed down LIMIT: the scan skips offset rows and returns limit more */
+  int limit;                  /* -1 for none */
+  int offset;
+  int64 position;             /* rows fetched in this (re)scan */
+
+  /* Rows of the first pass, replayed by rescans */
+  bool caching;
+  Tuplestorestate *cache;
+  bool cache_complete;
+  bool replaying;
+  TupleTableSlot *replay_slot;
+
+  /* Shared result cache (cache_ttl) */
+  const char *result_cache_status;  /* for EXPLAIN ANALYZE, NULL when not used */
+  char *result_cache_key;           /* set while this scan loads the rows */
+  StringInfo result_cache_rows;
+
+  /* execution 'worker' */
+  HolycornWorker *worker;
+
+  HolycornScanStats stats;
 } HolycornExecutionState;
@@ -0,0 +1,41 @@
+\echo Use "CREATE EXTENSION holycorn" to load this file. \quit
+
+CREATE FUNCTION holycorn_handler()
+RETURNS fdw_handler
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION holycorn_validator(text[], oid)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FOREIGN DATA WRAPPER holycorn
+  HANDLER holycorn_handler
+  VALIDATOR holycorn_validator;
+
+CREATE FUNCTION holycorn_stat_wrappers(
+    OUT wrapper text,
+    OUT scans int8,
+    OUT rows int8,
+    OUT batches int8,
+    OUT vm_startup_time float8,
+    OUT constructor_time float8,
+    OUT fetch_time float8,
+    OUT conversion_time float8,
+    OUT peak_heap int8,
+    OUT peak_objects int8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION holycorn_stat_wrappers_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+REVOKE ALL ON FUNCTION holycorn_stat_wrappers_reset() FROM PUBLIC;
+
+CREATE VIEW holycorn_stat_wrappers AS
+  SELECT * FROM holycorn_stat_wrappers();
@@ -1,12 +1,14 @@
 #include "postgres.h"
 
 #include <sys/stat.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "mruby.h"
 #include "mruby/array.h"
+#include "mruby/class.h"
 #include "mruby/proc.h"
 #include "mruby/compile.h"
 #include "mruby/string.h"
@@ -14,28 +16,78 @@
 #include "mruby/hash.h"
 
 #include "access/htup_details.h"
+#if PG_VERSION_NUM >= 120000
+#include "access/relation.h"
+#else
+#include "access/heapam.h"
+#endif
+#if PG_VERSION_NUM >= 90600
+#include "access/parallel.h"
+#include "port/atomics.h"
+#endif
 #include "access/reloptions.h"
+#include "access/skey.h"
 #include "access/sysattr.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_authid.h"
 #include "catalog/pg_foreign_table.h"
+#include "catalog/pg_type.h"
 #include "commands/defrem.h"
 #include "commands/explain.h"
 #include "commands/vacuum.h"
+#include "executor/executor.h"
 #include "foreign/fdwapi.h"
 #include "foreign/foreign.h"
 #include "miscadmin.h"
 #include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#if PG_VERSION_NUM >= 140000
+#include "optimizer/appendinfo.h"
+#endif
 #include "optimizer/cost.h"
+#include "optimizer/paths.h"
 #include "optimizer/pathnode.h"
 #include "optimizer/planmain.h"
 #include "optimizer/restrictinfo.h"
+#if PG_VERSION_NUM >= 120000
+#include "optimizer/optimizer.h"
+#else
 #include "optimizer/var.h"
+#endif
 #include "utils/memutils.h"
 #include "utils/rel.h"
+#if PG_VERSION_NUM >= 90500
+#include "utils/sampling.h"
+#endif
+#include "utils/acl.h"
 #include "utils/builtins.h"
+#if PG_VERSION_NUM >= 90600
+#include "utils/datum.h"
+#endif
+#if PG_VERSION_NUM >= 110000
+#include "utils/format_type.h"
+#endif
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#if PG_VERSION_NUM >= 100000
+#include "utils/ruleutils.h"
+#endif
 #include "utils/timestamp.h"
+#include "utils/tuplestore.h"
 #include "utils/numeric.h"
+#include "vm_pool.h"
+#include "bytecode_cache.h"
+#include "converters.h"
+#include "pushdown.h"
+#include "plan_cache.h"
+#include "stats.h"
+#include "result_cache.h"
+#include "worker.h"
+#include "streaming.h"
+#include "row.h"
 #include "plan_state.h"
 #include "execution_state.h"
+#include "modify_state.h"
 #include "options.h"
 
 PG_MODULE_MAGIC;
@@ -43,8 +95,7 @@ PG_MODULE_MAGIC;
 PG_FUNCTION_INFO_V1(holycorn_handler);
 PG_FUNCTION_INFO_V1(holycorn_validator);
 
-#define POSTGRES_TO_UNIX_EPOCH_DAYS (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE)
-#define POSTGRES_TO_UNIX_EPOCH_USECS (POSTGRES_TO_UNIX_EPOCH_DAYS * USECS_PER_DAY)
+void _PG_init(void);
 
 static void rbGetForeignRelSize(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid);
 static void rbGetForeignPaths(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid);
@@ -57,18 +108,121 @@ static ForeignScan *rbGetForeignPlan(PlannerInfo *root, RelOptInfo *baserel, Oid
 static void rbBeginForeignScan(ForeignScanState *node, int eflags);
 static void rbExplainForeignScan(ForeignScanState *node, ExplainState *es);
 static TupleTableSlot *rbIterateForeignScan(ForeignScanState *node);
-static void fileReScanForeignScan(ForeignScanState *node);
+static void rbReScanForeignScan(ForeignScanState *node);
 static void rbEndForeignScan(ForeignScanState *node);
+static bool rbAnalyzeForeignTable(Relation relation, AcquireSampleRowsFunc *func, BlockNumber *totalpages);
+static int rbAcquireSampleRows(Relation relation, int elevel, HeapTuple *rows, int targrows,
+    double *totalrows, double *totaldeadrows);
 #if (PG_VERSION_NUM >= 90500)
 static List *rbImportForeignSchema(ImportForeignSchemaStmt *stmt, Oid serverOid);
 #endif
+static void rbAddForeignUpdateTargets(
+#if (PG_VERSION_NUM >= 140000)
+    PlannerInfo *root, Index rtindex,
+#else
+    Query *parsetree,
+#endif
+    RangeTblEntry *target_rte, Relation target_relation);
+static List *rbPlanForeignModify(PlannerInfo *root, ModifyTable *plan, Index resultRelation, int subplan_index);
+static void rbBeginForeignModify(ModifyTableState *mtstate, ResultRelInfo *rinfo, List *fdw_private,
+    int subplan_index, int eflags);
+static TupleTableSlot *rbExecForeignInsert(EState *estate, ResultRelInfo *rinfo, TupleTableSlot *slot,
+    TupleTableSlot *planSlot);
+static TupleTableSlot *rbExecForeignUpdate(EState *estate, ResultRelInfo *rinfo, TupleTableSlot *slot,
+    TupleTableSlot *planSlot);
+static TupleTableSlot *rbExecForeignDelete(EState *estate, ResultRelInfo *rinfo, TupleTableSlot *slot,
+    TupleTableSlot *planSlot);
+static void rbEndForeignModify(EState *estate, ResultRelInfo *rinfo);
+#if (PG_VERSION_NUM >= 110000)
+static void rbBeginForeignInsert(ModifyTableState *mtstate, ResultRelInfo *rinfo);
+static void rbEndForeignInsert(EState *estate, ResultRelInfo *rinfo);
+#endif
+#if (PG_VERSION_NUM >= 140000)
+static TupleTableSlot **rbExecForeignBatchInsert(EState *estate, ResultRelInfo *rinfo, TupleTableSlot **slots,
+    TupleTableSlot **planSlots, int *numSlots);
+static int rbGetForeignModifyBatchSize(ResultRelInfo *rinfo);
+#endif
+#if (PG_VERSION_NUM >= 90600)
+static bool rbIsForeignScanParallelSafe(PlannerInfo *root, RelOptInfo *rel, RangeTblEntry *rte);
+static Size rbEstimateDSMForeignScan(ForeignScanState *node, ParallelContext *pcxt);
+static void rbInitializeDSMForeignScan(ForeignScanState *node, ParallelContext *pcxt, void *coordinate);
+static void rbInitializeWorkerForeignScan(ForeignScanState *node, shm_toc *toc, void *coordinate);
+#endif
+#if (PG_VERSION_NUM >= 100000)
+static void rbReInitializeDSMForeignScan(ForeignScanState *node, ParallelContext *pcxt, void *coordinate);
+#endif
 
+static int rbParsePositiveInt(DefElem *def);
+static int rbParseUnit(DefElem *def, int unit, const char *kind);
+static bool rbParseExecution(DefElem *def);
+static void rbCheckPathOption(DefElem *def);
 static void rbGetOptions(Oid foreigntableid, HolycornPlanState *state, List **other_options);
+static char *rbWrapperKey(char *wrapper_path, char *wrapper_class, List *options);
+static mrb_value rbLoadWrapper(mrb_state *mrb, char *wrapper_path, char *wrapper_class);
+static mrb_value rbNewWrapper(mrb_state *mrb, mrb_value class, mrb_value env, HolycornPlanState *state);
+static mrb_value rbBuildEnv(mrb_state *mrb, HolycornPlanState *state);
+static mrb_value rbQualToMrb(mrb_state *mrb, char *column, char *operator, mrb_value value, bool has_value);
+static void rbSetAttributes(mrb_state *mrb, mrb_value env, TupleDesc tupdesc);
+static void rbSetOrderAndLimit(mrb_state *mrb, mrb_value env, TupleDesc tupdesc, List *order, int limit, int offset);
+static void rbCollectQuals(PlannerInfo *root, RelOptInfo *baserel, HolycornPlanState *state);
+static char *rbPlanInfoKey(HolycornPlanState *state, TupleDesc tupdesc);
+static double rbEstimateNumber(mrb_state *mrb, mrb_value estimate, const char *key, double default_value);
+static void rbGetPlanInfo(HolycornPlanState *state, TupleDesc tupdesc, HolycornPlanInfo *info);
+static List *rbSerializePlanState(HolycornPlanState *state, List *quals, List *columns, List *path_private);
+static HolycornPlanState *rbDeserializePlanState(List *fdw_private);
+static bool rbIsLookupClause(PlannerInfo *root, RelOptInfo *baserel, HolycornPlanState *state, RestrictInfo *rinfo);
+static bool rbMatchesIndexedColumn(PlannerInfo *root, RelOptInfo *rel, EquivalenceClass *ec,
+    EquivalenceMember *em, void *arg);
+static void rbAddParameterizedPaths(PlannerInfo *root, RelOptInfo *baserel, HolycornPlanState *state);
+static bool rbPathKeySortKey(RelOptInfo *baserel, PathKey *pathkey, int *key);
+static bool rbMatchOrdering(RelOptInfo *baserel, HolycornPlanState *state, List *pathkeys, List **order);
+#if PG_VERSION_NUM >= 120000
+static void rbGetForeignUpperPaths(PlannerInfo *root, UpperRelationKind stage, RelOptInfo *input_rel,
+    RelOptInfo *output_rel, void *extra);
+static bool rbLimitConst(Node *node, int64 *value);
+#endif
 static void estimate_costs(PlannerInfo *root, RelOptInfo *baserel,
     HolycornPlanState *fdw_private,
     Cost *startup_cost, Cost *total_cost);
 
-Datum handle_column(mrb_value *, TupleTableSlot *, int, mrb_value);
+static bool rbStopIteration(mrb_state *mrb);
+static bool rbCollectParamIds(Node *node, Bitmapset **paramids);
+static void rbSetQuals(ForeignScanState *node, HolycornExecutionState *exec_state);
+static void rbStartWrapper(ForeignScanState *node, HolycornExecutionState *exec_state);
+static char *rbResultCacheKey(ForeignScanState *node, HolycornExecutionState *exec_state);
+static char *rbWorkerSpec(ForeignScanState *node, HolycornExecutionState *exec_state);
+static bool rbNextWorkerRow(ForeignScanState *node, HolycornExecutionState *exec_state, TupleTableSlot *slot);
+static void rbStopWorker(HolycornExecutionState *exec_state);
+static void rbFinishRows(HolycornExecutionState *exec_state);
+static void rbKeepRow(HolycornExecutionState *exec_state, TupleTableSlot *slot);
+static HolycornModifyState *rbBeginModify(ResultRelInfo *rinfo, CmdType operation, Plan *subplan);
+static mrb_value rbOldRow(HolycornModifyState *state, TupleTableSlot *planSlot);
+static mrb_value rbNewRow(HolycornModifyState *state, TupleTableSlot *slot);
+static void rbBufferRow(HolycornModifyState *state, mrb_value row);
+static void rbFlushRows(HolycornModifyState *state);
+
+static void rbSetRowProtocol(HolycornExecutionState *exec_state);
+static void rbDropStream(HolycornExecutionState *exec_state);
+static mrb_value rbNextStreamBatch(HolycornExecutionState *exec_state);
+static mrb_value rbNextWrapperRow(HolycornExecutionState *exec_state);
+static void rbLoadPartitions(HolycornExecutionState *exec_state, mrb_value class, mrb_value env);
+static bool rbClaimPartition(HolycornExecutionState *exec_state);
+static mrb_value rbNextRow(HolycornExecutionState *exec_state);
+static bool rbFetchRow(ForeignScanState *node, HolycornExecutionState *exec_state, TupleTableSlot *slot);
+static HeapTuple rbFormSampleRow(HolycornExecutionState *exec_state, TupleDesc tupdesc, mrb_value row,
+    MemoryContext tupcontext);
+static void rbSampleVM(HolycornExecutionState *exec_state);
+static void rbExplainTime(const char *label, double value, ExplainState *es);
+static void rbExplainCount(const char *label, const char *unit, int64 value, ExplainState *es);
+
+void _PG_init(void) {
+  holycorn_vm_pool_init();
+  holycorn_bytecode_cache_init();
+  holycorn_plan_cache_init();
+  holycorn_stats_init();
+  holycorn_result_cache_init();
+  holycorn_worker_init();
+}
 
 Datum holycorn_handler(PG_FUNCTION_ARGS) {
   FdwRoutine *fdwroutine = makeNode(FdwRoutine);
@@ -76,19 +230,53 @@ Datum holycorn_handler(PG_FUNCTION_ARGS) {
   fdwroutine->GetForeignRelSize  = rbGetForeignRelSize;
   fdwroutine->GetForeignPaths    = rbGetForeignPaths;
   fdwroutine->GetForeignPlan     = rbGetForeignPlan;
+#if (PG_VERSION_NUM >= 120000)
+  /* LIMIT pushdown */
+  fdwroutine->GetForeignUpperPaths = rbGetForeignUpperPaths;
+#endif
 
   fdwroutine->BeginForeignScan   = rbBeginForeignScan;
   fdwroutine->IterateForeignScan = rbIterateForeignScan;
   fdwroutine->EndForeignScan     = rbEndForeignScan;
   fdwroutine->ExplainForeignScan = rbExplainForeignScan;
 
-  fdwroutine->ReScanForeignScan  = fileReScanForeignScan;
+  fdwroutine->ReScanForeignScan  = rbReScanForeignScan;
+
+  fdwroutine->AnalyzeForeignTable = rbAnalyzeForeignTable;
 
 #if (PG_VERSION_NUM >= 90500)
   /* support for IMPORT FOREIGN SCHEMA */
   fdwroutine->ImportForeignSchema = rbImportForeignSchema;
 #endif
 
+  /* writes, dispatched to the wrapper by batches */
+  fdwroutine->AddForeignUpdateTargets = rbAddForeignUpdateTargets;
+  fdwroutine->PlanForeignModify       = rbPlanForeignModify;
+  fdwroutine->BeginForeignModify      = rbBeginForeignModify;
+  fdwroutine->ExecForeignInsert       = rbExecForeignInsert;
+  fdwroutine->ExecForeignUpdate       = rbExecForeignUpdate;
+  fdwroutine->ExecForeignDelete       = rbExecForeignDelete;
+  fdwroutine->EndForeignModify        = rbEndForeignModify;
+#if (PG_VERSION_NUM >= 110000)
+  fdwroutine->BeginForeignInsert      = rbBeginForeignInsert;
+  fdwroutine->EndForeignInsert        = rbEndForeignInsert;
+#endif
+#if (PG_VERSION_NUM >= 140000)
+  fdwroutine->ExecForeignBatchInsert     = rbExecForeignBatchInsert;
+  fdwroutine->GetForeignModifyBatchSize  = rbGetForeignModifyBatchSize;
+#endif
+
+#if (PG_VERSION_NUM >= 90600)
+  /* parallel scans of partitioned wrappers */
+  fdwroutine->IsForeignScanParallelSafe    = rbIsForeignScanParallelSafe;
+  fdwroutine->EstimateDSMForeignScan       = rbEstimateDSMForeignScan;
+  fdwroutine->InitializeDSMForeignScan     = rbInitializeDSMForeignScan;
+  fdwroutine->InitializeWorkerForeignScan  = rbInitializeWorkerForeignScan;
+#endif
+#if (PG_VERSION_NUM >= 100000)
+  fdwroutine->ReInitializeDSMForeignScan   = rbReInitializeDSMForeignScan;
+#endif
+
   PG_RETURN_POINTER(fdwroutine);
 }
 
@@ -121,7 +309,27 @@ Datum holycorn_validator(PG_FUNCTION_ARGS) {
             (errcode(ERRCODE_SYNTAX_ERROR),
              errmsg("conflicting or redundant options")));
       wrapper_class = defGetString(def);
+    }
+    else if (strcmp(def->defname, "batch_size") == 0) {
+      rbParsePositiveInt(def);
+    }
+    else if (strcmp(def->defname, "parallel_safe") == 0) {
+      defGetBoolean(def);
+    }
+    else if (strcmp(def->defname, "memory_limit") == 0) {
+      rbParseUnit(def, GUC_UNIT_KB, "a memory size");
+    }
+    else if (strcmp(def->defname, "cache_ttl") == 0) {
+      rbParseUnit(def, GUC_UNIT_S, "a duration");
+    }
+    else if (strcmp(def->defname, "cache_rescans") == 0) {
+      defGetBoolean(def);
+    }
+    else if (strcmp(def->defname, "execution") == 0) {
+      rbParseExecution(def);
     } else {
+      if (strcmp(def->defname, "path") == 0)
+        rbCheckPathOption(def);
       other_options = lappend(other_options, def);
     }
   }
@@ -133,35 +341,124 @@ Datum holycorn_validator(PG_FUNCTION_ARGS) {
   PG_RETURN_VOID();
 }
 
+static int rbParsePositiveInt(DefElem *def) {
+  char *value = defGetString(def);
+  char *end;
+  long parsed;
+
+  errno = 0;
+  parsed = strtol(value, &end, 10);
+
+  if (errno != 0 || *end != '\0' || end == value || parsed <= 0 || parsed > INT_MAX)
+    ereport(ERROR,
+        (errcode(ERRCODE_FDW_INVALID_OPTION_VALUE),
+         errmsg("[holycorn] %s requires a positive integer (was \"%s\")", def->defname, value)));
+
+  return (int) parsed;
+}
+
+/*
+ * Memory sizes and durations, in the given GUC unit unless the value has one
+ * (like '64MB' or '5min')
+ */
+static int rbParseUnit(DefElem *def, int unit, const char *kind) {
+  char *value = defGetString(def);
+  const char *hint = NULL;
+  int parsed;
+
+  if (!parse_int(value, &parsed, unit, &hint) || parsed < 0)
+    ereport(ERROR,
+        (errcode(ERRCODE_FDW_INVALID_OPTION_VALUE),
+         errmsg("[holycorn] %s requires %s (was \"%s\")", def->defname, kind, value),
+         hint ? errhint("%s", hint) : 0));
+
+  return parsed;
+}
+
+/*
+ * path makes HolycornFile read files (or globs of files) as the server's OS
+ * user, config and key files included: as with file_fdw's filename, only the
+ * roles allowed to read server files may set it.
+ */
+static void rbCheckPathOption(DefElem *def) {
+#if PG_VERSION_NUM >= 140000
+  if (!is_member_of_role(GetUserId(), ROLE_PG_READ_SERVER_FILES))
+#elif PG_VERSION_NUM >= 110000
+  if (!is_member_of_role(GetUserId(), DEFAULT_ROLE_READ_SERVER_FILES))
+#else
+  if (!superuser())
+#endif
+    ereport(ERROR,
+        (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+#if PG_VERSION_NUM >= 110000
+         errmsg("[holycorn] only superusers and members of pg_read_server_files can set the \"%s\" option",
+#else
+         errmsg("[holycorn] only superusers can set the \"%s\" option",
+#endif
+           def->defname)));
+}
+
+/* execution: 'backend' (the default) or 'worker', true for the latter */
+static bool rbParseExecution(DefElem *def) {
+  char *value = defGetString(def);
+
+  if (strcmp(value, "backend") == 0)
+    return false;
+
+  if (strcmp(value, "worker") != 0)
+    ereport(ERROR,
+        (errcode(ERRCODE_FDW_INVALID_OPTION_VALUE),
+         errmsg("[holycorn] invalid value for option \"%s\": \"%s\"", def->defname, value),
+         errhint("Valid values are \"backend\" and \"worker\".")));
+
+#if PG_VERSION_NUM < 100000
+  ereport(ERROR,
+      (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+       errmsg("[holycorn] execution 'worker' requires PostgreSQL 10 or later")));
+#endif
+
+  return true;
+}
+
 static void rbGetOptions(Oid foreigntableid, HolycornPlanState *state, List **other_options) {
   ForeignTable *table;
-  List     *options;
-  ListCell   *lc,
-             *prev;
+  List     *options = NIL;  /* the options passed on to the wrapper */
+  ListCell   *lc;
 
   table = GetForeignTable(foreigntableid);
 
-  options = NIL;
-  options = list_concat(options, table->options);
-
-  prev = NULL;
-
   /* Set default values */
   state->wrapper_path  = NULL;
   state->wrapper_class = NULL;
-
-  foreach(lc, options) {
+  state->batch_size    = DEFAULT_BATCH_SIZE;
+  state->parallel_safe = false;
+  state->memory_limit  = holycorn_vm_memory_limit;
+  state->cache_rescans = true;
+  state->cache_ttl     = 0;
+  state->worker        = false;
+
+  foreach(lc, table->options) {
     DefElem *def = (DefElem *) lfirst(lc);
 
     if (strcmp(def->defname, "wrapper_path") == 0) { /* Extract the wrapper_path */
       state->wrapper_path = defGetString(def);
-      options = list_delete_cell(options, lc, prev);
     } else if (strcmp(def->defname, "wrapper_class") == 0) { /* Extract the wrapper_class */
       state->wrapper_class = defGetString(def);
-      options = list_delete_cell(options, lc, prev);
+    } else if (strcmp(def->defname, "batch_size") == 0) { /* Rows requested per #each_batch call */
+      state->batch_size = rbParsePositiveInt(def);
+    } else if (strcmp(def->defname, "parallel_safe") == 0) { /* Wrapper can run in parallel workers */
+      state->parallel_safe = defGetBoolean(def);
+    } else if (strcmp(def->defname, "memory_limit") == 0) { /* Memory the VM can allocate */
+      state->memory_limit = rbParseUnit(def, GUC_UNIT_KB, "a memory size");
+    } else if (strcmp(def->defname, "cache_rescans") == 0) { /* Replay the first pass on rescans */
+      state->cache_rescans = defGetBoolean(def);
+    } else if (strcmp(def->defname, "cache_ttl") == 0) { /* Share the rows with other backends */
+      state->cache_ttl = rbParseUnit(def, GUC_UNIT_S, "a duration");
+    } else if (strcmp(def->defname, "execution") == 0) { /* Run the wrapper in a background worker */
+      state->worker = rbParseExecution(def);
+    } else {
+      options = lappend(options, def);
     }
-
-    prev = lc;
   }
 
   if (state->wrapper_path != NULL && state->wrapper_class != NULL) {
@@ -171,406 +468,2654 @@ static void rbGetOptions(Oid foreigntableid, HolycornPlanState *state, List **ot
   *other_options = options;
 }
 
-static void rbGetForeignRelSize(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid) {
-
-  HolycornPlanState *fdw_private = (HolycornPlanState *) palloc(sizeof(HolycornPlanState));
-  rbGetOptions(foreigntableid, fdw_private, &fdw_private->options);
-  baserel->fdw_private = (void *) fdw_private;
-}
+/*
+ * Identity of a wrapper instance, used to hand out pooled VMs: scans of the
+ * same wrapper with the same options can share a warm interpreter.
+ */
+static char *rbWrapperKey(char *wrapper_path, char *wrapper_class, List *options) {
+  StringInfoData key;
+  ListCell *cell;
 
-static void rbGetForeignPaths(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid) {
-  HolycornPlanState *fdw_private = (HolycornPlanState *) baserel->fdw_private;
-  Cost    startup_cost;
-  Cost    total_cost;
-  List *coptions = NIL;
+  initStringInfo(&key);
 
-  /* Estimate costs */
-  estimate_costs(root, baserel, fdw_private, &startup_cost, &total_cost);
+  if (wrapper_path)
+    appendStringInfo(&key, "path:%s", wrapper_path);
+  else
+    appendStringInfo(&key, "class:%s", wrapper_class);
 
-  /*
-   * Create a ForeignPath node and add it as only possible path.  We use the
-   * fdw_private list of the path to carry the convert_selectively option;
-   * it will be propagated into the fdw_private list of the Plan node.
-   */
-  Path * path = (Path*)create_foreignscan_path(root, baserel,
-#if PG_VERSION_NUM >= 90600
-      NULL, /* default pathtarget */
-#endif
-      baserel->rows, startup_cost, total_cost,
-      NIL,    /* no pathkeys */
-      NULL,   /* no outer rel either */
-#if PG_VERSION_NUM >= 90500
-      NULL,    /* no extra plan */
-#endif
-      coptions);
+  foreach(cell, options) {
+    DefElem *def = (DefElem *) lfirst(cell);
+    appendStringInfo(&key, "\n%s=%s", def->defname, defGetString(def));
+  }
 
-  add_path(baserel, path);
+  return key.data;
 }
 
-static ForeignScan * rbGetForeignPlan(
-  PlannerInfo *root,
-  RelOptInfo *baserel,
-  Oid foreigntableid,
-  ForeignPath *best_path,
-  List *tlist,
-  List *scan_clauses
-#if (PG_VERSION_NUM >= 90500)
-  , Plan *outer_plan
-#endif
-  )
-{
-  Index scan_relid = baserel->relid;
-  scan_clauses = extract_actual_clauses(scan_clauses, false);
+static mrb_value rbLoadWrapper(mrb_state *mrb, char *wrapper_path, char *wrapper_class) {
+  mrb_value class;
 
-  best_path->fdw_private = baserel->fdw_private;
-  ForeignScan * scan = make_foreignscan(
-    tlist,
-    scan_clauses,
-    scan_relid,
-    NIL,
-    best_path->fdw_private
-#if PG_VERSION_NUM >= 90500
-    , NIL
-    , NIL
-    , outer_plan
-#endif
-    );
+  if(wrapper_path) {
+    class = holycorn_load_wrapper_script(mrb, wrapper_path);
+  } else {
+    class = mrb_obj_value(mrb_class_get(mrb, wrapper_class));
+  }
 
-  return scan;
+  return class;
 }
 
-static void rbExplainForeignScan(ForeignScanState *node, ExplainState *es) {
-}
+static mrb_value rbNewWrapper(mrb_state *mrb, mrb_value class, mrb_value env, HolycornPlanState *state) {
+  mrb_value wrapper = mrb_funcall(mrb, class, "new", 1, env);
 
-static void rbBeginForeignScan(ForeignScanState *node, int eflags) {
-  HolycornExecutionState *exec_state = (HolycornExecutionState *)palloc(sizeof(HolycornExecutionState));
+  if (mrb_exception_p(wrapper)) {
+    mrb_value message = mrb_funcall(mrb, wrapper, "inspect", NULL);
+    mrb_value pretty_params = mrb_funcall(mrb, env, "inspect", NULL);
+    elog(ERROR,
+        "[holycorn] Instantiating %s raised an exception:\n%s\n (params: %s)\n",
+        state->wrapper_class ? state->wrapper_class : state->wrapper_path,
+        RSTRING_PTR(message),
+        RSTRING_PTR(pretty_params));
+  }
 
-  ForeignScan *plan = (ForeignScan *)node->ss.ps.plan;
+  return wrapper;
+}
 
-  HolycornPlanState * hps = (HolycornPlanState*)plan->fdw_private;
+/* The hash given to wrappers on instantiation (and to their class callbacks) */
+static mrb_value rbBuildEnv(mrb_state *mrb, HolycornPlanState *state) {
+  mrb_value env = mrb_hash_new(mrb);
+  ListCell *cell;
 
-  exec_state->mrb_state = mrb_open();
+#define HASH_SET(hash, key, val) \
+  mrb_hash_set(mrb, hash, mrb_str_new_lit(mrb, key), val);
 
-  mrb_value class;
+  HASH_SET(env, "PG_VERSION",         mrb_str_new_lit(mrb, PG_VERSION));
+  HASH_SET(env, "PG_VERSION_NUM",     mrb_float_value(mrb, PG_VERSION_NUM));
+  HASH_SET(env, "PACKAGE_STRING",     mrb_str_new_lit(mrb, PACKAGE_STRING));
+  HASH_SET(env, "PACKAGE_VERSION",    mrb_str_new_lit(mrb, PACKAGE_VERSION));
+  HASH_SET(env, "MRUBY_RUBY_VERSION", mrb_str_new_lit(mrb, MRUBY_RUBY_VERSION));
 
-  if(hps->wrapper_path) {
-    FILE *source = fopen(hps->wrapper_path,"r");
-    class = mrb_load_file(exec_state->mrb_state, source);
-    fclose(source);
-  } else {
-    class = mrb_obj_value(mrb_class_get(exec_state->mrb_state, hps->wrapper_class));
+  foreach(cell, state->options) {
+    DefElem *def = (DefElem *) lfirst(cell);
+    char *key = def->defname;
+    char *val = defGetString(def);
+
+    mrb_hash_set(mrb, env, mrb_str_new(mrb, key, strlen(key)), mrb_str_new(mrb, val, strlen(val)));
   }
 
-  mrb_value params = mrb_hash_new(exec_state->mrb_state);
+  return env;
+}
 
-#define HASH_SET(hash, key, val) \
-  mrb_hash_set(exec_state->mrb_state, hash, mrb_str_new_lit(exec_state->mrb_state, key), val);
+/*
+ * A qual as given to wrappers: {"column" => ..., "operator" => ..., "value" => ...}.
+ * LIKE patterns made of a literal followed by a single trailing % also get
+ * that literal as "prefix".
+ */
+static mrb_value rbQualToMrb(mrb_state *mrb, char *column, char *operator, mrb_value value, bool has_value) {
+  mrb_value qual = mrb_hash_new(mrb);
 
-  HASH_SET(params, "PG_VERSION",         mrb_str_new_lit(exec_state->mrb_state, PG_VERSION));
-  HASH_SET(params, "PG_VERSION_NUM",     mrb_float_value(exec_state->mrb_state, PG_VERSION_NUM));
-  HASH_SET(params, "PACKAGE_STRING",     mrb_str_new_lit(exec_state->mrb_state, PACKAGE_STRING));
-  HASH_SET(params, "PACKAGE_VERSION",    mrb_str_new_lit(exec_state->mrb_state, PACKAGE_VERSION));
-  HASH_SET(params, "MRUBY_RUBY_VERSION", mrb_str_new_lit(exec_state->mrb_state, MRUBY_RUBY_VERSION));
+  HASH_SET(qual, "column", mrb_str_new_cstr(mrb, column));
+  HASH_SET(qual, "operator", mrb_str_new_cstr(mrb, operator));
 
-  ListCell   *cell;
-  foreach(cell, hps->options) {
-    DefElem    *def = (DefElem *) lfirst(cell);
+  if (!has_value)
+    return qual;
 
-    char * key = def->defname;
-    char * val = defGetString(def);
+  HASH_SET(qual, "value", value);
 
-    mrb_hash_set( \
-        exec_state->mrb_state, \
-        params, \
-        mrb_str_new(exec_state->mrb_state, key, strlen(key)), \
-        mrb_str_new(exec_state->mrb_state, val, strlen(val)));
+  if (strcmp(operator, "like") == 0 && mrb_string_p(value)) {
+    const char *pattern = RSTRING_PTR(value);
+    mrb_int len = RSTRING_LEN(value);
+    mrb_int literal = strcspn(pattern, "%_\\");
+
+    if (literal == len - 1 && pattern[literal] == '%')
+      HASH_SET(qual, "prefix", mrb_str_new(mrb, pattern, literal));
   }
 
-  exec_state->iterator = mrb_funcall(exec_state->mrb_state, class, "new", 1, params);
+  return qual;
+}
 
-  if (mrb_exception_p(exec_state->iterator)) {
-    mrb_value message = mrb_funcall(exec_state->mrb_state, exec_state->iterator, "inspect", NULL);
-    mrb_value pretty_params = mrb_funcall(exec_state->mrb_state, params, "inspect", NULL);
-    elog(ERROR,
-        "[holycorn] Instantiating %s raised an exception:\n%s\n (params: %s)\n",
-        hps->wrapper_class,
-        RSTRING_PTR(message),
-        RSTRING_PTR(pretty_params));
+/*
+ * Sets env["attributes"]: the name and type of each column of the table, in
+ * column order (nil for dropped columns), which lets wrappers build Array rows
+ * and parse values according to the columns they end up in.
+ */
+static void rbSetAttributes(mrb_state *mrb, mrb_value env, TupleDesc tupdesc) {
+  mrb_value attributes = mrb_ary_new_capa(mrb, tupdesc->natts);
+
+  for (int i = 0; i < tupdesc->natts; i++) {
+    Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+    char *type;
+
+    if (attr->attisdropped) {
+      mrb_ary_push(mrb, attributes, mrb_nil_value());
+      continue;
+    }
+
+    type = format_type_be(attr->atttypid);
+    mrb_ary_push(mrb, attributes, mrb_assoc_new(mrb,
+          mrb_str_new_cstr(mrb, NameStr(attr->attname)), mrb_str_new_cstr(mrb, type)));
   }
 
-  node->fdw_state = (void *) exec_state;
+  HASH_SET(env, "attributes", attributes);
 }
 
-static TupleTableSlot * rbIterateForeignScan(ForeignScanState *node) {
-  HolycornExecutionState *exec_state = (HolycornExecutionState *) node->fdw_state;
-  TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
-  char * output_str;
+/*
+ * Sets env["order_by"], the [column, "asc" or "desc"] keys of the order the
+ * scan needs its rows in, and env["limit"] and env["offset"]: the scan skips
+ * the first offset rows the wrapper returns, and stops after limit more. They
+ * are left unset when the scan has no such needs.
+ */
+static void rbSetOrderAndLimit(mrb_state *mrb, mrb_value env, TupleDesc tupdesc, List *order, int limit, int offset) {
+  ListCell *cell;
 
-#define StringDatumFromChars(column) \
-  output_str = (char *)palloc(sizeof(char) * RSTRING_LEN(column) + 2); /* 2 = 1 prefix (string) + 1 suffix (NULL) */ \
-  sprintf(output_str, "s%s\0", RSTRING_PTR(column)); \
-  CStringGetDatum(output_str);
+  if (order != NIL) {
+    mrb_value keys = mrb_ary_new_capa(mrb, list_length(order));
 
-#define INSPECT \
-  column = mrb_funcall(exec_state->mrb_state, column, "inspect", 0, NULL); \
-  slot->tts_isnull[i] = false; \
-  slot->tts_values[i] = StringDatumFromChars(column);
+    foreach(cell, order) {
+      int key = intVal(lfirst(cell));
+      Form_pg_attribute attr = TupleDescAttr(tupdesc, Abs(key) - 1);
 
-  ExecClearTuple(slot);
+      mrb_ary_push(mrb, keys, mrb_assoc_new(mrb, mrb_str_new_cstr(mrb, NameStr(attr->attname)),
+            key < 0 ? mrb_str_new_lit(mrb, "desc") : mrb_str_new_lit(mrb, "asc")));
+    }
 
-  mrb_value output = mrb_funcall(exec_state->mrb_state, exec_state->iterator, "each", 0, NULL);
+    HASH_SET(env, "order_by", keys);
+  }
 
-  if (!mrb_array_p(output)) {
-    output = mrb_funcall(exec_state->mrb_state, output, "inspect", 0, NULL);
-    elog(LOG, "#each must provide an array (was %s)", RSTRING_PTR(output));
-    return NULL;
-  } else {
-    slot->tts_nvalid = RARRAY_LEN(output);
+  if (limit >= 0) {
+    HASH_SET(env, "limit", mrb_fixnum_value(limit));
+    HASH_SET(env, "offset", mrb_fixnum_value(offset));
+  }
+}
 
-    slot->tts_isempty = false;
-    slot->tts_isnull = (bool *)palloc(sizeof(bool) * slot->tts_nvalid);
-    slot->tts_values = (Datum *)palloc(sizeof(Datum) * slot->tts_nvalid);
+/* Collects the restriction clauses wrappers can be told about */
+static void rbCollectQuals(PlannerInfo *root, RelOptInfo *baserel, HolycornPlanState *state) {
+  ListCell *lc;
 
-    if (slot->tts_nvalid <= 0) { //TODO: the size can't be < 0 but being defensive is OK :-)
-      slot->tts_isempty = true;
-    } else {
-      Datum outputDatum;
-      for(int i = 0; i < slot->tts_nvalid; i++) {
-        slot->tts_isnull[i] = true;
-        slot->tts_values[i] = NULL;
-        mrb_value column = mrb_ary_entry(output, i);
-
-        switch(mrb_type(column)) {
-          case MRB_TT_FREE:
-            slot->tts_isnull[i] = true;
-            break;
-          case MRB_TT_FALSE: //TODO: use BoolGetDatum
-            if (!mrb_nil_p(column)) {
-                slot->tts_isnull[i] = true;
-                slot->tts_values[i] = BoolGetDatum(false);
-            }
-            break;
-          case MRB_TT_TRUE:
-            slot->tts_isnull[i] = false;
-            slot->tts_values[i] = BoolGetDatum(true);
-            break;
-          case MRB_TT_FIXNUM:
-            outputDatum = Int64GetDatum(mrb_fixnum(column));
-            slot->tts_isnull[i] = false;
-            slot->tts_values[i] = outputDatum;
-            break;
-          case MRB_TT_SYMBOL: //TODO: use mrb_sym
-            INSPECT
-              break;
-          case MRB_TT_UNDEF:
-            elog(ERROR,"MRB_TT_UNDEF not supported (yet?)");
-            break;
-          case MRB_TT_FLOAT:
-            outputDatum = Float8GetDatum(mrb_flo_to_fixnum(column));
-            slot->tts_isnull[i] = false;
-            slot->tts_values[i] = outputDatum;
-            break;
-          case MRB_TT_CPTR:
-            elog(ERROR,"MRB_TT_CPTR not supported (yet?)");
-            break;
-          case MRB_TT_OBJECT:
-            column = mrb_funcall(exec_state->mrb_state, column, "to_s", 0, NULL);
-            slot->tts_isnull[i] = false;
-            slot->tts_values[i] = StringDatumFromChars(column);
-            break;
-          case MRB_TT_CLASS:
-            column = mrb_funcall(exec_state->mrb_state, column, "class", 0, NULL);
-            column = mrb_funcall(exec_state->mrb_state, column, "to_s", 0, NULL);
-            slot->tts_isnull[i] = false;
-            slot->tts_values[i] = StringDatumFromChars(column);
-            break;
-          case MRB_TT_MODULE:
-            column = mrb_funcall(exec_state->mrb_state, column, "to_s", 0, NULL);
-            slot->tts_isnull[i] = false;
-            slot->tts_values[i] = StringDatumFromChars(column);
-            break;
-          case MRB_TT_ICLASS:
-            elog(ERROR, "MRB_TT_ICLASS not supported (yet?)");
-            break;
-          case MRB_TT_SCLASS:
-            elog(ERROR, "MRB_TT_SCLASS not supported (yet?)");
-            break;
-          case MRB_TT_PROC:
-            INSPECT
-              break;
-          case MRB_TT_ARRAY: //TODO: use array type
-            INSPECT
-              break;
-          case MRB_TT_HASH: //TODO: use json type
-            INSPECT
-              break;
-          case MRB_TT_STRING:
-            slot->tts_isnull[i] = false;
-            slot->tts_values[i] = StringDatumFromChars(column);
-            break;
-          case MRB_TT_RANGE: //TODO: Use the range type
-            // struct RangeBound *range = (RangeBound*)malloc(sizeof(RangeBound));
-            //   {
-            //       Datum       val;            /* the bound value, if any */
-            //       bool        infinite;       /* bound is +/- infinity */
-            //       bool        inclusive;      /* bound is inclusive (vs exclusive) */
-            //       bool        lower;          /* this is the lower (vs upper) bound */
-            //   } RangeBound;
-            // mrb_range_ptr(column)->edges->beg,
-            // mrb_range_ptr(column)->edges->end,
-            // mrb_range_ptr(column)->excl);
-            INSPECT
-              break;
-          case MRB_TT_EXCEPTION:
-            elog(ERROR, "MRB_TT_EXCEPTION not supported (yet?)");
-            break;
-          case MRB_TT_FILE:
-            elog(ERROR, "MRB_TT_FILE not supported (yet?)");
-            break;
-          case MRB_TT_ENV:
-            elog(ERROR, "MRB_TT_ENV not supported (yet?)");
-            break;
-          case MRB_TT_DATA:
-            handle_column(exec_state->mrb_state, slot, i, column);
-            break;
-          case MRB_TT_FIBER:
-            INSPECT
-              break;
-          case MRB_TT_MAXDEFINE:
-            elog(ERROR, "MRB_TT_MAX_DEFINE not supported (yet?)");
-            break;
-          default:
-            slot->tts_isnull[i] = true;
-            elog(ERROR,"unknown type (0x%x)", mrb_type(column));
-            break;
-        }
-        ExecStoreVirtualTuple(slot);
-      }
+  state->quals = NIL;
+  state->qual_clauses = NIL;
+  state->handled_clauses = NIL;
+
+  foreach(lc, baserel->baserestrictinfo) {
+    RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+    HolycornQual *qual = (HolycornQual *) palloc(sizeof(HolycornQual));
+
+    if (rinfo->pseudoconstant || !holycorn_deparse_qual(root, baserel, rinfo->clause, qual)) {
+      pfree(qual);
+      continue;
     }
-    return slot;
+
+    state->quals = lappend(state->quals, qual);
+    state->qual_clauses = lappend(state->qual_clauses, rinfo);
   }
 }
 
-static void fileReScanForeignScan(ForeignScanState *node) {
-}
+/*
+ * Plan cache key: the wrapper identity, the types of the columns and the
+ * quals, with the values known at plan time.
+ */
+static char *rbPlanInfoKey(HolycornPlanState *state, TupleDesc tupdesc) {
+  StringInfoData key;
+  ListCell *lc;
 
-static void rbEndForeignScan(ForeignScanState *node) {
-  HolycornExecutionState *exec_state = (HolycornExecutionState *) node->fdw_state;
-  mrb_close(exec_state->mrb_state);
+  initStringInfo(&key);
+  appendStringInfoString(&key, rbWrapperKey(state->wrapper_path, state->wrapper_class, state->options));
+
+  appendStringInfoString(&key, "\ntypes:");
+  for (int i = 0; i < tupdesc->natts; i++) {
+    Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+
+    appendStringInfo(&key, " %u", attr->attisdropped ? InvalidOid : attr->atttypid);
+  }
+
+  foreach(lc, state->quals) {
+    HolycornQual *qual = (HolycornQual *) lfirst(lc);
+
+    appendStringInfo(&key, "\n%s %s ", qual->column, qual->operator);
+
+    if (qual->value == NULL || !IsA(qual->value, Const)) {
+      appendStringInfoChar(&key, '?');
+    } else if (((Const *) qual->value)->constisnull) {
+      appendStringInfoString(&key, "NULL");
+    } else {
+      Const *value = (Const *) qual->value;
+      Oid output;
+      bool isvarlena;
+
+      getTypeOutputInfo(value->consttype, &output, &isvarlena);
+      appendStringInfo(&key, "%u:%s", value->consttype, OidOutputFunctionCall(output, value->constvalue));
+    }
+  }
+
+  return key.data;
 }
 
-static void estimate_costs(PlannerInfo *root, RelOptInfo *baserel, HolycornPlanState *fdw_private, Cost *startup_cost, Cost *total_cost)
-{
-  BlockNumber pages = fdw_private->pages;
-  double    ntuples = fdw_private->ntuples;
-  Cost    run_cost;
-  Cost    cpu_per_tuple;
+static double rbEstimateNumber(mrb_state *mrb, mrb_value estimate, const char *key, double default_value) {
+  mrb_value value = mrb_hash_get(mrb, estimate, mrb_str_new_cstr(mrb, key));
 
-  *startup_cost = baserel->baserestrictcost.startup;
+  if (mrb_fixnum_p(value))
+    return (double) mrb_fixnum(value);
+  if (mrb_float_p(value))
+    return mrb_float(value);
+  if (!mrb_nil_p(value))
+    ereport(ERROR,
+        (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+         errmsg("[holycorn] .estimate must return numbers (\"%s\" isn't)", key)));
 
-  // Arbitrary choice to make it very expensive
-  run_cost = seq_page_cost * pages;
-  cpu_per_tuple = cpu_tuple_cost * 100 + baserel->baserestrictcost.per_tuple;
-  run_cost += cpu_per_tuple * ntuples;
-  *total_cost = *startup_cost + run_cost;
+  return default_value;
 }
 
-#define IS_A(actual, expected) strcmp(RSTRING_PTR(actual), expected) == 0
+/*
+ * Asks the wrapper class, through its optional class methods:
+ *
+ *   .handled_quals(env, quals): indexes of the quals it evaluates exactly,
+ *   which are not rechecked by the executor
+ *   .estimate(env, quals): a Hash of "rows", "width", "startup_cost" and
+ *   "per_row_cost"
+ *   .partitions(env): whether it is defined, which allows parallel scans
+ *   .indexed_columns(env): names of the columns it can look rows up by, with
+ *   an = qual, cheaply enough for nested loops to do it for each outer row
+ *   .orderings(env, quals): the orders it returns rows in, each an Array of
+ *   "column", "column ASC" or "column DESC" keys
+ *
+ * Values not known at plan time (parameters) are left out of the quals, and
+ * env has the attributes of the table. The answers are cached for
+ * holycorn.estimate_cache_ttl.
+ */
+static void rbGetPlanInfo(HolycornPlanState *state, TupleDesc tupdesc, HolycornPlanInfo *info) {
+  char *key = rbPlanInfoKey(state, tupdesc);
+  HolycornVM *vm;
+  mrb_state *mrb;
+  mrb_value class, env, quals;
+  ListCell *lc;
+
+  if (holycorn_plan_cache_lookup(key, info))
+    return;
 
-Datum handle_column(mrb_value * mrb, TupleTableSlot *slot, int idx, mrb_value rb_obj) {
-  char * output_str = NULL;
-  mrb_value class = mrb_funcall(mrb, rb_obj, "class", 0, NULL);
-  mrb_value class_name = mrb_funcall(mrb, class, "to_s", 0, NULL);
+  memset(info, 0, sizeof(HolycornPlanInfo));
 
-  if(IS_A(class_name, "Time")) {
-    rb_obj = mrb_funcall(mrb, rb_obj, "to_i", 0, NULL);
-    long value = (long)mrb_fixnum(rb_obj);
+  vm = holycorn_vm_acquire(rbWrapperKey(state->wrapper_path, state->wrapper_class, state->options),
+      state->memory_limit);
+  mrb = vm->mrb;
+  class = rbLoadWrapper(mrb, state->wrapper_path, state->wrapper_class);
+  env = rbBuildEnv(mrb, state);
+  rbSetAttributes(mrb, env, tupdesc);
 
-    long int val = (value * 1000000L) - POSTGRES_TO_UNIX_EPOCH_USECS;
-    slot->tts_isnull[idx] = false;
-    slot->tts_values[idx] = Int64GetDatum(val);
-  } else {
-    //TODO: serialize the error type in the column?
-    elog(WARNING, "Unsupported Ruby object (%s). Using #to_s by default", RSTRING_PTR(class_name));
+  quals = mrb_ary_new_capa(mrb, list_length(state->quals));
+  foreach(lc, state->quals) {
+    HolycornQual *qual = (HolycornQual *) lfirst(lc);
+    Const *value = (qual->value && IsA(qual->value, Const)) ? (Const *) qual->value : NULL;
 
-    slot->tts_isnull[idx] = false;
-    slot->tts_values[idx] = StringDatumFromChars(class_name);
+    mrb_ary_push(mrb, quals, rbQualToMrb(mrb, qual->column, qual->operator,
+          value ? holycorn_datum_to_mrb(mrb, value->constvalue, value->constisnull, value->consttype) : mrb_nil_value(),
+          value != NULL));
   }
-}
-#if (PG_VERSION_NUM >= 90500)
-static List *rbImportForeignSchema(ImportForeignSchemaStmt *stmt, Oid serverOid)
-{
-  char * wrapper_path = NULL;
-  char * wrapper_class = NULL;
 
-  mrb_value *state = mrb_open();
+  if (state->quals != NIL && mrb_respond_to(mrb, class, mrb_intern_lit(mrb, "handled_quals"))) {
+    mrb_value handled = mrb_funcall(mrb, class, "handled_quals", 2, env, quals);
+    holycorn_check_exception(mrb, "calling .handled_quals");
 
-  mrb_value params = mrb_hash_new(state);
+    if (mrb_array_p(handled) && RARRAY_LEN(handled) > 0) {
+      info->handled = (int *) palloc(sizeof(int) * RARRAY_LEN(handled));
 
-  List     *commands = NIL;
-  char     **options;
-  StringInfoData cft_stmt;
-  if (strcmp(stmt->remote_schema, "holycorn_schema") != 0) {
-    ereport(ERROR,
-        (errcode(ERRCODE_FDW_SCHEMA_NOT_FOUND),
-         errmsg("Foreign schema \"%s\" is invalid.  Use `holycorn_schema` instead.", stmt->remote_schema)
-        ));
-  }
+      for (mrb_int i = 0; i < RARRAY_LEN(handled); i++) {
+        mrb_value index = mrb_ary_entry(handled, i);
 
-  ListCell *lc;
-  foreach(lc, stmt->options) {
-    DefElem    *def = (DefElem *) lfirst(lc);
-    char * key = def->defname;
-    char * val = defGetString(def);
+        if (!mrb_fixnum_p(index) || mrb_fixnum(index) < 0 || mrb_fixnum(index) >= list_length(state->quals))
+          ereport(ERROR,
+              (errcode(ERRCODE_FDW_ERROR),
+               errmsg("[holycorn] .handled_quals must return indexes of the quals it was given")));
 
-    if (strcmp(def->defname, "wrapper_path") == 0) {
-      if (wrapper_path)
-        ereport(DEBUG1,
-            (errcode(ERRCODE_SYNTAX_ERROR),
-             errmsg("conflicting or redundant options")));
-      wrapper_path = defGetString(def);
-    }
-    else if (strcmp(def->defname, "wrapper_class") == 0) {
-      if (wrapper_class)
-        ereport(DEBUG1,
-            (errcode(ERRCODE_SYNTAX_ERROR),
-             errmsg("conflicting or redundant options")));
-      wrapper_class = defGetString(def);
-    } else {
-      mrb_hash_set( \
-          state, \
-          params, \
-          mrb_str_new(state, key, strlen(key)), \
-          mrb_str_new(state, val, strlen(val)));
+        info->handled[info->nhandled++] = (int) mrb_fixnum(index);
+      }
     }
   }
 
-  if ((wrapper_path != NULL) && (wrapper_class != NULL)) {
-    elog(ERROR, "[holycorn import schema] wrapper_path or wrapper_class are required (and not both) for defining a holycorn foreign table");
+  info->partitioned = mrb_respond_to(mrb, class, mrb_intern_lit(mrb, "partitions"));
+
+  if (mrb_respond_to(mrb, class, mrb_intern_lit(mrb, "indexed_columns"))) {
+    mrb_value indexed = mrb_funcall(mrb, class, "indexed_columns", 1, env);
+    holycorn_check_exception(mrb, "calling .indexed_columns");
+
+    if (mrb_array_p(indexed) && RARRAY_LEN(indexed) > 0) {
+      info->indexed = (char **) palloc(sizeof(char *) * RARRAY_LEN(indexed));
+
+      for (mrb_int i = 0; i < RARRAY_LEN(indexed); i++) {
+        mrb_value column = mrb_ary_entry(indexed, i);
+
+        if (!mrb_string_p(column))
+          ereport(ERROR,
+              (errcode(ERRCODE_FDW_ERROR),
+               errmsg("[holycorn] .indexed_columns must return column names")));
+
+        info->indexed[info->nindexed++] = pnstrdup(RSTRING_PTR(column), RSTRING_LEN(column));
+      }
+    }
   }
 
-  mrb_value class;
+  if (mrb_respond_to(mrb, class, mrb_intern_lit(mrb, "orderings"))) {
+    mrb_value orderings = mrb_funcall(mrb, class, "orderings", 2, env, quals);
+    holycorn_check_exception(mrb, "calling .orderings");
 
-  if(wrapper_path) {
-    FILE *source = fopen(wrapper_path,"r");
-    class = mrb_load_file(state, source);
-    fclose(source);
-  } else {
-    class = mrb_obj_value(mrb_class_get(state, wrapper_class));
+    if (mrb_array_p(orderings) && RARRAY_LEN(orderings) > 0) {
+      int nkeys = 0;
+
+      for (mrb_int i = 0; i < RARRAY_LEN(orderings); i++) {
+        mrb_value ordering = mrb_ary_entry(orderings, i);
+
+        if (!mrb_array_p(ordering))
+          ereport(ERROR,
+              (errcode(ERRCODE_FDW_ERROR),
+               errmsg("[holycorn] .orderings must return arrays of sort keys")));
+        nkeys += RARRAY_LEN(ordering);
+      }
+
+      info->ordering_ends = (int *) palloc(sizeof(int) * RARRAY_LEN(orderings));
+      info->sort_keys = (HolycornSortKey *) palloc(sizeof(HolycornSortKey) * Max(nkeys, 1));
+      nkeys = 0;
+
+      for (mrb_int i = 0; i < RARRAY_LEN(orderings); i++) {
+        mrb_value ordering = mrb_ary_entry(orderings, i);
+
+        if (RARRAY_LEN(ordering) == 0)
+          continue;
+
+        for (mrb_int j = 0; j < RARRAY_LEN(ordering); j++) {
+          mrb_value key = mrb_ary_entry(ordering, j);
+          char *column, *direction;
+
+          if (!mrb_string_p(key))
+            ereport(ERROR,
+                (errcode(ERRCODE_FDW_ERROR),
+                 errmsg("[holycorn] .orderings must return arrays of sort keys")));
+
+          column = pnstrdup(RSTRING_PTR(key), RSTRING_LEN(key));
+          direction = strrchr(column, ' ');
+          info->sort_keys[nkeys].descending = false;
+
+          if (direction != NULL && pg_strcasecmp(direction + 1, "desc") == 0) {
+            info->sort_keys[nkeys].descending = true;
+            *direction = '\0';
+          } else if (direction != NULL && pg_strcasecmp(direction + 1, "asc") == 0) {
+            *direction = '\0';
+          }
+
+          info->sort_keys[nkeys++].column = column;
+        }
+
+        info->ordering_ends[info->norderings++] = nkeys;
+      }
+    }
   }
 
-#define HASH_SET(hash, key, val) \
-  mrb_hash_set(state, hash, mrb_str_new_lit(state, key), val);
+  if (mrb_respond_to(mrb, class, mrb_intern_lit(mrb, "estimate"))) {
+    mrb_value estimate = mrb_funcall(mrb, class, "estimate", 2, env, quals);
+    holycorn_check_exception(mrb, "calling .estimate");
 
-  HASH_SET(params, "local_schema", mrb_str_new(state, stmt->local_schema, strlen(stmt->local_schema)));
-  HASH_SET(params, "server_name", mrb_str_new(state, quote_identifier(stmt->server_name), strlen(quote_identifier(stmt->server_name))));
+    if (mrb_hash_p(estimate)) {
+      info->estimated = true;
+      info->rows = rbEstimateNumber(mrb, estimate, "rows", DEFAULT_ROWS);
+      info->width = (int) rbEstimateNumber(mrb, estimate, "width", 0);
+      info->startup_cost = rbEstimateNumber(mrb, estimate, "startup_cost", 0);
+      info->per_row_cost = rbEstimateNumber(mrb, estimate, "per_row_cost", DEFAULT_PER_ROW_COST);
+    }
+  }
 
-  mrb_value res = mrb_funcall(state, class, "import_schema", 1, params);
+  holycorn_vm_release(vm);
+  holycorn_plan_cache_store(key, info);
+}
+
+/*
+ * path_private is the fdw_private of the path: NIL, or the order, limit and
+ * offset of the scan.
+ */
+static List *rbSerializePlanState(HolycornPlanState *state, List *quals, List *columns, List *path_private) {
+  List *fdw_private = list_make4(
+      makeString(state->wrapper_path ? state->wrapper_path : ""),
+      makeString(state->wrapper_class ? state->wrapper_class : ""),
+      state->options,
+      makeInteger(state->batch_size));
+
+  fdw_private = lappend(fdw_private, quals);
+  fdw_private = lappend(fdw_private, columns);
+  fdw_private = lappend(fdw_private, makeInteger(state->memory_limit));
+  fdw_private = lappend(fdw_private, makeInteger(state->cache_rescans));
+  fdw_private = lappend(fdw_private, makeInteger(state->cache_ttl));
+  fdw_private = lappend(fdw_private, makeInteger(state->worker));
+
+  if (path_private == NIL)
+    path_private = list_make3(NIL, makeInteger(-1), makeInteger(0));
+  return list_concat(fdw_private, list_copy(path_private));
+}
+
+static HolycornPlanState *rbDeserializePlanState(List *fdw_private) {
+  HolycornPlanState *state = (HolycornPlanState *) palloc0(sizeof(HolycornPlanState));
+  char *wrapper_path = strVal(list_nth(fdw_private, HolycornScanWrapperPath));
+  char *wrapper_class = strVal(list_nth(fdw_private, HolycornScanWrapperClass));
+
+  state->wrapper_path = *wrapper_path ? wrapper_path : NULL;
+  state->wrapper_class = *wrapper_class ? wrapper_class : NULL;
+  state->options = (List *) list_nth(fdw_private, HolycornScanOptions);
+  state->batch_size = intVal(list_nth(fdw_private, HolycornScanBatchSize));
+  state->memory_limit = intVal(list_nth(fdw_private, HolycornScanMemoryLimit));
+  state->cache_rescans = intVal(list_nth(fdw_private, HolycornScanCacheRescans)) != 0;
+  state->cache_ttl = intVal(list_nth(fdw_private, HolycornScanCacheTtl));
+  state->worker = intVal(list_nth(fdw_private, HolycornScanWorker)) != 0;
+
+  return state;
+}
+
+static void rbGetForeignRelSize(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid) {
+
+  HolycornPlanState *fdw_private = (HolycornPlanState *) palloc(sizeof(HolycornPlanState));
+  HolycornPlanInfo info;
+  List *local_conds = NIL;
+  ListCell *lc;
+  Relation rel;
+
+  rbGetOptions(foreigntableid, fdw_private, &fdw_private->options);
+  rbCollectQuals(root, baserel, fdw_private);
+
+  /* The planner already holds a lock on the table */
+  rel = relation_open(foreigntableid, NoLock);
+  rbGetPlanInfo(fdw_private, RelationGetDescr(rel), &info);
+  relation_close(rel, NoLock);
+
+  for (int i = 0; i < info.nhandled; i++)
+    fdw_private->handled_clauses = lappend(fdw_private->handled_clauses,
+        list_nth(fdw_private->qual_clauses, info.handled[i]));
+
+  /* Without .estimate, wrappers are assumed to be slow and of moderate size */
+  fdw_private->partitioned = info.partitioned;
+  fdw_private->indexed_columns = NULL;
+  for (int i = 0; i < info.nindexed; i++) {
+    AttrNumber attnum = get_attnum(foreigntableid, info.indexed[i]);
+
+    if (attnum == InvalidAttrNumber)
+      ereport(ERROR,
+          (errcode(ERRCODE_FDW_COLUMN_NAME_NOT_FOUND),
+           errmsg("[holycorn] .indexed_columns returned \"%s\", which is not a column of the table",
+             info.indexed[i])));
+
+    fdw_private->indexed_columns = bms_add_member(fdw_private->indexed_columns, attnum);
+  }
+  fdw_private->orderings = NIL;
+  for (int i = 0, key = 0; i < info.norderings; i++) {
+    List *ordering = NIL;
+
+    for (; key < info.ordering_ends[i]; key++) {
+      AttrNumber attnum = get_attnum(foreigntableid, info.sort_keys[key].column);
+
+      if (attnum == InvalidAttrNumber)
+        ereport(ERROR,
+            (errcode(ERRCODE_FDW_COLUMN_NAME_NOT_FOUND),
+             errmsg("[holycorn] .orderings returned \"%s\", which is not a column of the table",
+               info.sort_keys[key].column)));
+
+      ordering = lappend(ordering, makeInteger(info.sort_keys[key].descending ? -attnum : attnum));
+    }
+
+    fdw_private->orderings = lappend(fdw_private->orderings, ordering);
+  }
+  fdw_private->ntuples = info.estimated ? info.rows : DEFAULT_ROWS;
+  fdw_private->startup_cost = info.estimated ? info.startup_cost : 0;
+  fdw_private->per_row_cost = info.estimated ? info.per_row_cost : DEFAULT_PER_ROW_COST;
+
+  if (info.width > 0) {
+#if PG_VERSION_NUM >= 90600
+    baserel->reltarget->width = info.width;
+#else
+    baserel->width = info.width;
+#endif
+  }
+
+  /* The rows returned by the wrapper are then filtered by the local quals */
+  foreach(lc, baserel->baserestrictinfo) {
+    if (!list_member_ptr(fdw_private->handled_clauses, lfirst(lc)))
+      local_conds = lappend(local_conds, lfirst(lc));
+  }
+
+  baserel->tuples = fdw_private->ntuples;
+  baserel->rows = clamp_row_est(fdw_private->ntuples *
+      clauselist_selectivity(root, local_conds, baserel->relid, JOIN_INNER, NULL));
+
+  baserel->fdw_private = (void *) fdw_private;
+}
+
+/*
+ * Whether a join clause compares an indexed column to a value from other
+ * relations, and can be given to the wrapper as an = qual.
+ */
+static bool rbIsLookupClause(PlannerInfo *root, RelOptInfo *baserel, HolycornPlanState *state, RestrictInfo *rinfo) {
+  RangeTblEntry *rte = planner_rt_fetch(baserel->relid, root);
+  HolycornQual qual;
+
+#if PG_VERSION_NUM >= 90500
+  if (!join_clause_is_movable_to(rinfo, baserel))
+#else
+  if (!join_clause_is_movable_to(rinfo, baserel->relid))
+#endif
+    return false;
+
+  if (rinfo->pseudoconstant || !holycorn_deparse_qual(root, baserel, rinfo->clause, &qual) ||
+      strcmp(qual.operator, "=") != 0)
+    return false;
+
+  return bms_is_member(get_attnum(rte->relid, qual.column), state->indexed_columns);
+}
+
+/* Equivalence class members that are the indexed column given as arg */
+static bool rbMatchesIndexedColumn(PlannerInfo *root, RelOptInfo *rel, EquivalenceClass *ec,
+    EquivalenceMember *em, void *arg) {
+  Var *var = (Var *) em->em_expr;
+
+  return IsA(var, Var) && var->varno == rel->relid && var->varlevelsup == 0 &&
+    var->varattno == *(AttrNumber *) arg;
+}
+
+/*
+ * Paths for nested loops looking rows up in the wrapper: for each set of
+ * outer relations joined to indexed columns, a scan parameterized by them,
+ * run again with the outer values as quals for each outer row.
+ */
+static void rbAddParameterizedPaths(PlannerInfo *root, RelOptInfo *baserel, HolycornPlanState *state) {
+  List *clauses = NIL;
+  List *ppi_list = NIL;
+  ListCell *lc;
+
+  /* Join clauses, and the ones implied by equivalence classes */
+  foreach(lc, baserel->joininfo)
+    clauses = lappend(clauses, lfirst(lc));
+
+  if (baserel->has_eclass_joins) {
+    for (AttrNumber attnum = 1; attnum <= baserel->max_attr; attnum++) {
+      if (!bms_is_member(attnum, state->indexed_columns))
+        continue;
+
+      clauses = list_concat(clauses, generate_implied_equalities_for_column(root, baserel,
+            rbMatchesIndexedColumn, (void *) &attnum, baserel->lateral_referencers));
+    }
+  }
+
+  foreach(lc, clauses) {
+    RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+    Relids required_outer;
+
+    if (!rbIsLookupClause(root, baserel, state, rinfo))
+      continue;
+
+    required_outer = bms_union(rinfo->clause_relids, baserel->lateral_relids);
+    required_outer = bms_del_member(required_outer, baserel->relid);
+    if (bms_is_empty(required_outer))
+      continue;
+
+    ppi_list = list_append_unique_ptr(ppi_list, get_baserel_parampathinfo(root, baserel, required_outer));
+  }
+
+  /* Each lookup costs a wrapper startup, plus the few rows it returns */
+  foreach(lc, ppi_list) {
+    ParamPathInfo *param_info = (ParamPathInfo *) lfirst(lc);
+    Cost startup_cost = state->startup_cost + baserel->baserestrictcost.startup;
+    Cost total_cost = startup_cost + param_info->ppi_rows *
+      (cpu_tuple_cost + state->per_row_cost + baserel->baserestrictcost.per_tuple);
+
+    add_path(baserel, (Path *) create_foreignscan_path(root, baserel,
+#if PG_VERSION_NUM >= 90600
+        NULL,
+#endif
+        param_info->ppi_rows, startup_cost, total_cost,
+        NIL,
+        param_info->ppi_req_outer,
+#if PG_VERSION_NUM >= 90500
+        NULL,
+#endif
+        NIL));
+  }
+}
+
+/*
+ * The column of baserel a pathkey sorts by, as in HolycornScanOrder: its
+ * attnum, negated when descending. Only the sort orders of the default btree
+ * operator class with default NULLS placement and the column's collation are
+ * the ones wrappers produce.
+ */
+static bool rbPathKeySortKey(RelOptInfo *baserel, PathKey *pathkey, int *key) {
+  EquivalenceClass *ec = pathkey->pk_eclass;
+  bool descending = pathkey->pk_strategy == BTGreaterStrategyNumber;
+  ListCell *lc;
+
+  if (ec->ec_has_volatile || pathkey->pk_nulls_first != descending)
+    return false;
+
+  foreach(lc, ec->ec_members) {
+    EquivalenceMember *em = (EquivalenceMember *) lfirst(lc);
+    Var *var = (Var *) em->em_expr;
+    Oid opclass;
+
+    if (em->em_is_child || !IsA(var, Var) || var->varno != baserel->relid ||
+        var->varlevelsup != 0 || var->varattno <= 0)
+      continue;
+
+    opclass = GetDefaultOpClass(var->vartype, BTREE_AM_OID);
+    if (!OidIsValid(opclass) || get_opclass_family(opclass) != pathkey->pk_opfamily ||
+        var->varcollid != ec->ec_collation)
+      continue;
+
+    *key = descending ? -var->varattno : var->varattno;
+    return true;
+  }
+
+  return false;
+}
+
+/*
+ * Whether the wrapper produces rows sorted by pathkeys, which holds when one
+ * of its orderings starts with them. order is then set to their sort keys.
+ */
+static bool rbMatchOrdering(RelOptInfo *baserel, HolycornPlanState *state, List *pathkeys, List **order) {
+  List *keys = NIL;
+  ListCell *lc;
+
+  if (pathkeys == NIL || state->orderings == NIL)
+    return false;
+
+  foreach(lc, pathkeys) {
+    int key;
+
+    if (!rbPathKeySortKey(baserel, (PathKey *) lfirst(lc), &key))
+      return false;
+    keys = lappend(keys, makeInteger(key));
+  }
+
+  foreach(lc, state->orderings) {
+    List *ordering = (List *) lfirst(lc);
+    bool matches = list_length(keys) <= list_length(ordering);
+    ListCell *a, *b;
+
+    forboth(a, keys, b, ordering) {
+      if (intVal(lfirst(a)) != intVal(lfirst(b)))
+        matches = false;
+    }
+
+    if (matches) {
+      *order = keys;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void rbGetForeignPaths(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid) {
+  HolycornPlanState *fdw_private = (HolycornPlanState *) baserel->fdw_private;
+  Cost    startup_cost;
+  Cost    total_cost;
+  List *coptions = NIL;
+  List *order = NIL;
+
+  /* Estimate costs */
+  estimate_costs(root, baserel, fdw_private, &startup_cost, &total_cost);
+
+  /*
+   * Create a ForeignPath node and add it as only possible path.  We use the
+   * fdw_private list of the path to carry the convert_selectively option;
+   * it will be propagated into the fdw_private list of the Plan node.
+   */
+  Path * path = (Path*)create_foreignscan_path(root, baserel,
+#if PG_VERSION_NUM >= 90600
+      NULL, /* default pathtarget */
+#endif
+      baserel->rows, startup_cost, total_cost,
+      NIL,    /* no pathkeys */
+      NULL,   /* no outer rel either */
+#if PG_VERSION_NUM >= 90500
+      NULL,    /* no extra plan */
+#endif
+      coptions);
+
+  add_path(baserel, path);
+
+  /*
+   * The ORDER BY of the query, when the wrapper can produce it: a sorted path
+   * spares the Sort node. The path's fdw_private gives the order to the plan
+   * (followed by the limit and offset of rbGetForeignUpperPaths).
+   */
+  if (rbMatchOrdering(baserel, fdw_private, root->query_pathkeys, &order))
+    add_path(baserel, (Path *) create_foreignscan_path(root, baserel,
+#if PG_VERSION_NUM >= 90600
+        NULL,
+#endif
+        baserel->rows, startup_cost, total_cost,
+        root->query_pathkeys,
+        NULL,
+#if PG_VERSION_NUM >= 90500
+        NULL,
+#endif
+        list_make3(order, makeInteger(-1), makeInteger(0))));
+
+  if (!bms_is_empty(fdw_private->indexed_columns))
+    rbAddParameterizedPaths(root, baserel, fdw_private);
+
+#if PG_VERSION_NUM >= 90600
+  /*
+   * Partitioned wrappers can also be scanned by several workers, each of them
+   * claiming partitions until there are none left.
+   */
+  if (baserel->consider_parallel && fdw_private->partitioned && !fdw_private->worker &&
+      max_parallel_workers_per_gather > 0) {
+    int workers = max_parallel_workers_per_gather;
+    double divisor = workers;
+    double leader_contribution = 1.0 - (0.3 * workers);
+
+    if (leader_contribution > 0)
+      divisor += leader_contribution;
+
+    path = (Path *) create_foreignscan_path(root, baserel,
+        NULL,
+        clamp_row_est(baserel->rows / divisor),
+        startup_cost, startup_cost + (total_cost - startup_cost) / divisor,
+        NIL,
+        NULL,
+        NULL,
+        coptions);
+
+    path->parallel_aware = true;
+    path->parallel_safe = true;
+    path->parallel_workers = workers;
+
+    add_partial_path(baserel, path);
+  }
+#endif
+}
+
+#if PG_VERSION_NUM >= 120000
+/* Value of a LIMIT or OFFSET clause, false unless it's a non-negative constant */
+static bool rbLimitConst(Node *node, int64 *value) {
+  Const *limit = (Const *) node;
+
+  if (limit == NULL || !IsA(limit, Const) || limit->constisnull)
+    return false;
+
+  *value = DatumGetInt64(limit->constvalue);
+  return *value >= 0;
+}
+
+/*
+ * Queries reading nothing but a holycorn table can have their LIMIT applied
+ * by the scan: the final relation gets a path of the table returning only the
+ * rows asked for, which spares the Limit node and lets the wrapper know how
+ * many rows are needed. This requires the wrapper to evaluate all the quals
+ * itself (rows filtered out afterwards would be counted) and, with an ORDER
+ * BY, to produce that order.
+ *
+ * The ordered relation of the query is given the table at the ORDERED stage,
+ * where the sorted paths of rbGetForeignPaths are all there is to do.
+ */
+static void rbGetForeignUpperPaths(PlannerInfo *root, UpperRelationKind stage, RelOptInfo *input_rel,
+    RelOptInfo *output_rel, void *extra) {
+  Query *parse = root->parse;
+  RelOptInfo *baserel;
+  HolycornPlanState *state;
+  List *order = NIL;
+  List *pathkeys = NIL;
+  int64 limit, offset = 0;
+  double fetched, rows;
+  Cost startup_cost, total_cost;
+  ListCell *lc;
+
+  if (stage == UPPERREL_ORDERED) {
+    if (input_rel->reloptkind == RELOPT_BASEREL)
+      output_rel->fdw_private = input_rel;
+    return;
+  }
+
+  if (stage != UPPERREL_FINAL || !((FinalPathExtraData *) extra)->limit_needed)
+    return;
+
+  if (input_rel->reloptkind == RELOPT_BASEREL && parse->sortClause == NIL)
+    baserel = input_rel;
+  else if (input_rel->reloptkind == RELOPT_UPPER_REL && input_rel->fdw_private != NULL)
+    baserel = (RelOptInfo *) input_rel->fdw_private;
+  else
+    return;
+
+  if (parse->hasTargetSRFs || parse->rowMarks != NIL || !bms_is_empty(baserel->lateral_relids))
+    return;
+#if PG_VERSION_NUM >= 130000
+  if (parse->limitOption == LIMIT_OPTION_WITH_TIES)
+    return;
+#endif
+
+  if (!rbLimitConst(parse->limitCount, &limit) ||
+      (parse->limitOffset != NULL && !rbLimitConst(parse->limitOffset, &offset)) ||
+      limit + offset > INT_MAX)
+    return;
+
+  state = (HolycornPlanState *) baserel->fdw_private;
+  foreach(lc, baserel->baserestrictinfo) {
+    if (!list_member_ptr(state->handled_clauses, lfirst(lc)))
+      return;
+  }
+
+  if (root->sort_pathkeys != NIL) {
+    if (!rbMatchOrdering(baserel, state, root->sort_pathkeys, &order))
+      return;
+    pathkeys = root->sort_pathkeys;
+  }
+
+  /*
+   * The wrapper only runs until the rows are there. The path is a little
+   * cheaper than the scan under a Limit node, as there is no Limit node to
+   * pass the rows through.
+   */
+  estimate_costs(root, baserel, state, &startup_cost, &total_cost);
+  fetched = Min((double) (limit + offset), state->ntuples);
+  rows = clamp_row_est(Min((double) limit, baserel->rows - offset));
+  if (state->ntuples > 0)
+    total_cost = startup_cost + (total_cost - startup_cost) * fetched / state->ntuples;
+  total_cost -= cpu_tuple_cost * rows;
+
+  add_path(output_rel, (Path *) create_foreign_upper_path(root, baserel,
+        root->upper_targets[UPPERREL_FINAL],
+        rows, startup_cost, Max(total_cost, startup_cost),
+        pathkeys,
+        NULL,
+        list_make3(order, makeInteger((int) limit), makeInteger((int) offset))));
+}
+#endif
+
+static ForeignScan * rbGetForeignPlan(
+  PlannerInfo *root,
+  RelOptInfo *baserel,
+  Oid foreigntableid,
+  ForeignPath *best_path,
+  List *tlist,
+  List *scan_clauses
+#if (PG_VERSION_NUM >= 90500)
+  , Plan *outer_plan
+#endif
+  )
+{
+  HolycornPlanState *fdw_private = (HolycornPlanState *) baserel->fdw_private;
+  Index scan_relid = baserel->relid;
+  List *local_exprs = NIL;
+  List *fdw_exprs = NIL;
+  List *quals = NIL;
+  List *columns = NIL;
+  Bitmapset *attrs_used = NULL;
+  bool whole_row;
+  ListCell *lc;
+
+  /* Clauses the wrapper handles itself don't need to be rechecked */
+  foreach(lc, scan_clauses) {
+    RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+
+    if (rinfo->pseudoconstant || list_member_ptr(fdw_private->handled_clauses, rinfo))
+      continue;
+
+    local_exprs = lappend(local_exprs, rinfo->clause);
+  }
+
+  foreach(lc, fdw_private->quals) {
+    HolycornQual *qual = (HolycornQual *) lfirst(lc);
+    int value_index = -1;
+
+    if (qual->value) {
+      fdw_exprs = lappend(fdw_exprs, qual->value);
+      value_index = list_length(fdw_exprs) - 1;
+    }
+
+    quals = lappend(quals, list_make3(makeString(qual->column), makeString(qual->operator),
+          makeInteger(value_index)));
+  }
+
+  /*
+   * Lookups of parameterized paths: the outer values become parameters once
+   * the plan is done, and each rescan gives their new values to the wrapper.
+   * The clauses are still rechecked.
+   */
+  if (best_path->path.param_info != NULL) {
+    foreach(lc, best_path->path.param_info->ppi_clauses) {
+      RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+      HolycornQual qual;
+
+      if (!rbIsLookupClause(root, baserel, fdw_private, rinfo))
+        continue;
+
+      holycorn_deparse_qual(root, baserel, rinfo->clause, &qual);
+      fdw_exprs = lappend(fdw_exprs, qual.value);
+      quals = lappend(quals, list_make3(makeString(qual.column), makeString(qual.operator),
+            makeInteger(list_length(fdw_exprs) - 1)));
+    }
+  }
+
+  /* Columns the wrapper has to provide: the ones output or rechecked locally */
+#if PG_VERSION_NUM >= 90600
+  pull_varattnos((Node *) baserel->reltarget->exprs, scan_relid, &attrs_used);
+#else
+  pull_varattnos((Node *) baserel->reltargetlist, scan_relid, &attrs_used);
+#endif
+  pull_varattnos((Node *) local_exprs, scan_relid, &attrs_used);
+
+  whole_row = bms_is_member(0 - FirstLowInvalidHeapAttributeNumber, attrs_used);
+
+  for (AttrNumber attnum = 1; attnum <= baserel->max_attr; attnum++) {
+    if (whole_row || bms_is_member(attnum - FirstLowInvalidHeapAttributeNumber, attrs_used))
+      columns = lappend(columns, makeInteger(attnum));
+  }
+
+  ForeignScan * scan = make_foreignscan(
+    tlist,
+    local_exprs,
+    scan_relid,
+    fdw_exprs,
+    rbSerializePlanState(fdw_private, quals, columns, best_path->fdw_private)
+#if PG_VERSION_NUM >= 90500
+    , NIL
+    , NIL
+    , outer_plan
+#endif
+    );
+
+  return scan;
+}
+
+static void rbExplainTime(const char *label, double value, ExplainState *es) {
+#if PG_VERSION_NUM >= 110000
+  ExplainPropertyFloat(label, "ms", value, 3, es);
+#else
+  ExplainPropertyFloat(label, value, 3, es);
+#endif
+}
+
+static void rbExplainCount(const char *label, const char *unit, int64 value, ExplainState *es) {
+#if PG_VERSION_NUM >= 110000
+  ExplainPropertyInteger(label, unit, value, es);
+#else
+  ExplainPropertyLong(label, (long) value, es);
+#endif
+}
+
+/*
+ * Shows the wrapper, the quals, columns, order and limit it is given and,
+ * under ANALYZE, where the scan spent its time.
+ */
+static void rbExplainForeignScan(ForeignScanState *node, ExplainState *es) {
+  ForeignScan *plan = (ForeignScan *) node->ss.ps.plan;
+  HolycornPlanState *hps = rbDeserializePlanState(plan->fdw_private);
+  TupleDesc tupdesc = node->ss.ss_ScanTupleSlot->tts_tupleDescriptor;
+  List *quals = (List *) list_nth(plan->fdw_private, HolycornScanQuals);
+  List *columns = (List *) list_nth(plan->fdw_private, HolycornScanColumns);
+  List *order;
+  List *descriptions = NIL;
+  ListCell *cell;
+
+  ExplainPropertyText("Wrapper", hps->wrapper_class ? hps->wrapper_class : hps->wrapper_path, es);
+  if (hps->worker)
+    ExplainPropertyText("Wrapper Execution", "worker", es);
+
+  foreach(cell, quals) {
+    List *qual = (List *) lfirst(cell);
+    int value_index = intVal(lthird(qual));
+    StringInfoData description;
+
+    initStringInfo(&description);
+    appendStringInfo(&description, "%s %s", strVal(linitial(qual)), strVal(lsecond(qual)));
+
+    if (value_index >= 0)
+      appendStringInfo(&description, " %s",
+          deparse_expression((Node *) list_nth(plan->fdw_exprs, value_index), es->deparse_cxt, false, false));
+
+    descriptions = lappend(descriptions, description.data);
+  }
+
+  if (descriptions != NIL || es->verbose)
+    ExplainPropertyList("Wrapper Quals", descriptions, es);
+
+  descriptions = NIL;
+  foreach(cell, columns) {
+    Form_pg_attribute attr = TupleDescAttr(tupdesc, intVal(lfirst(cell)) - 1);
+
+    if (!attr->attisdropped)
+      descriptions = lappend(descriptions, NameStr(attr->attname));
+  }
+
+  ExplainPropertyList("Wrapper Columns", descriptions, es);
+
+  order = (List *) list_nth(plan->fdw_private, HolycornScanOrder);
+  if (order != NIL) {
+    descriptions = NIL;
+    foreach(cell, order) {
+      int key = intVal(lfirst(cell));
+      Form_pg_attribute attr = TupleDescAttr(tupdesc, Abs(key) - 1);
+
+      descriptions = lappend(descriptions, key < 0 ? psprintf("%s DESC", NameStr(attr->attname)) :
+          NameStr(attr->attname));
+    }
+
+    ExplainPropertyList("Wrapper Order", descriptions, es);
+  }
+
+  if (intVal(list_nth(plan->fdw_private, HolycornScanLimit)) >= 0) {
+    rbExplainCount("Wrapper Limit", NULL, intVal(list_nth(plan->fdw_private, HolycornScanLimit)), es);
+    if (intVal(list_nth(plan->fdw_private, HolycornScanOffset)) > 0)
+      rbExplainCount("Wrapper Offset", NULL, intVal(list_nth(plan->fdw_private, HolycornScanOffset)), es);
+  }
+
+  if (es->analyze && node->fdw_state != NULL) {
+    HolycornExecutionState *exec_state = (HolycornExecutionState *) node->fdw_state;
+    HolycornScanStats *stats = &exec_state->stats;
+
+    if (exec_state->result_cache_status != NULL)
+      ExplainPropertyText("Result Cache", exec_state->result_cache_status, es);
+
+    rbExplainCount("Wrapper Rows", NULL, stats->rows, es);
+    rbExplainCount("Wrapper Batches", NULL, stats->batches, es);
+
+    if (stats->timing) {
+      rbExplainTime("VM Startup Time", stats->vm_startup_time, es);
+      rbExplainTime("Constructor Time", stats->constructor_time, es);
+      rbExplainTime("Fetch Time", stats->fetch_time, es);
+      rbExplainTime("Conversion Time", stats->conversion_time, es);
+    }
+
+    rbExplainCount("Peak VM Heap", "kB", (stats->peak_heap + 1023) / 1024, es);
+    rbExplainCount("Peak VM Objects", NULL, stats->peak_objects, es);
+  }
+}
+
+/* Executor parameters the values of the quals depend on */
+static bool rbCollectParamIds(Node *node, Bitmapset **paramids) {
+  if (node == NULL)
+    return false;
+
+  if (IsA(node, Param) && ((Param *) node)->paramkind == PARAM_EXEC)
+    *paramids = bms_add_member(*paramids, ((Param *) node)->paramid);
+
+  return expression_tree_walker(node, rbCollectParamIds, (void *) paramids);
+}
+
+/* Sets env["quals"], with the values of the quals computed for this (re)scan */
+static void rbSetQuals(ForeignScanState *node, HolycornExecutionState *exec_state) {
+  ForeignScan *plan = (ForeignScan *) node->ss.ps.plan;
+  ExprContext *econtext = node->ss.ps.ps_ExprContext;
+  mrb_state *mrb = exec_state->mrb_state;
+  List *quals = (List *) list_nth(plan->fdw_private, HolycornScanQuals);
+  mrb_value mrb_quals = mrb_ary_new_capa(mrb, list_length(quals));
+  ListCell *cell;
+
+  foreach(cell, quals) {
+    List *qual = (List *) lfirst(cell);
+    int value_index = intVal(lthird(qual));
+    mrb_value value = mrb_nil_value();
+
+    if (value_index >= 0) {
+      ExprState *value_state = (ExprState *) list_nth(exec_state->value_states, value_index);
+      bool isnull;
+#if PG_VERSION_NUM >= 100000
+      Datum datum = ExecEvalExpr(value_state, econtext, &isnull);
+#else
+      Datum datum = ExecEvalExpr(value_state, econtext, &isnull, NULL);
+#endif
+
+      value = holycorn_datum_to_mrb(mrb, datum, isnull,
+          exprType((Node *) list_nth(plan->fdw_exprs, value_index)));
+    }
+
+    mrb_ary_push(mrb, mrb_quals, rbQualToMrb(mrb,
+          strVal(linitial(qual)), strVal(lsecond(qual)), value, value_index >= 0));
+  }
+
+  mrb_hash_set(mrb, exec_state->env, mrb_str_new_lit(mrb, "quals"), mrb_quals);
+}
+
+/*
+ * Gives the quals of this (re)scan to the wrapper: through #rewind(env) when
+ * its instance implements it, otherwise to a new instance.
+ */
+static void rbStartWrapper(ForeignScanState *node, HolycornExecutionState *exec_state) {
+  mrb_state *mrb = exec_state->mrb_state;
+  instr_time start;
+
+  rbSetQuals(node, exec_state);
+
+  holycorn_stats_start(&exec_state->stats, &start);
+
+  if (!mrb_nil_p(exec_state->iterator) &&
+      mrb_respond_to(mrb, exec_state->iterator, mrb_intern_lit(mrb, "rewind"))) {
+    mrb_funcall(mrb, exec_state->iterator, "rewind", 1, exec_state->env);
+    holycorn_check_exception(mrb, "calling #rewind");
+  } else {
+    mrb_value iterator = rbNewWrapper(mrb, exec_state->class, exec_state->env, exec_state->hps);
+
+    if (!mrb_nil_p(exec_state->iterator))
+      mrb_gc_unregister(mrb, exec_state->iterator);
+    mrb_gc_register(mrb, iterator);
+    exec_state->iterator = iterator;
+  }
+
+  holycorn_stats_accum(&exec_state->stats, &exec_state->stats.constructor_time, start);
+
+  rbSetRowProtocol(exec_state);
+  exec_state->started = true;
+}
+
+/*
+ * Identity of the rows a scan gets from its wrapper, for the shared result
+ * cache: the table, its generation and its row type, the wrapper and its
+ * options, the values of the quals, the columns provided and the order and
+ * limit.
+ */
+static char *rbResultCacheKey(ForeignScanState *node, HolycornExecutionState *exec_state) {
+  ForeignScan *plan = (ForeignScan *) node->ss.ps.plan;
+  ExprContext *econtext = node->ss.ps.ps_ExprContext;
+  HolycornPlanState *hps = exec_state->hps;
+  TupleDesc tupdesc = node->ss.ss_ScanTupleSlot->tts_tupleDescriptor;
+  List *quals = (List *) list_nth(plan->fdw_private, HolycornScanQuals);
+  List *columns = (List *) list_nth(plan->fdw_private, HolycornScanColumns);
+  Oid relid = RelationGetRelid(node->ss.ss_currentRelation);
+  StringInfoData key;
+  ListCell *cell;
+
+  initStringInfo(&key);
+  appendStringInfo(&key, "rel:%u;generation:%u;types:", relid, holycorn_result_cache_generation(relid));
+
+  for (int i = 0; i < tupdesc->natts; i++) {
+    Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+
+    appendStringInfo(&key, " %u", attr->attisdropped ? InvalidOid : attr->atttypid);
+  }
+
+  appendStringInfo(&key, ";%s", rbWrapperKey(hps->wrapper_path, hps->wrapper_class, hps->options));
+
+  foreach(cell, quals) {
+    List *qual = (List *) lfirst(cell);
+    int value_index = intVal(lthird(qual));
+
+    appendStringInfo(&key, ";%s %s", strVal(linitial(qual)), strVal(lsecond(qual)));
+
+    if (value_index >= 0) {
+      ExprState *value_state = (ExprState *) list_nth(exec_state->value_states, value_index);
+      Oid typid = exprType((Node *) list_nth(plan->fdw_exprs, value_index));
+      bool isnull;
+#if PG_VERSION_NUM >= 100000
+      Datum datum = ExecEvalExpr(value_state, econtext, &isnull);
+#else
+      Datum datum = ExecEvalExpr(value_state, econtext, &isnull, NULL);
+#endif
+
+      if (isnull) {
+        appendStringInfoString(&key, " NULL");
+      } else {
+        Oid output;
+        bool varlena;
+
+        getTypeOutputInfo(typid, &output, &varlena);
+        appendStringInfo(&key, " %u:%s", typid, OidOutputFunctionCall(output, datum));
+      }
+    }
+  }
+
+  appendStringInfoString(&key, ";columns:");
+  foreach(cell, columns)
+    appendStringInfo(&key, " %d", intVal(lfirst(cell)));
+
+  appendStringInfoString(&key, ";order:");
+  foreach(cell, (List *) list_nth(plan->fdw_private, HolycornScanOrder))
+    appendStringInfo(&key, " %d", intVal(lfirst(cell)));
+  appendStringInfo(&key, ";limit: %d %d", exec_state->limit, exec_state->offset);
+
+  return key.data;
+}
+
+static void rbBeginForeignScan(ForeignScanState *node, int eflags) {
+  ForeignScan *plan = (ForeignScan *)node->ss.ps.plan;
+
+  HolycornPlanState * hps = rbDeserializePlanState(plan->fdw_private);
+
+  /* Nothing to run for a plain EXPLAIN */
+  if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+    return;
+
+  HolycornExecutionState *exec_state = (HolycornExecutionState *)palloc0(sizeof(HolycornExecutionState));
+  TupleDesc tupdesc = node->ss.ss_ScanTupleSlot->tts_tupleDescriptor;
+  instr_time start;
+
+  exec_state->wrapper = hps->wrapper_class ? hps->wrapper_class : hps->wrapper_path;
+  exec_state->hps = hps;
+  exec_state->stats.timing = holycorn_track_timing ||
+    (node->ss.ps.state->es_instrument & INSTRUMENT_TIMER) != 0;
+
+  /* Pushed down quals; their values are computed for each (re)scan */
+#if PG_VERSION_NUM >= 100000
+  exec_state->value_states = ExecInitExprList(plan->fdw_exprs, (PlanState *) node);
+#else
+  exec_state->value_states = (List *) ExecInitExpr((Expr *) plan->fdw_exprs, (PlanState *) node);
+#endif
+  exec_state->value_params = NULL;
+  rbCollectParamIds((Node *) plan->fdw_exprs, &exec_state->value_params);
+
+  exec_state->limit = intVal(list_nth(plan->fdw_private, HolycornScanLimit));
+  exec_state->offset = intVal(list_nth(plan->fdw_private, HolycornScanOffset));
+  exec_state->position = 0;
+
+  /*
+   * Scans that may be rewound without their parameters changing keep the
+   * rows of the first pass, to replay them rather than calling the wrapper
+   * again. Partial scans of parallel queries are never rewound that way.
+   */
+  exec_state->caching = hps->cache_rescans && (eflags & EXEC_FLAG_REWIND) != 0 &&
+    !plan->scan.plan.parallel_aware;
+  exec_state->cache = exec_state->caching ? tuplestore_begin_heap(false, false, work_mem) : NULL;
+#if PG_VERSION_NUM >= 120000
+  /* Scan slots hold heap tuples, the cached rows are minimal tuples */
+  exec_state->replay_slot = ExecInitExtraTupleSlot(node->ss.ps.state, tupdesc, &TTSOpsMinimalTuple);
+#else
+  exec_state->replay_slot = node->ss.ss_ScanTupleSlot;
+#endif
+
+  /*
+   * Tables with cache_ttl share the rows of their wrapper through shared
+   * memory. Rows already there are all this scan needs, without a VM.
+   */
+  if (hps->cache_ttl > 0 && holycorn_result_cache_enabled() &&
+      !plan->scan.plan.parallel_aware && bms_is_empty(exec_state->value_params)) {
+    char *key = rbResultCacheKey(node, exec_state);
+
+    if (exec_state->cache == NULL)
+      exec_state->cache = tuplestore_begin_heap(false, false, work_mem);
+
+    switch (holycorn_result_cache_lookup(key, exec_state->cache, exec_state->replay_slot)) {
+      case HOLYCORN_CACHE_HIT:
+        exec_state->result_cache_status = "hit";
+        exec_state->cache_complete = true;
+        exec_state->replaying = true;
+        node->fdw_state = (void *) exec_state;
+        return;
+      case HOLYCORN_CACHE_LOAD:
+        exec_state->result_cache_status = "miss";
+        exec_state->result_cache_key = key;
+        exec_state->result_cache_rows = makeStringInfo();
+        break;
+      case HOLYCORN_CACHE_BYPASS:
+        exec_state->result_cache_status = "bypassed";
+        break;
+    }
+  }
+
+  /* The worker is launched on the first fetch, once parameters have values */
+  if (hps->worker) {
+    exec_state->batch = mrb_nil_value();
+    exec_state->stream = mrb_nil_value();
+    exec_state->partitions = mrb_nil_value();
+    node->fdw_state = (void *) exec_state;
+    return;
+  }
+
+  holycorn_stats_start(&exec_state->stats, &start);
+
+  exec_state->vm = holycorn_vm_acquire(rbWrapperKey(hps->wrapper_path, hps->wrapper_class, hps->options),
+      hps->memory_limit);
+  exec_state->mrb_state = exec_state->vm->mrb;
+  exec_state->vm->heap_peak = exec_state->vm->heap_size;
+
+  mrb_value class = rbLoadWrapper(exec_state->mrb_state, hps->wrapper_path, hps->wrapper_class);
+
+  holycorn_stats_accum(&exec_state->stats, &exec_state->stats.vm_startup_time, start);
+
+  mrb_value params = rbBuildEnv(exec_state->mrb_state, hps);
+
+  exec_state->class = class;
+  exec_state->env = params;
+
+  ListCell *cell;
+
+  /* Columns used by the query; the others are NULL whatever the wrapper returns */
+  List *columns = (List *) list_nth(plan->fdw_private, HolycornScanColumns);
+  mrb_value mrb_columns = mrb_ary_new_capa(exec_state->mrb_state, list_length(columns));
+
+  exec_state->converters = holycorn_build_converters(exec_state->mrb_state, tupdesc);
+
+  for (int i = 0; i < exec_state->converters->natts; i++)
+    exec_state->converters->columns[i].projected = false;
+
+  foreach(cell, columns) {
+    AttrNumber attnum = intVal(lfirst(cell));
+    Form_pg_attribute attr = TupleDescAttr(tupdesc, attnum - 1);
+
+    if (attr->attisdropped)
+      continue;
+
+    exec_state->converters->columns[attnum - 1].projected = true;
+    mrb_ary_push(exec_state->mrb_state, mrb_columns, mrb_str_new_cstr(exec_state->mrb_state, NameStr(attr->attname)));
+  }
+
+  mrb_hash_set(exec_state->mrb_state, params, mrb_str_new_lit(exec_state->mrb_state, "columns"), mrb_columns);
+  rbSetAttributes(exec_state->mrb_state, params, tupdesc);
+  rbSetOrderAndLimit(exec_state->mrb_state, params, tupdesc,
+      (List *) list_nth(plan->fdw_private, HolycornScanOrder), exec_state->limit, exec_state->offset);
+
+  exec_state->iterator = mrb_nil_value();
+  exec_state->batch_size = hps->batch_size;
+  /* Batches needn't be larger than the rows the scan returns */
+  if (exec_state->limit >= 0)
+    exec_state->batch_size = Max(Min(exec_state->batch_size, exec_state->offset + exec_state->limit), 1);
+  exec_state->batch = mrb_nil_value();
+  exec_state->stream = mrb_nil_value();
+  exec_state->batch_pos = 0;
+  exec_state->batch_len = 0;
+  exec_state->exhausted = false;
+
+  /*
+   * Parameters set by the outer side of nested loops (the lookups of
+   * parameterized paths) have no value before the scan runs: the wrapper is
+   * then constructed on the first fetch.
+   */
+  exec_state->started = false;
+  if (bms_is_empty(exec_state->value_params))
+    rbStartWrapper(node, exec_state);
+
+  holycorn_stats_start(&exec_state->stats, &start);
+
+  /* Set by rbInitializeDSMForeignScan() for parallel scans */
+  exec_state->pstate = NULL;
+  rbLoadPartitions(exec_state, class, params);
+
+  holycorn_stats_accum(&exec_state->stats, &exec_state->stats.constructor_time, start);
+  rbSampleVM(exec_state);
+
+  exec_state->arena_idx = mrb_gc_arena_save(exec_state->mrb_state);
+
+  node->fdw_state = (void *) exec_state;
+}
+
+/*
+ * Wrappers built on Enumerator#next end the scan by raising StopIteration,
+ * which is not an error.
+ */
+static bool rbStopIteration(mrb_state *mrb) {
+  if (mrb->exc == NULL || !mrb_class_defined(mrb, "StopIteration"))
+    return false;
+
+  if (!mrb_obj_is_kind_of(mrb, mrb_obj_value(mrb->exc), mrb_class_get(mrb, "StopIteration")))
+    return false;
+
+  mrb->exc = NULL;
+  return true;
+}
+
+/*
+ * How rows are asked of the wrapper: #each_batch(n) when it is defined, #each
+ * with a block when the class declares .yields_rows, or else one row per call
+ * to #each. The return value of a block-form #each is never taken for a row.
+ */
+static void rbSetRowProtocol(HolycornExecutionState *exec_state) {
+  mrb_state *mrb = exec_state->mrb_state;
+  mrb_value class = mrb_obj_value(mrb_obj_class(mrb, exec_state->iterator));
+
+  exec_state->batched = mrb_respond_to(mrb, exec_state->iterator, mrb_intern_lit(mrb, "each_batch"));
+  exec_state->streamed = false;
+  if (!exec_state->batched && mrb_respond_to(mrb, class, mrb_intern_lit(mrb, "yields_rows"))) {
+    mrb_value yields = mrb_funcall(mrb, class, "yields_rows", 0);
+    holycorn_check_exception(mrb, "calling .yields_rows");
+    exec_state->streamed = mrb_test(yields);
+  }
+
+  if (exec_state->streamed && !holycorn_stream_available(mrb))
+    ereport(ERROR,
+        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+         errmsg("[holycorn] wrappers declaring .yields_rows need the mruby-fiber gem")));
+
+  rbDropStream(exec_state);
+}
+
+static void rbDropStream(HolycornExecutionState *exec_state) {
+  if (mrb_nil_p(exec_state->stream))
+    return;
+
+  mrb_gc_unregister(exec_state->mrb_state, exec_state->stream);
+  exec_state->stream = mrb_nil_value();
+}
+
+/* Next rows of a block-form #each, started for each (re)scan or partition */
+static mrb_value rbNextStreamBatch(HolycornExecutionState *exec_state) {
+  mrb_state *mrb = exec_state->mrb_state;
+  mrb_value batch;
+
+  if (mrb_nil_p(exec_state->stream)) {
+    exec_state->stream = holycorn_stream_new(mrb, exec_state->iterator, exec_state->batch_size);
+    mrb_gc_register(mrb, exec_state->stream);
+  }
+
+  batch = mrb_funcall(mrb, exec_state->stream, "next_batch", 0);
+  if (rbStopIteration(mrb))
+    batch = mrb_nil_value();
+  holycorn_check_exception(mrb, "calling #each");
+
+  if (mrb_nil_p(batch))
+    rbDropStream(exec_state);
+
+  return batch;
+}
+
+/*
+ * Returns the next row produced by the wrapper, or nil once it is exhausted.
+ *
+ * Wrappers implementing #each_batch(n) hand over up to n rows per call, and
+ * block-form #each wrappers n rows per resumption of their Stream; these are
+ * buffered here. Others are asked for one row per #each call.
+ */
+static mrb_value rbNextWrapperRow(HolycornExecutionState *exec_state) {
+  mrb_state *mrb = exec_state->mrb_state;
+  instr_time start;
+
+  if (!exec_state->batched && !exec_state->streamed) {
+    holycorn_stats_start(&exec_state->stats, &start);
+    mrb_value row = mrb_funcall(mrb, exec_state->iterator, "each", 0, NULL);
+    holycorn_stats_accum(&exec_state->stats, &exec_state->stats.fetch_time, start);
+    rbSampleVM(exec_state);
+
+    if (rbStopIteration(mrb))
+      return mrb_nil_value();
+
+    holycorn_check_exception(mrb, "calling #each");
+    return row;
+  }
+
+  if (exec_state->batch_pos >= exec_state->batch_len) {
+    if (!mrb_nil_p(exec_state->batch)) {
+      mrb_gc_unregister(mrb, exec_state->batch);
+      exec_state->batch = mrb_nil_value();
+    }
+
+    if (exec_state->exhausted)
+      return mrb_nil_value();
+
+    holycorn_stats_start(&exec_state->stats, &start);
+    mrb_value batch = exec_state->streamed ? rbNextStreamBatch(exec_state) :
+      mrb_funcall(mrb, exec_state->iterator, "each_batch", 1, mrb_fixnum_value(exec_state->batch_size));
+    holycorn_stats_accum(&exec_state->stats, &exec_state->stats.fetch_time, start);
+    rbSampleVM(exec_state);
+
+    if (rbStopIteration(mrb))
+      batch = mrb_nil_value();
+
+    holycorn_check_exception(mrb, "calling #each_batch");
+
+    /* An empty batch (or nil) marks the end of the scan */
+    if (!mrb_array_p(batch) || RARRAY_LEN(batch) == 0) {
+      exec_state->exhausted = true;
+      return mrb_nil_value();
+    }
+
+    mrb_gc_register(mrb, batch);
+    exec_state->stats.batches++;
+    exec_state->batch = batch;
+    exec_state->batch_pos = 0;
+    exec_state->batch_len = RARRAY_LEN(batch);
+  }
+
+  return mrb_ary_entry(exec_state->batch, exec_state->batch_pos++);
+}
+
+/*
+ * Wrappers whose class defines .partitions are scanned a partition at a time,
+ * through #partition(unit), whether the scan runs in parallel or not: every
+ * participant gets the same partitions from the class.
+ */
+static void rbLoadPartitions(HolycornExecutionState *exec_state, mrb_value class, mrb_value env) {
+  mrb_state *mrb = exec_state->mrb_state;
+  mrb_value partitions;
+
+  exec_state->partitioned = false;
+  exec_state->partitions = mrb_nil_value();
+  exec_state->npartitions = 0;
+  exec_state->next_partition = 0;
+  exec_state->in_partition = false;
+
+  if (!mrb_respond_to(mrb, class, mrb_intern_lit(mrb, "partitions")))
+    return;
+
+  partitions = mrb_funcall(mrb, class, "partitions", 1, env);
+  holycorn_check_exception(mrb, "calling .partitions");
+
+  if (!mrb_array_p(partitions))
+    ereport(ERROR,
+        (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+         errmsg("[holycorn] .partitions must return an array")));
+
+  if (!mrb_obj_respond_to(mrb, mrb_class_ptr(class), mrb_intern_lit(mrb, "partition")))
+    ereport(ERROR,
+        (errcode(ERRCODE_FDW_ERROR),
+         errmsg("[holycorn] wrappers implementing .partitions must implement #partition(unit)")));
+
+  mrb_gc_register(mrb, partitions);
+  exec_state->partitioned = true;
+  exec_state->partitions = partitions;
+  exec_state->npartitions = RARRAY_LEN(partitions);
+}
+
+/*
+ * Moves the wrapper to the next unclaimed partition through #partition(unit).
+ * Partitions are claimed from shared memory when the scan runs in parallel,
+ * or all scanned by this backend otherwise.
+ */
+static bool rbClaimPartition(HolycornExecutionState *exec_state) {
+  mrb_state *mrb = exec_state->mrb_state;
+  instr_time start;
+  uint32 index;
+
+#if PG_VERSION_NUM >= 90600
+  if (exec_state->pstate != NULL)
+    index = pg_atomic_fetch_add_u32(&exec_state->pstate->next_partition, 1);
+  else
+#endif
+    index = exec_state->next_partition++;
+
+  if (index >= exec_state->npartitions)
+    return false;
+
+  holycorn_stats_start(&exec_state->stats, &start);
+  mrb_funcall(mrb, exec_state->iterator, "partition", 1, mrb_ary_entry(exec_state->partitions, index));
+  holycorn_stats_accum(&exec_state->stats, &exec_state->stats.fetch_time, start);
+  holycorn_check_exception(mrb, "calling #partition");
+
+  exec_state->batch_pos = 0;
+  exec_state->batch_len = 0;
+  exec_state->exhausted = false;
+  exec_state->in_partition = true;
+
+  return true;
+}
+
+/*
+ * Records the VM's peak heap and live objects. mruby has no GC hooks, so the
+ * object count sampled after each call into the wrapper is what tells GC
+ * pressure apart, and collections are part of the time of these calls.
+ */
+static void rbSampleVM(HolycornExecutionState *exec_state) {
+  int64 live = (int64) exec_state->mrb_state->gc.live;
+
+  if (exec_state->stats.peak_objects < live)
+    exec_state->stats.peak_objects = live;
+
+  exec_state->stats.peak_heap = exec_state->vm->heap_peak;
+}
+
+static mrb_value rbNextRow(HolycornExecutionState *exec_state) {
+  if (!exec_state->partitioned)
+    return rbNextWrapperRow(exec_state);
+
+  for (;;) {
+    if (exec_state->in_partition) {
+      mrb_value row = rbNextWrapperRow(exec_state);
+
+      if (!mrb_nil_p(row))
+        return row;
+
+      exec_state->in_partition = false;
+    }
+
+    if (!rbClaimPartition(exec_state))
+      return mrb_nil_value();
+  }
+}
+
+static TupleTableSlot * rbIterateForeignScan(ForeignScanState *node) {
+  HolycornExecutionState *exec_state = (HolycornExecutionState *) node->fdw_state;
+  TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+
+  ExecClearTuple(slot);
+
+  if (exec_state->replaying) {
+#if PG_VERSION_NUM >= 120000
+    if (tuplestore_gettupleslot(exec_state->cache, true, false, exec_state->replay_slot))
+      ExecCopySlot(slot, exec_state->replay_slot);
+#else
+    tuplestore_gettupleslot(exec_state->cache, true, false, slot);
+#endif
+    return slot;
+  }
+
+  /* Under a pushed down LIMIT, the wrapper isn't called once the rows are there */
+  if (exec_state->limit >= 0 && exec_state->position >= (int64) exec_state->offset + exec_state->limit) {
+    rbStopWorker(exec_state);
+    rbFinishRows(exec_state);
+    return slot;
+  }
+
+  while (rbFetchRow(node, exec_state, slot)) {
+    if (exec_state->position++ >= exec_state->offset) {
+      rbKeepRow(exec_state, slot);
+      return slot;
+    }
+
+    ExecClearTuple(slot);
+  }
+
+  return slot;
+}
+
+/* Stores the next row of the wrapper in slot, false once there are no more */
+static bool rbFetchRow(ForeignScanState *node, HolycornExecutionState *exec_state, TupleTableSlot *slot) {
+  mrb_state *mrb = exec_state->mrb_state;
+  mrb_value output;
+  instr_time start;
+
+  if (exec_state->hps->worker) {
+    if (rbNextWorkerRow(node, exec_state, slot))
+      return true;
+
+    rbFinishRows(exec_state);
+    return false;
+  }
+
+  if (!exec_state->started) {
+    rbStartWrapper(node, exec_state);
+    mrb_gc_arena_restore(mrb, exec_state->arena_idx);
+  }
+
+  output = rbNextRow(exec_state);
+
+  if (mrb_nil_p(output)) {
+    rbFinishRows(exec_state);
+    return false;
+  } else if (!mrb_array_p(output) && !mrb_hash_p(output) && holycorn_row_get(mrb, output) == NULL) {
+    output = mrb_funcall(mrb, output, "inspect", 0, NULL);
+    elog(LOG, "#each must provide an array, a hash or a Holycorn::Row (was %s)", RSTRING_PTR(output));
+    return false;
+  }
+
+  holycorn_stats_start(&exec_state->stats, &start);
+  holycorn_convert_row(mrb, exec_state->converters, output, slot->tts_values, slot->tts_isnull);
+  holycorn_stats_accum(&exec_state->stats, &exec_state->stats.conversion_time, start);
+  exec_state->stats.rows++;
+  ExecStoreVirtualTuple(slot);
+
+  /* Release the Ruby objects created for this row */
+  mrb_gc_arena_restore(mrb, exec_state->arena_idx);
+
+  return true;
+}
+
+/* The wrapper returned all its rows: they can be replayed and shared */
+static void rbFinishRows(HolycornExecutionState *exec_state) {
+  exec_state->cache_complete = exec_state->caching;
+
+  if (exec_state->result_cache_key != NULL) {
+    holycorn_result_cache_publish(exec_state->result_cache_key, exec_state->result_cache_rows,
+        exec_state->hps->cache_ttl);
+    exec_state->result_cache_key = NULL;
+  }
+}
+
+/* Keeps a row returned by the scan for rescans and for the shared cache */
+static void rbKeepRow(HolycornExecutionState *exec_state, TupleTableSlot *slot) {
+  if (exec_state->caching)
+    tuplestore_puttupleslot(exec_state->cache, slot);
+
+  /* Results too large for the shared cache are only returned */
+  if (exec_state->result_cache_key != NULL) {
+    holycorn_result_cache_append(exec_state->result_cache_rows, slot);
+
+    if (exec_state->result_cache_rows->len > holycorn_result_cache_max_entry()) {
+      holycorn_result_cache_abandon(exec_state->result_cache_key);
+      exec_state->result_cache_key = NULL;
+      exec_state->result_cache_status = "bypassed";
+    }
+  }
+}
+
+/*
+ * A value in the form of datumSerialize(), hex-encoded to fit in a node
+ * string: unlike its text form, it doesn't depend on settings such as
+ * extra_float_digits, and reads back to the same value.
+ */
+static char *rbSerializeDatum(Datum value, bool isnull, Oid typid) {
+#if PG_VERSION_NUM >= 100000
+  int16 typlen;
+  bool typbyval;
+  Size len;
+  char *data, *cursor, *hex;
+
+  get_typlenbyval(typid, &typlen, &typbyval);
+  len = datumEstimateSpace(value, isnull, typbyval, typlen);
+  data = cursor = (char *) palloc(len);
+  datumSerialize(value, isnull, typbyval, typlen, &cursor);
+
+  hex = (char *) palloc(len * 2 + 1);
+  hex_encode(data, len, hex);
+  hex[len * 2] = '\0';
+
+  return hex;
+#else
+  elog(ERROR, "[holycorn] execution 'worker' requires PostgreSQL 10 or later");
+  return NULL;
+#endif
+}
+
+/*
+ * What a worker needs to know to run the wrapper of a scan, as a node string:
+ * the quals, with their values computed for this (re)scan (see
+ * rbSerializeDatum()), the attnums of the columns used, the memory limit of
+ * the VM (which may come from a setting of this session), the order, the
+ * limit and offset, the fdw_private of the plan and the attributes of the
+ * table. The worker can't look up the table and its options itself: its
+ * snapshot wouldn't see changes this transaction hasn't committed.
+ */
+static char *rbWorkerSpec(ForeignScanState *node, HolycornExecutionState *exec_state) {
+  ForeignScan *plan = (ForeignScan *) node->ss.ps.plan;
+  ExprContext *econtext = node->ss.ps.ps_ExprContext;
+  TupleDesc tupdesc = RelationGetDescr(node->ss.ss_currentRelation);
+  List *quals = (List *) list_nth(plan->fdw_private, HolycornScanQuals);
+  List *spec_quals = NIL;
+  List *attributes = NIL;
+  List *spec;
+  ListCell *cell;
+
+  foreach(cell, quals) {
+    List *qual = (List *) lfirst(cell);
+    int value_index = intVal(lthird(qual));
+    List *spec_qual = list_make2(linitial(qual), lsecond(qual));
+
+    if (value_index >= 0) {
+      ExprState *value_state = (ExprState *) list_nth(exec_state->value_states, value_index);
+      Oid typid = exprType((Node *) list_nth(plan->fdw_exprs, value_index));
+      bool isnull;
+#if PG_VERSION_NUM >= 100000
+      Datum datum = ExecEvalExpr(value_state, econtext, &isnull);
+#else
+      Datum datum = ExecEvalExpr(value_state, econtext, &isnull, NULL);
+#endif
+
+      spec_qual = lappend(spec_qual, makeString(psprintf("%u", typid)));
+      spec_qual = lappend(spec_qual, makeString(rbSerializeDatum(datum, isnull, typid)));
+    }
+
+    spec_quals = lappend(spec_quals, spec_qual);
+  }
+
+  /* Attributes are (name, type, typmod, dropped) */
+  for (int i = 0; i < tupdesc->natts; i++) {
+    Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+    List *attribute = list_make2(makeString(pstrdup(NameStr(attr->attname))),
+        makeString(psprintf("%u", attr->atttypid)));
+
+    attribute = lappend(attribute, makeInteger(attr->atttypmod));
+    attribute = lappend(attribute, makeInteger(attr->attisdropped));
+    attributes = lappend(attributes, attribute);
+  }
+
+  spec = list_make4(spec_quals, list_nth(plan->fdw_private, HolycornScanColumns),
+      makeInteger(exec_state->hps->memory_limit), list_nth(plan->fdw_private, HolycornScanOrder));
+  spec = lappend(spec, list_make2(makeInteger(exec_state->limit), makeInteger(exec_state->offset)));
+  spec = lappend(spec, plan->fdw_private);
+  spec = lappend(spec, attributes);
+
+  return nodeToString(spec);
+}
+
+/* Stores the next row sent by the worker in slot, false at the end */
+static bool rbNextWorkerRow(ForeignScanState *node, HolycornExecutionState *exec_state, TupleTableSlot *slot) {
+  MinimalTuple tuple;
+  instr_time start;
+
+  if (exec_state->exhausted)
+    return false;
+
+  if (exec_state->worker == NULL) {
+    holycorn_stats_start(&exec_state->stats, &start);
+    exec_state->worker = holycorn_worker_launch(rbWorkerSpec(node, exec_state));
+    holycorn_stats_accum(&exec_state->stats, &exec_state->stats.vm_startup_time, start);
+  }
+
+  holycorn_stats_start(&exec_state->stats, &start);
+  tuple = holycorn_worker_receive(exec_state->worker);
+  holycorn_stats_accum(&exec_state->stats, &exec_state->stats.fetch_time, start);
+
+  if (tuple == NULL) {
+    rbStopWorker(exec_state);
+    exec_state->exhausted = true;
+    return false;
+  }
+
+#if PG_VERSION_NUM >= 120000
+  ExecStoreMinimalTuple(tuple, exec_state->replay_slot, false);
+  ExecCopySlot(slot, exec_state->replay_slot);
+#else
+  ExecStoreMinimalTuple(tuple, slot, false);
+#endif
+  exec_state->stats.rows++;
+  return true;
+}
+
+static void rbStopWorker(HolycornExecutionState *exec_state) {
+  if (exec_state->worker == NULL)
+    return;
+
+  holycorn_worker_stop(exec_state->worker);
+  exec_state->worker = NULL;
+}
+
+/*
+ * Rescans replay the rows cached during the first pass when the values of the
+ * quals are still the same. Otherwise the wrapper starts over on the next
+ * fetch.
+ */
+static void rbReScanForeignScan(ForeignScanState *node) {
+  HolycornExecutionState *exec_state = (HolycornExecutionState *) node->fdw_state;
+  mrb_state *mrb = exec_state->mrb_state;
+  bool params_changed = bms_overlap(node->ss.ps.chgParam, exec_state->value_params);
+
+  if (exec_state->cache_complete && !params_changed) {
+    exec_state->replaying = true;
+    tuplestore_rescan(exec_state->cache);
+    return;
+  }
+
+  exec_state->replaying = false;
+  exec_state->cache_complete = false;
+  if (exec_state->cache != NULL)
+    tuplestore_clear(exec_state->cache);
+  if (exec_state->result_cache_key != NULL)
+    resetStringInfo(exec_state->result_cache_rows);
+
+  if (!mrb_nil_p(exec_state->batch)) {
+    mrb_gc_unregister(mrb, exec_state->batch);
+    exec_state->batch = mrb_nil_value();
+  }
+  rbDropStream(exec_state);
+  exec_state->batch_pos = 0;
+  exec_state->batch_len = 0;
+  exec_state->exhausted = false;
+  exec_state->position = 0;
+  exec_state->next_partition = 0;
+  exec_state->in_partition = false;
+
+  /* The parameters may change again before the next fetch */
+  exec_state->started = false;
+  rbStopWorker(exec_state);
+}
+
+static void rbEndForeignScan(ForeignScanState *node) {
+  HolycornExecutionState *exec_state = (HolycornExecutionState *) node->fdw_state;
+
+  if (exec_state == NULL)
+    return;
+
+  /* The scan stopped before the end of the rows: they can't be shared */
+  if (exec_state->result_cache_key != NULL)
+    holycorn_result_cache_abandon(exec_state->result_cache_key);
+
+  if (exec_state->cache != NULL)
+    tuplestore_end(exec_state->cache);
+
+  if (exec_state->hps->worker) {
+    rbStopWorker(exec_state);
+    holycorn_stats_report(exec_state->wrapper, &exec_state->stats);
+    return;
+  }
+
+  /* Served from the shared result cache */
+  if (exec_state->vm == NULL)
+    return;
+
+  if (!mrb_nil_p(exec_state->batch))
+    mrb_gc_unregister(exec_state->mrb_state, exec_state->batch);
+
+  rbDropStream(exec_state);
+
+  if (!mrb_nil_p(exec_state->partitions))
+    mrb_gc_unregister(exec_state->mrb_state, exec_state->partitions);
+
+  if (!mrb_nil_p(exec_state->iterator))
+    mrb_gc_unregister(exec_state->mrb_state, exec_state->iterator);
+
+  holycorn_stats_report(exec_state->wrapper, &exec_state->stats);
+  holycorn_vm_release(exec_state->vm);
+}
+
+static bool rbAnalyzeForeignTable(Relation relation, AcquireSampleRowsFunc *func, BlockNumber *totalpages) {
+  *func = rbAcquireSampleRows;
+  *totalpages = 1;  /* wrappers have no pages */
+
+  return true;
+}
+
+/* A row returned by the wrapper, as a tuple allocated in the caller's context */
+static HeapTuple rbFormSampleRow(HolycornExecutionState *exec_state, TupleDesc tupdesc, mrb_value row,
+    MemoryContext tupcontext) {
+  MemoryContext oldcontext = MemoryContextSwitchTo(tupcontext);
+  Datum *values = (Datum *) palloc(sizeof(Datum) * tupdesc->natts);
+  bool *nulls = (bool *) palloc(sizeof(bool) * tupdesc->natts);
+  HeapTuple tuple;
+
+  if (!mrb_array_p(row) && !mrb_hash_p(row) && holycorn_row_get(exec_state->mrb_state, row) == NULL)
+    ereport(ERROR,
+        (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+         errmsg("[holycorn] rows must be arrays, hashes or Holycorn::Row objects")));
+
+  holycorn_convert_row(exec_state->mrb_state, exec_state->converters, row, values, nulls);
+
+  MemoryContextSwitchTo(oldcontext);
+  tuple = heap_form_tuple(tupdesc, values, nulls);
+  MemoryContextReset(tupcontext);
+
+  return tuple;
+}
+
+/*
+ * ANALYZE samples the rows of the wrapper: through #sample(n) when it
+ * implements it, an Array of at most n rows picked at random, with the total
+ * number of rows taken from .estimate. Otherwise all the rows are read and
+ * sampled here, like file_fdw does.
+ */
+static int rbAcquireSampleRows(Relation relation, int elevel, HeapTuple *rows, int targrows,
+    double *totalrows, double *totaldeadrows) {
+  HolycornPlanState *hps = (HolycornPlanState *) palloc0(sizeof(HolycornPlanState));
+  HolycornExecutionState *exec_state = (HolycornExecutionState *) palloc0(sizeof(HolycornExecutionState));
+  TupleDesc tupdesc = RelationGetDescr(relation);
+  HolycornPlanInfo info;
+  MemoryContext tupcontext;
+  mrb_state *mrb;
+  mrb_value env, columns;
+  int numrows = 0;
+
+  rbGetOptions(RelationGetRelid(relation), hps, &hps->options);
+  rbGetPlanInfo(hps, tupdesc, &info);
+
+  exec_state->wrapper = hps->wrapper_class ? hps->wrapper_class : hps->wrapper_path;
+  exec_state->hps = hps;
+  exec_state->vm = holycorn_vm_acquire(rbWrapperKey(hps->wrapper_path, hps->wrapper_class, hps->options),
+      hps->memory_limit);
+  exec_state->mrb_state = mrb = exec_state->vm->mrb;
+  exec_state->class = rbLoadWrapper(mrb, hps->wrapper_path, hps->wrapper_class);
+  exec_state->env = env = rbBuildEnv(mrb, hps);
+  exec_state->converters = holycorn_build_converters(mrb, tupdesc);
+  exec_state->batch_size = hps->batch_size;
+  exec_state->batch = mrb_nil_value();
+  exec_state->stream = mrb_nil_value();
+  exec_state->partitions = mrb_nil_value();
+
+  /* All the columns, without quals */
+  columns = mrb_ary_new_capa(mrb, tupdesc->natts);
+  for (int i = 0; i < tupdesc->natts; i++) {
+    Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+
+    if (!attr->attisdropped)
+      mrb_ary_push(mrb, columns, mrb_str_new_cstr(mrb, NameStr(attr->attname)));
+  }
+  mrb_hash_set(mrb, env, mrb_str_new_lit(mrb, "columns"), columns);
+  mrb_hash_set(mrb, env, mrb_str_new_lit(mrb, "quals"), mrb_ary_new(mrb));
+  rbSetAttributes(mrb, env, tupdesc);
+
+  exec_state->iterator = rbNewWrapper(mrb, exec_state->class, env, hps);
+  mrb_gc_register(mrb, exec_state->iterator);
+  rbSetRowProtocol(exec_state);
+  rbLoadPartitions(exec_state, exec_state->class, env);
+  exec_state->arena_idx = mrb_gc_arena_save(mrb);
+
+  /* Conversions may leak, so they're done in a context reset for each row */
+  tupcontext = AllocSetContextCreate(CurrentMemoryContext, "holycorn analyze",
+#if PG_VERSION_NUM >= 90600
+      ALLOCSET_DEFAULT_SIZES);
+#else
+      ALLOCSET_DEFAULT_MINSIZE, ALLOCSET_DEFAULT_INITSIZE, ALLOCSET_DEFAULT_MAXSIZE);
+#endif
+
+  *totalrows = 0;
+  *totaldeadrows = 0;
+
+  if (mrb_respond_to(mrb, exec_state->iterator, mrb_intern_lit(mrb, "sample"))) {
+    mrb_value sample = mrb_funcall(mrb, exec_state->iterator, "sample", 1, mrb_fixnum_value(targrows));
+    holycorn_check_exception(mrb, "calling #sample");
+
+    if (!mrb_array_p(sample))
+      ereport(ERROR,
+          (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+           errmsg("[holycorn] #sample must return an array of rows")));
+
+    for (mrb_int i = 0; i < RARRAY_LEN(sample) && numrows < targrows; i++) {
+      vacuum_delay_point();
+      rows[numrows++] = rbFormSampleRow(exec_state, tupdesc, mrb_ary_entry(sample, i), tupcontext);
+    }
+
+    *totalrows = (info.estimated && info.rows > numrows) ? info.rows : numrows;
+  } else {
+    double rowstoskip = -1;  /* -1 means not set yet */
+#if PG_VERSION_NUM >= 90500
+    ReservoirStateData rstate;
+
+    reservoir_init_selection_state(&rstate, targrows);
+#else
+    double rstate = anl_init_selection_state(targrows);
+#endif
+
+    for (;;) {
+      mrb_value row;
+
+      vacuum_delay_point();
+
+      row = rbNextRow(exec_state);
+      if (mrb_nil_p(row))
+        break;
+
+      /*
+       * The first targrows rows fill the reservoir, then each row replaces
+       * a random one of it with decreasing probability (Vitter's algorithm).
+       */
+      if (numrows < targrows) {
+        rows[numrows++] = rbFormSampleRow(exec_state, tupdesc, row, tupcontext);
+      } else {
+        if (rowstoskip < 0)
+#if PG_VERSION_NUM >= 90500
+          rowstoskip = reservoir_get_next_S(&rstate, *totalrows, targrows);
+#else
+          rowstoskip = anl_get_next_S(*totalrows, targrows, &rstate);
+#endif
+
+        if (rowstoskip <= 0) {
+#if PG_VERSION_NUM >= 150000
+          int k = (int) (targrows * sampler_random_fract(&rstate.randstate));
+#elif PG_VERSION_NUM >= 90500
+          int k = (int) (targrows * sampler_random_fract(rstate.randstate));
+#else
+          int k = (int) (targrows * anl_random_fract());
+#endif
+
+          Assert(k >= 0 && k < targrows);
+          heap_freetuple(rows[k]);
+          rows[k] = rbFormSampleRow(exec_state, tupdesc, row, tupcontext);
+        }
+
+        rowstoskip -= 1;
+      }
+
+      *totalrows += 1;
+      mrb_gc_arena_restore(mrb, exec_state->arena_idx);
+    }
+  }
+
+  MemoryContextDelete(tupcontext);
+
+  if (!mrb_nil_p(exec_state->batch))
+    mrb_gc_unregister(mrb, exec_state->batch);
+  rbDropStream(exec_state);
+  if (!mrb_nil_p(exec_state->partitions))
+    mrb_gc_unregister(mrb, exec_state->partitions);
+  mrb_gc_unregister(mrb, exec_state->iterator);
+  holycorn_vm_release(exec_state->vm);
+
+  ereport(elevel,
+      (errmsg("\"%s\": %d rows sampled from %s, out of %.0f rows",
+              RelationGetRelationName(relation), numrows, exec_state->wrapper, *totalrows)));
+
+  return numrows;
+}
+
+#if PG_VERSION_NUM >= 100000
+/* The tuple descriptor of the attributes of a worker spec */
+static TupleDesc rbWorkerTupleDesc(List *attributes) {
+#if PG_VERSION_NUM >= 120000
+  TupleDesc tupdesc = CreateTemplateTupleDesc(list_length(attributes));
+#else
+  TupleDesc tupdesc = CreateTemplateTupleDesc(list_length(attributes), false);
+#endif
+  AttrNumber attnum = 0;
+  ListCell *cell;
+
+  foreach(cell, attributes) {
+    List *attribute = (List *) lfirst(cell);
+    bool dropped = intVal(lfourth(attribute)) != 0;
+
+    attnum++;
+
+    /* Dropped columns are always NULL, whatever their type was */
+    TupleDescInitEntry(tupdesc, attnum, strVal(linitial(attribute)),
+        dropped ? INT4OID : atooid(strVal(lsecond(attribute))), intVal(lthird(attribute)), 0);
+    TupleDescAttr(tupdesc, attnum - 1)->attisdropped = dropped;
+  }
+
+  return tupdesc;
+}
+
+/*
+ * Runs the wrapper of a scan with execution 'worker', in the background
+ * worker: spec comes from rbWorkerSpec(), and the rows are sent as minimal
+ * tuples of the table until the wrapper is done or the scan is gone.
+ */
+void holycorn_worker_scan(const char *spec, shm_mq_handle *mqh) {
+  List *scan = (List *) stringToNode(pstrdup(spec));
+  List *quals = (List *) linitial(scan);
+  List *columns = (List *) lsecond(scan);
+  List *limit = (List *) list_nth(scan, 4);
+  int64 rows = 0;
+  HolycornPlanState *hps = rbDeserializePlanState((List *) list_nth(scan, 5));
+  HolycornExecutionState *exec_state = (HolycornExecutionState *) palloc0(sizeof(HolycornExecutionState));
+  TupleDesc tupdesc = rbWorkerTupleDesc((List *) list_nth(scan, 6));
+  Datum *values = (Datum *) palloc(sizeof(Datum) * tupdesc->natts);
+  bool *nulls = (bool *) palloc(sizeof(bool) * tupdesc->natts);
+  MemoryContext tupcontext;
+  mrb_state *mrb;
+  mrb_value env, mrb_quals, mrb_columns;
+  ListCell *cell;
+
+  hps->memory_limit = intVal(lthird(scan));
+
+  exec_state->wrapper = hps->wrapper_class ? hps->wrapper_class : hps->wrapper_path;
+  exec_state->hps = hps;
+  exec_state->vm = holycorn_vm_acquire(rbWrapperKey(hps->wrapper_path, hps->wrapper_class, hps->options),
+      hps->memory_limit);
+  exec_state->mrb_state = mrb = exec_state->vm->mrb;
+  exec_state->class = rbLoadWrapper(mrb, hps->wrapper_path, hps->wrapper_class);
+  exec_state->env = env = rbBuildEnv(mrb, hps);
+  exec_state->converters = holycorn_build_converters(mrb, tupdesc);
+  exec_state->batch_size = hps->batch_size;
+  exec_state->batch = mrb_nil_value();
+  exec_state->stream = mrb_nil_value();
+  exec_state->partitions = mrb_nil_value();
+
+  /* Quals are (column, operator[, type, value]), see rbSerializeDatum() for the value */
+  mrb_quals = mrb_ary_new_capa(mrb, list_length(quals));
+  foreach(cell, quals) {
+    List *qual = (List *) lfirst(cell);
+    mrb_value value = mrb_nil_value();
+
+    if (list_length(qual) > 3) {
+      char *hex = strVal(lfourth(qual));
+      size_t len = strlen(hex) / 2;
+      char *data = (char *) palloc(len);
+      char *cursor = data;
+      bool isnull;
+      Datum datum;
+
+      hex_decode(hex, len * 2, data);
+      datum = datumRestore(&cursor, &isnull);
+      value = holycorn_datum_to_mrb(mrb, datum, isnull, atooid(strVal(lthird(qual))));
+    }
+
+    mrb_ary_push(mrb, mrb_quals, rbQualToMrb(mrb,
+          strVal(linitial(qual)), strVal(lsecond(qual)), value, list_length(qual) > 2));
+  }
+  mrb_hash_set(mrb, env, mrb_str_new_lit(mrb, "quals"), mrb_quals);
+
+  for (int i = 0; i < exec_state->converters->natts; i++)
+    exec_state->converters->columns[i].projected = false;
+
+  mrb_columns = mrb_ary_new_capa(mrb, list_length(columns));
+  foreach(cell, columns) {
+    AttrNumber attnum = intVal(lfirst(cell));
+    Form_pg_attribute attr = TupleDescAttr(tupdesc, attnum - 1);
+
+    if (attr->attisdropped)
+      continue;
+
+    exec_state->converters->columns[attnum - 1].projected = true;
+    mrb_ary_push(mrb, mrb_columns, mrb_str_new_cstr(mrb, NameStr(attr->attname)));
+  }
+  mrb_hash_set(mrb, env, mrb_str_new_lit(mrb, "columns"), mrb_columns);
+  rbSetAttributes(mrb, env, tupdesc);
+  rbSetOrderAndLimit(mrb, env, tupdesc, (List *) list_nth(scan, 3), intVal(linitial(limit)), intVal(lsecond(limit)));
+
+  /* The scan needs no more than offset + limit rows */
+  exec_state->limit = intVal(linitial(limit));
+  exec_state->offset = intVal(lsecond(limit));
+  if (exec_state->limit >= 0)
+    exec_state->batch_size = Max(Min(exec_state->batch_size, exec_state->offset + exec_state->limit), 1);
+
+  exec_state->iterator = rbNewWrapper(mrb, exec_state->class, env, hps);
+  mrb_gc_register(mrb, exec_state->iterator);
+  rbSetRowProtocol(exec_state);
+  rbLoadPartitions(exec_state, exec_state->class, env);
+  exec_state->arena_idx = mrb_gc_arena_save(mrb);
+
+  tupcontext = AllocSetContextCreate(CurrentMemoryContext, "holycorn worker rows",
+      ALLOCSET_DEFAULT_SIZES);
+
+  for (;;) {
+    MemoryContext oldcontext;
+    mrb_value row;
+    bool sent;
+
+    CHECK_FOR_INTERRUPTS();
+
+    row = rbNextRow(exec_state);
+    if (mrb_nil_p(row))
+      break;
+
+    if (!mrb_array_p(row) && !mrb_hash_p(row) && holycorn_row_get(mrb, row) == NULL) {
+      row = mrb_funcall(mrb, row, "inspect", 0, NULL);
+      elog(LOG, "#each must provide an array, a hash or a Holycorn::Row (was %s)", RSTRING_PTR(row));
+      break;
+    }
+
+    oldcontext = MemoryContextSwitchTo(tupcontext);
+    holycorn_convert_row(mrb, exec_state->converters, row, values, nulls);
+    sent = holycorn_worker_send(mqh, heap_form_minimal_tuple(tupdesc, values, nulls));
+    MemoryContextSwitchTo(oldcontext);
+
+    MemoryContextReset(tupcontext);
+    mrb_gc_arena_restore(mrb, exec_state->arena_idx);
+
+    /* The scan doesn't need more rows */
+    if (!sent || (exec_state->limit >= 0 && ++rows >= (int64) exec_state->offset + exec_state->limit))
+      break;
+  }
+
+  MemoryContextDelete(tupcontext);
+
+  if (!mrb_nil_p(exec_state->batch))
+    mrb_gc_unregister(mrb, exec_state->batch);
+  rbDropStream(exec_state);
+  if (!mrb_nil_p(exec_state->partitions))
+    mrb_gc_unregister(mrb, exec_state->partitions);
+  mrb_gc_unregister(mrb, exec_state->iterator);
+  holycorn_vm_release(exec_state->vm);
+}
+#endif
+
+/*
+ * UPDATE and DELETE hand the wrapper the rows being changed, as they were
+ * scanned: the whole row is fetched as a junk column.
+ */
+static void rbAddForeignUpdateTargets(
+#if (PG_VERSION_NUM >= 140000)
+    PlannerInfo *root, Index rtindex,
+#else
+    Query *parsetree,
+#endif
+    RangeTblEntry *target_rte, Relation target_relation) {
+  Var *var;
+
+#if (PG_VERSION_NUM >= 140000)
+  var = makeWholeRowVar(target_rte, rtindex, 0, false);
+  add_row_identity_var(root, var, rtindex, "holycorn_rowid");
+#else
+  TargetEntry *tle;
+
+  var = makeWholeRowVar(target_rte, parsetree->resultRelation, 0, false);
+  tle = makeTargetEntry((Expr *) var, list_length(parsetree->targetList) + 1, pstrdup("holycorn_rowid"), true);
+  parsetree->targetList = lappend(parsetree->targetList, tle);
+#endif
+}
+
+static List *rbPlanForeignModify(PlannerInfo *root, ModifyTable *plan, Index resultRelation, int subplan_index) {
+#if (PG_VERSION_NUM >= 90500)
+  if (plan->onConflictAction != ONCONFLICT_NONE)
+    ereport(ERROR,
+        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+         errmsg("[holycorn] INSERT with ON CONFLICT is not supported")));
+#endif
+
+  return NIL;
+}
+
+/*
+ * Instantiates the wrapper for writes. It is given the same env as for scans
+ * (without quals), and must implement the batch method of the operation.
+ */
+static HolycornModifyState *rbBeginModify(ResultRelInfo *rinfo, CmdType operation, Plan *subplan) {
+  Relation rel = rinfo->ri_RelationDesc;
+  HolycornModifyState *state = (HolycornModifyState *) palloc0(sizeof(HolycornModifyState));
+  HolycornPlanState hps;
+  mrb_state *mrb;
+  mrb_value class, env, columns;
+
+  memset(&hps, 0, sizeof(HolycornPlanState));
+  rbGetOptions(RelationGetRelid(rel), &hps, &hps.options);
+
+  state->relid = RelationGetRelid(rel);
+  state->operation = operation;
+  state->method = operation == CMD_INSERT ? "insert_batch" :
+    operation == CMD_UPDATE ? "update_batch" : "delete_batch";
+  state->tupdesc = RelationGetDescr(rel);
+  state->batch_size = hps.batch_size;
+
+  state->vm = holycorn_vm_acquire(rbWrapperKey(hps.wrapper_path, hps.wrapper_class, hps.options),
+      hps.memory_limit);
+  state->mrb_state = mrb = state->vm->mrb;
+
+  class = rbLoadWrapper(mrb, hps.wrapper_path, hps.wrapper_class);
+  env = rbBuildEnv(mrb, &hps);
+  columns = mrb_ary_new_capa(mrb, state->tupdesc->natts);
+
+  for (int i = 0; i < state->tupdesc->natts; i++) {
+    Form_pg_attribute attr = TupleDescAttr(state->tupdesc, i);
+
+    if (!attr->attisdropped)
+      mrb_ary_push(mrb, columns, mrb_str_new_cstr(mrb, NameStr(attr->attname)));
+  }
+
+  mrb_hash_set(mrb, env, mrb_str_new_lit(mrb, "quals"), mrb_ary_new(mrb));
+  mrb_hash_set(mrb, env, mrb_str_new_lit(mrb, "columns"), columns);
+
+  state->wrapper = rbNewWrapper(mrb, class, env, &hps);
+
+  if (!mrb_respond_to(mrb, state->wrapper, mrb_intern_cstr(mrb, state->method)))
+    ereport(ERROR,
+        (errcode(ERRCODE_FDW_ERROR),
+         errmsg("[holycorn] %s doesn't implement #%s",
+           hps.wrapper_class ? hps.wrapper_class : hps.wrapper_path, state->method)));
+
+  if (operation != CMD_INSERT) {
+    state->rowid_attno = ExecFindJunkAttributeInTlist(subplan->targetlist, "holycorn_rowid");
+
+    if (!AttributeNumberIsValid(state->rowid_attno))
+      elog(ERROR, "[holycorn] could not find junk holycorn_rowid column");
+
+    state->old_values = (Datum *) palloc(sizeof(Datum) * state->tupdesc->natts);
+    state->old_isnull = (bool *) palloc(sizeof(bool) * state->tupdesc->natts);
+  }
+
+  state->buffer = mrb_ary_new_capa(mrb, state->batch_size);
+  mrb_gc_register(mrb, state->buffer);
+  state->arena_idx = mrb_gc_arena_save(mrb);
+
+  return state;
+}
+
+static void rbBeginForeignModify(ModifyTableState *mtstate, ResultRelInfo *rinfo, List *fdw_private,
+    int subplan_index, int eflags) {
+  Plan *subplan = NULL;
+
+  /* Nothing to write for a plain EXPLAIN */
+  if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+    return;
+
+  if (mtstate->operation != CMD_INSERT) {
+#if (PG_VERSION_NUM >= 140000)
+    subplan = outerPlanState(mtstate)->plan;
+#else
+    subplan = mtstate->mt_plans[subplan_index]->plan;
+#endif
+  }
+
+  rinfo->ri_FdwState = rbBeginModify(rinfo, mtstate->operation, subplan);
+}
+
+static mrb_value rbNewRow(HolycornModifyState *state, TupleTableSlot *slot) {
+  slot_getallattrs(slot);
+
+  return holycorn_row_to_mrb(state->mrb_state, state->tupdesc, slot->tts_values, slot->tts_isnull);
+}
+
+static mrb_value rbOldRow(HolycornModifyState *state, TupleTableSlot *planSlot) {
+  HeapTupleHeader header;
+  HeapTupleData tuple;
+  bool isnull;
+  Datum datum = ExecGetJunkAttribute(planSlot, state->rowid_attno, &isnull);
+
+  if (isnull)
+    elog(ERROR, "[holycorn] holycorn_rowid is NULL");
+
+  header = DatumGetHeapTupleHeader(datum);
+  tuple.t_len = HeapTupleHeaderGetDatumLength(header);
+  ItemPointerSetInvalid(&tuple.t_self);
+  tuple.t_tableOid = InvalidOid;
+  tuple.t_data = header;
+
+  heap_deform_tuple(&tuple, state->tupdesc, state->old_values, state->old_isnull);
+
+  return holycorn_row_to_mrb(state->mrb_state, state->tupdesc, state->old_values, state->old_isnull);
+}
+
+static void rbBufferRow(HolycornModifyState *state, mrb_value row) {
+  mrb_ary_push(state->mrb_state, state->buffer, row);
+  mrb_gc_arena_restore(state->mrb_state, state->arena_idx);
+
+  if (RARRAY_LEN(state->buffer) >= state->batch_size)
+    rbFlushRows(state);
+}
+
+static void rbFlushRows(HolycornModifyState *state) {
+  mrb_state *mrb = state->mrb_state;
+
+  if (RARRAY_LEN(state->buffer) == 0)
+    return;
+
+  mrb_funcall(mrb, state->wrapper, state->method, 1, state->buffer);
+  holycorn_check_exception(mrb, psprintf("calling #%s", state->method));
+  holycorn_result_cache_invalidate(state->relid);
+
+  mrb_gc_unregister(mrb, state->buffer);
+  state->buffer = mrb_ary_new_capa(mrb, state->batch_size);
+  mrb_gc_register(mrb, state->buffer);
+  mrb_gc_arena_restore(mrb, state->arena_idx);
+}
+
+/*
+ * Rows are buffered and written by batches: they are only seen by the wrapper
+ * once batch_size rows are buffered, or at the end of the statement.
+ */
+static TupleTableSlot *rbExecForeignInsert(EState *estate, ResultRelInfo *rinfo, TupleTableSlot *slot,
+    TupleTableSlot *planSlot) {
+  HolycornModifyState *state = (HolycornModifyState *) rinfo->ri_FdwState;
+
+  rbBufferRow(state, rbNewRow(state, slot));
+
+  return slot;
+}
+
+/* update_batch gets [old_row, new_row] pairs */
+static TupleTableSlot *rbExecForeignUpdate(EState *estate, ResultRelInfo *rinfo, TupleTableSlot *slot,
+    TupleTableSlot *planSlot) {
+  HolycornModifyState *state = (HolycornModifyState *) rinfo->ri_FdwState;
+  mrb_value rows[2];
+
+  rows[0] = rbOldRow(state, planSlot);
+  rows[1] = rbNewRow(state, slot);
+  rbBufferRow(state, mrb_ary_new_from_values(state->mrb_state, 2, rows));
+
+  return slot;
+}
+
+/* The deleted row is returned as it was scanned, for RETURNING */
+static TupleTableSlot *rbExecForeignDelete(EState *estate, ResultRelInfo *rinfo, TupleTableSlot *slot,
+    TupleTableSlot *planSlot) {
+  HolycornModifyState *state = (HolycornModifyState *) rinfo->ri_FdwState;
+  int natts = state->tupdesc->natts;
+
+  rbBufferRow(state, rbOldRow(state, planSlot));
+
+  ExecClearTuple(slot);
+  memcpy(slot->tts_values, state->old_values, sizeof(Datum) * natts);
+  memcpy(slot->tts_isnull, state->old_isnull, sizeof(bool) * natts);
+  ExecStoreVirtualTuple(slot);
+
+  return slot;
+}
+
+static void rbEndForeignModify(EState *estate, ResultRelInfo *rinfo) {
+  HolycornModifyState *state = (HolycornModifyState *) rinfo->ri_FdwState;
+
+  if (state == NULL)
+    return;
+
+  rbFlushRows(state);
+
+  /* Work the wrapper defers to the end of the statement */
+  if (mrb_respond_to(state->mrb_state, state->wrapper, mrb_intern_lit(state->mrb_state, "finish_writes"))) {
+    mrb_funcall(state->mrb_state, state->wrapper, "finish_writes", 0);
+    holycorn_check_exception(state->mrb_state, "calling #finish_writes");
+    holycorn_result_cache_invalidate(state->relid);
+  }
+
+  mrb_gc_unregister(state->mrb_state, state->buffer);
+  holycorn_vm_release(state->vm);
+}
+
+#if (PG_VERSION_NUM >= 110000)
+/* COPY FROM and rows routed to a foreign partition */
+static void rbBeginForeignInsert(ModifyTableState *mtstate, ResultRelInfo *rinfo) {
+  rinfo->ri_FdwState = rbBeginModify(rinfo, CMD_INSERT, NULL);
+}
+
+static void rbEndForeignInsert(EState *estate, ResultRelInfo *rinfo) {
+  rbEndForeignModify(estate, rinfo);
+}
+#endif
+
+#if (PG_VERSION_NUM >= 140000)
+static TupleTableSlot **rbExecForeignBatchInsert(EState *estate, ResultRelInfo *rinfo, TupleTableSlot **slots,
+    TupleTableSlot **planSlots, int *numSlots) {
+  HolycornModifyState *state = (HolycornModifyState *) rinfo->ri_FdwState;
+
+  for (int i = 0; i < *numSlots; i++)
+    rbBufferRow(state, rbNewRow(state, slots[i]));
+
+  return slots;
+}
+
+/* Like postgres_fdw, rows that must be returned or seen by triggers aren't batched */
+static int rbGetForeignModifyBatchSize(ResultRelInfo *rinfo) {
+  HolycornModifyState *state = (HolycornModifyState *) rinfo->ri_FdwState;
+
+  if (state == NULL || rinfo->ri_projectReturning != NULL)
+    return 1;
+
+  if (rinfo->ri_TrigDesc &&
+      (rinfo->ri_TrigDesc->trig_insert_before_row || rinfo->ri_TrigDesc->trig_insert_after_row))
+    return 1;
+
+  return state->batch_size;
+}
+#endif
+
+#if (PG_VERSION_NUM >= 90600)
+/* Wrappers are only run by parallel workers when the table says they can */
+static bool rbIsForeignScanParallelSafe(PlannerInfo *root, RelOptInfo *rel, RangeTblEntry *rte) {
+  HolycornPlanState state;
+  List *other_options;
+
+  rbGetOptions(rte->relid, &state, &other_options);
+
+  return state.parallel_safe;
+}
+
+static Size rbEstimateDSMForeignScan(ForeignScanState *node, ParallelContext *pcxt) {
+  return sizeof(HolycornParallelState);
+}
+
+static void rbInitializeDSMForeignScan(ForeignScanState *node, ParallelContext *pcxt, void *coordinate) {
+  HolycornExecutionState *exec_state = (HolycornExecutionState *) node->fdw_state;
+  HolycornParallelState *pstate = (HolycornParallelState *) coordinate;
+
+  pg_atomic_init_u32(&pstate->next_partition, 0);
+  pstate->npartitions = exec_state->npartitions;
+
+  exec_state->pstate = pstate;
+}
+
+#if (PG_VERSION_NUM >= 100000)
+static void rbReInitializeDSMForeignScan(ForeignScanState *node, ParallelContext *pcxt, void *coordinate) {
+  HolycornParallelState *pstate = (HolycornParallelState *) coordinate;
+
+  pg_atomic_write_u32(&pstate->next_partition, 0);
+}
+#endif
+
+/*
+ * Workers compute the partitions on their own, so .partitions has to return
+ * the same units in every process: only their count can be checked.
+ */
+static void rbInitializeWorkerForeignScan(ForeignScanState *node, shm_toc *toc, void *coordinate) {
+  HolycornExecutionState *exec_state = (HolycornExecutionState *) node->fdw_state;
+  HolycornParallelState *pstate = (HolycornParallelState *) coordinate;
+
+  if (pstate->npartitions != exec_state->npartitions)
+    ereport(ERROR,
+        (errcode(ERRCODE_FDW_ERROR),
+         errmsg("[holycorn] .partitions returned %d partitions in a parallel worker, but %d in the leader",
+           exec_state->npartitions, pstate->npartitions)));
+
+  exec_state->pstate = pstate;
+}
+#endif
+
+static void estimate_costs(PlannerInfo *root, RelOptInfo *baserel, HolycornPlanState *fdw_private, Cost *startup_cost, Cost *total_cost)
+{
+  Cost    cpu_per_tuple;
+
+  *startup_cost = fdw_private->startup_cost + baserel->baserestrictcost.startup;
+
+  cpu_per_tuple = cpu_tuple_cost + fdw_private->per_row_cost + baserel->baserestrictcost.per_tuple;
+  *total_cost = *startup_cost + cpu_per_tuple * fdw_private->ntuples;
+}
+
+#if (PG_VERSION_NUM >= 90500)
+static List *rbImportForeignSchema(ImportForeignSchemaStmt *stmt, Oid serverOid)
+{
+  char * wrapper_path = NULL;
+  char * wrapper_class = NULL;
+
+  List     *commands = NIL;
+  char     **options;
+  StringInfoData cft_stmt;
+  if (strcmp(stmt->remote_schema, "holycorn_schema") != 0) {
+    ereport(ERROR,
+        (errcode(ERRCODE_FDW_SCHEMA_NOT_FOUND),
+         errmsg("Foreign schema \"%s\" is invalid.  Use `holycorn_schema` instead.", stmt->remote_schema)
+        ));
+  }
+
+  List *other_options = NIL;
+  ListCell *lc;
+  foreach(lc, stmt->options) {
+    DefElem    *def = (DefElem *) lfirst(lc);
+
+    if (strcmp(def->defname, "wrapper_path") == 0) {
+      if (wrapper_path)
+        ereport(DEBUG1,
+            (errcode(ERRCODE_SYNTAX_ERROR),
+             errmsg("conflicting or redundant options")));
+      wrapper_path = defGetString(def);
+    }
+    else if (strcmp(def->defname, "wrapper_class") == 0) {
+      if (wrapper_class)
+        ereport(DEBUG1,
+            (errcode(ERRCODE_SYNTAX_ERROR),
+             errmsg("conflicting or redundant options")));
+      wrapper_class = defGetString(def);
+    } else {
+      other_options = lappend(other_options, def);
+    }
+  }
+
+  if ((wrapper_path != NULL) && (wrapper_class != NULL)) {
+    elog(ERROR, "[holycorn import schema] wrapper_path or wrapper_class are required (and not both) for defining a holycorn foreign table");
+  }
+
+  HolycornVM *vm = holycorn_vm_acquire(rbWrapperKey(wrapper_path, wrapper_class, other_options),
+      holycorn_vm_memory_limit);
+  mrb_state *state = vm->mrb;
+
+  mrb_value params = mrb_hash_new(state);
+
+  foreach(lc, other_options) {
+    DefElem    *def = (DefElem *) lfirst(lc);
+    char * key = def->defname;
+    char * val = defGetString(def);
+
+    mrb_hash_set( \
+        state, \
+        params, \
+        mrb_str_new(state, key, strlen(key)), \
+        mrb_str_new(state, val, strlen(val)));
+  }
+
+  mrb_value class = rbLoadWrapper(state, wrapper_path, wrapper_class);
+
+  mrb_hash_set(state, params, mrb_str_new_lit(state, "local_schema"),
+      mrb_str_new(state, stmt->local_schema, strlen(stmt->local_schema)));
+  mrb_hash_set(state, params, mrb_str_new_lit(state, "server_name"),
+      mrb_str_new(state, quote_identifier(stmt->server_name), strlen(quote_identifier(stmt->server_name))));
+
+  mrb_value res = mrb_funcall(state, class, "import_schema", 1, params);
 
   initStringInfo(&cft_stmt);
   appendStringInfo(&cft_stmt, "%s", RSTRING_PTR(res));
   commands = lappend(commands, pstrdup(cft_stmt.data));
   pfree(cft_stmt.data);
+
+  holycorn_vm_release(vm);
   return commands;
 }
 #endif
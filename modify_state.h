@@ -0,0 +1,18 @@
+typedef struct HolycornModifyState
+{
+  HolycornVM *vm;
+  mrb_state * mrb_state;
+  mrb_value wrapper;
+  Oid relid;                 /* whose result cache entries writes invalidate */
+  CmdType operation;
+  const char *method;        /* insert_batch, update_batch or delete_batch */
+  TupleDesc tupdesc;
+  AttrNumber rowid_attno;    /* junk whole-row attribute holding the old row */
+  Datum *old_values;
+  bool *old_isnull;
+  int arena_idx;
+
+  /* Rows waiting to be written, handed over once batch_size are buffered */
+  int batch_size;
+  mrb_value buffer;
+} HolycornModifyState;
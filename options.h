@@ -7,5 +7,11 @@ struct HolycornOption {
 static const struct HolycornOption valid_options[] = {
   {"wrapper_path",  ForeignTableRelationId, false},
   {"wrapper_class", ForeignTableRelationId, false},
+  {"batch_size",    ForeignTableRelationId, false},
+  {"parallel_safe", ForeignTableRelationId, false},
+  {"memory_limit",  ForeignTableRelationId, false},
+  {"cache_rescans", ForeignTableRelationId, false},
+  {"cache_ttl",     ForeignTableRelationId, false},
+  {"execution",     ForeignTableRelationId, false},
   {NULL,     InvalidOid, false}
 };
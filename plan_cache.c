@@ -0,0 +1,177 @@
+#include "postgres.h"
+
+#include <limits.h>
+
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#elif PG_VERSION_NUM >= 120000
+#include "utils/hashutils.h"
+#else
+#include "access/hash.h"
+#endif
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "plan_cache.h"
+
+int holycorn_estimate_cache_ttl = 60;
+int holycorn_estimate_cache_size = 256;
+
+/*
+ * Backend-local, keyed by the hash of the wrapper identity and its quals. The
+ * full key is kept to tell collisions apart, in which case the entry is
+ * simply replaced. Past holycorn.estimate_cache_size entries, the least
+ * recently used ones are evicted.
+ */
+static HTAB *plan_cache = NULL;
+static dlist_head plan_cache_lru = DLIST_STATIC_INIT(plan_cache_lru);
+static long plan_cache_entries = 0;
+
+static void plan_cache_free(HolycornPlanInfo *entry);
+static void plan_cache_remove(HolycornPlanInfo *entry);
+
+void holycorn_plan_cache_init(void) {
+  DefineCustomIntVariable("holycorn.estimate_cache_ttl",
+      "How long the results of .estimate and .handled_quals are reused.",
+      "Set to 0 to call them every time a query is planned.",
+      &holycorn_estimate_cache_ttl,
+      60, 0, INT_MAX,
+      PGC_USERSET, GUC_UNIT_S,
+      NULL, NULL, NULL);
+
+  DefineCustomIntVariable("holycorn.estimate_cache_size",
+      "Maximum number of planner callback results cached by each backend.",
+      "Set to 0 to call them every time a query is planned.",
+      &holycorn_estimate_cache_size,
+      256, 0, INT_MAX,
+      PGC_USERSET, 0,
+      NULL, NULL, NULL);
+}
+
+static uint32 plan_cache_hash(const char *key) {
+  return DatumGetUInt32(hash_any((const unsigned char *) key, strlen(key)));
+}
+
+/* Frees what an entry allocated in TopMemoryContext */
+static void plan_cache_free(HolycornPlanInfo *entry) {
+  pfree(entry->key);
+  if (entry->handled)
+    pfree(entry->handled);
+  for (int i = 0; i < entry->nindexed; i++)
+    pfree(entry->indexed[i]);
+  if (entry->indexed)
+    pfree(entry->indexed);
+  if (entry->norderings > 0) {
+    for (int i = 0; i < entry->ordering_ends[entry->norderings - 1]; i++)
+      pfree(entry->sort_keys[i].column);
+    pfree(entry->sort_keys);
+    pfree(entry->ordering_ends);
+  }
+}
+
+static void plan_cache_remove(HolycornPlanInfo *entry) {
+  uint32 hash = entry->hash;
+
+  dlist_delete(&entry->lru);
+  plan_cache_free(entry);
+  hash_search(plan_cache, &hash, HASH_REMOVE, NULL);
+  plan_cache_entries--;
+}
+
+/*
+ * Copies a valid (not expired) cache entry for key into info, if there's one.
+ * Expired entries are dropped.
+ */
+bool holycorn_plan_cache_lookup(const char *key, HolycornPlanInfo *info) {
+  HolycornPlanInfo *entry;
+  uint32 hash;
+
+  if (plan_cache == NULL || holycorn_estimate_cache_ttl == 0 || holycorn_estimate_cache_size == 0)
+    return false;
+
+  hash = plan_cache_hash(key);
+  entry = (HolycornPlanInfo *) hash_search(plan_cache, &hash, HASH_FIND, NULL);
+
+  if (entry == NULL || strcmp(entry->key, key) != 0)
+    return false;
+
+  if (TimestampDifferenceExceeds(entry->computed_at, GetCurrentTimestamp(),
+        holycorn_estimate_cache_ttl * 1000)) {
+    plan_cache_remove(entry);
+    return false;
+  }
+
+  dlist_move_head(&plan_cache_lru, &entry->lru);
+
+  *info = *entry;
+  return true;
+}
+
+void holycorn_plan_cache_store(const char *key, HolycornPlanInfo *info) {
+  HolycornPlanInfo *entry;
+  uint32 hash;
+  bool found;
+
+  if (holycorn_estimate_cache_ttl == 0 || holycorn_estimate_cache_size == 0)
+    return;
+
+  if (plan_cache == NULL) {
+    HASHCTL ctl;
+
+    MemSet(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(uint32);
+    ctl.entrysize = sizeof(HolycornPlanInfo);
+#if PG_VERSION_NUM >= 90500
+    plan_cache = hash_create("holycorn plan cache", 64, &ctl, HASH_ELEM | HASH_BLOBS);
+#else
+    ctl.hash = tag_hash;
+    plan_cache = hash_create("holycorn plan cache", 64, &ctl, HASH_ELEM | HASH_FUNCTION);
+#endif
+  }
+
+  hash = plan_cache_hash(key);
+  entry = (HolycornPlanInfo *) hash_search(plan_cache, &hash, HASH_FIND, NULL);
+  if (entry != NULL)
+    plan_cache_remove(entry);
+
+  /* The size may also have been lowered since the entries were stored */
+  while (plan_cache_entries >= holycorn_estimate_cache_size)
+    plan_cache_remove(dlist_container(HolycornPlanInfo, lru, dlist_tail_node(&plan_cache_lru)));
+
+  entry = (HolycornPlanInfo *) hash_search(plan_cache, &hash, HASH_ENTER, &found);
+  plan_cache_entries++;
+
+  *entry = *info;
+  entry->hash = hash;
+  dlist_push_head(&plan_cache_lru, &entry->lru);
+  entry->key = MemoryContextStrdup(TopMemoryContext, key);
+  entry->computed_at = GetCurrentTimestamp();
+  entry->handled = NULL;
+  entry->indexed = NULL;
+  entry->ordering_ends = NULL;
+  entry->sort_keys = NULL;
+
+  if (info->nhandled > 0) {
+    entry->handled = (int *) MemoryContextAlloc(TopMemoryContext, sizeof(int) * info->nhandled);
+    memcpy(entry->handled, info->handled, sizeof(int) * info->nhandled);
+  }
+
+  if (info->nindexed > 0) {
+    entry->indexed = (char **) MemoryContextAlloc(TopMemoryContext, sizeof(char *) * info->nindexed);
+    for (int i = 0; i < info->nindexed; i++)
+      entry->indexed[i] = MemoryContextStrdup(TopMemoryContext, info->indexed[i]);
+  }
+
+  if (info->norderings > 0) {
+    int nkeys = info->ordering_ends[info->norderings - 1];
+
+    entry->ordering_ends = (int *) MemoryContextAlloc(TopMemoryContext, sizeof(int) * info->norderings);
+    memcpy(entry->ordering_ends, info->ordering_ends, sizeof(int) * info->norderings);
+
+    entry->sort_keys = (HolycornSortKey *) MemoryContextAlloc(TopMemoryContext, sizeof(HolycornSortKey) * nkeys);
+    for (int i = 0; i < nkeys; i++) {
+      entry->sort_keys[i].column = MemoryContextStrdup(TopMemoryContext, info->sort_keys[i].column);
+      entry->sort_keys[i].descending = info->sort_keys[i].descending;
+    }
+  }
+}
@@ -0,0 +1,51 @@
+#ifndef HOLYCORN_PLAN_CACHE_H
+#define HOLYCORN_PLAN_CACHE_H
+
+#include "lib/ilist.h"
+#include "nodes/nodes.h"
+#include "utils/timestamp.h"
+
+/* A column of an ordering wrappers produce natively */
+typedef struct HolycornSortKey {
+  char        *column;
+  bool        descending;
+} HolycornSortKey;
+
+/*
+ * What planning learns from a wrapper class through its .handled_quals,
+ * .estimate, .indexed_columns and .orderings callbacks, for a given wrapper
+ * and set of quals.
+ */
+typedef struct HolycornPlanInfo {
+  uint32      hash;          /* hash table key */
+  char        *key;
+  TimestampTz computed_at;
+  dlist_node  lru;           /* most recently used entries first */
+
+  int         nhandled;
+  int         *handled;      /* indexes of the quals the wrapper evaluates itself */
+
+  bool        estimated;     /* false when the wrapper has no .estimate */
+  double      rows;
+  int         width;
+  Cost        startup_cost;
+  Cost        per_row_cost;
+
+  bool        partitioned;   /* the wrapper implements .partitions */
+
+  int         nindexed;
+  char        **indexed;     /* columns the wrapper can look rows up by */
+
+  int         norderings;
+  int         *ordering_ends;   /* index in sort_keys past the last key of each ordering */
+  HolycornSortKey *sort_keys;   /* keys of all the orderings, one after the other */
+} HolycornPlanInfo;
+
+extern int holycorn_estimate_cache_ttl;
+extern int holycorn_estimate_cache_size;
+
+void holycorn_plan_cache_init(void);
+bool holycorn_plan_cache_lookup(const char *key, HolycornPlanInfo *info);
+void holycorn_plan_cache_store(const char *key, HolycornPlanInfo *info);
+
+#endif
@@ -1,7 +1,50 @@
+#define DEFAULT_BATCH_SIZE 100
+
+/* Estimates of wrappers without .estimate; arbitrary choice to make them expensive */
+#define DEFAULT_ROWS 1000
+#define DEFAULT_PER_ROW_COST (cpu_tuple_cost * 100)
+
 typedef struct HolycornPlanState {
   char     *wrapper_path;
   char     *wrapper_class;
   List     *options;
-  BlockNumber pages;
-  double      ntuples;
+  int      batch_size;
+  int      memory_limit;    /* kB, 0 for none */
+  bool     parallel_safe;
+  bool     cache_rescans;
+  int      cache_ttl;       /* seconds in the shared result cache, 0 for none */
+  bool     worker;          /* run the wrapper in a background worker */
+  bool     partitioned;     /* the wrapper class implements .partitions */
+  Bitmapset *indexed_columns; /* attnums of the columns it looks rows up by */
+  List     *orderings;      /* orders it produces rows in, as HolycornScanOrder */
+  double   ntuples;
+  Cost     startup_cost;
+  Cost     per_row_cost;
+
+  /* Restriction clauses handed to the wrapper, as HolycornQual */
+  List     *quals;
+  List     *qual_clauses;     /* RestrictInfo each HolycornQual comes from */
+  List     *handled_clauses;  /* RestrictInfo the wrapper fully evaluates itself */
 } HolycornPlanState;
+
+/*
+ * ForeignScan's fdw_private has to be copyable by copyObject(), so the plan
+ * state is flattened into a List. Qual values are expressions, which go into
+ * fdw_exprs so setrefs can process them; each qual records the index of its
+ * value there (-1 when it has none).
+ */
+enum HolycornScanPrivateIndex {
+  HolycornScanWrapperPath,   /* String, "" when unset */
+  HolycornScanWrapperClass,  /* String, "" when unset */
+  HolycornScanOptions,       /* List of DefElem */
+  HolycornScanBatchSize,     /* Integer */
+  HolycornScanQuals,         /* List of (column, operator, value index) Lists */
+  HolycornScanColumns,       /* List of Integer, attnums of the columns used */
+  HolycornScanMemoryLimit,   /* Integer, kB */
+  HolycornScanCacheRescans,  /* Integer, 0 or 1 */
+  HolycornScanCacheTtl,      /* Integer, seconds */
+  HolycornScanWorker,        /* Integer, 0 or 1 */
+  HolycornScanOrder,         /* List of Integer, attnums negated when descending */
+  HolycornScanLimit,         /* Integer, -1 for none */
+  HolycornScanOffset         /* Integer */
+};
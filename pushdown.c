@@ -0,0 +1,143 @@
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/clauses.h"
+#if PG_VERSION_NUM >= 120000
+#include "optimizer/optimizer.h"
+#else
+#include "optimizer/var.h"
+#endif
+#include "parser/parsetree.h"
+#include "utils/lsyscache.h"
+#include "pushdown.h"
+
+static bool is_relation_column(RelOptInfo *baserel, Node *node) {
+  Var *var;
+
+  if (node == NULL || !IsA(node, Var))
+    return false;
+
+  var = (Var *) node;
+
+  return var->varno == baserel->relid && var->varlevelsup == 0 && var->varattno > 0;
+}
+
+/*
+ * Values must be computable before the scan starts: they can't reference the
+ * scanned relation, and must give the same result for every row.
+ */
+static bool is_scan_value(PlannerInfo *root, RelOptInfo *baserel, Node *node) {
+  Relids relids;
+
+#if PG_VERSION_NUM >= 140000
+  relids = pull_varnos(root, node);
+#else
+  relids = pull_varnos(node);
+#endif
+
+  return !bms_is_member(baserel->relid, relids) && !contain_volatile_functions(node);
+}
+
+static char *column_name(PlannerInfo *root, RelOptInfo *baserel, Var *var) {
+  RangeTblEntry *rte = planner_rt_fetch(baserel->relid, root);
+
+#if PG_VERSION_NUM >= 110000
+  return get_attname(rte->relid, var->varattno, false);
+#else
+  return get_attname(rte->relid, var->varattno);
+#endif
+}
+
+/* Wrappers see LIKE operators by name rather than as ~~ */
+static char *operator_name(Oid opno) {
+  char *name = get_opname(opno);
+
+  if (name == NULL)
+    return NULL;
+
+  if (strcmp(name, "~~") == 0)
+    return "like";
+  if (strcmp(name, "!~~") == 0)
+    return "not like";
+  if (strcmp(name, "~~*") == 0)
+    return "ilike";
+  if (strcmp(name, "!~~*") == 0)
+    return "not ilike";
+
+  return name;
+}
+
+/*
+ * Recognizes the clauses handed to wrappers:
+ *
+ *   column op value, value op column (commuted), column = ANY(array) as "in",
+ *   column <> ALL(array) as "not in", column IS [NOT] NULL
+ *
+ * Returns false for anything else, which is only evaluated locally.
+ */
+bool holycorn_deparse_qual(PlannerInfo *root, RelOptInfo *baserel, Expr *clause, HolycornQual *qual) {
+  if (IsA(clause, OpExpr)) {
+    OpExpr *op = (OpExpr *) clause;
+    Node *left, *right;
+    Oid opno = op->opno;
+
+    if (list_length(op->args) != 2)
+      return false;
+
+    left = linitial(op->args);
+    right = lsecond(op->args);
+
+    if (!is_relation_column(baserel, left)) {
+      Node *tmp = left;
+
+      if (!is_relation_column(baserel, right) || (opno = get_commutator(opno)) == InvalidOid)
+        return false;
+
+      left = right;
+      right = tmp;
+    }
+
+    if (!is_scan_value(root, baserel, right) || (qual->operator = operator_name(opno)) == NULL)
+      return false;
+
+    qual->column = column_name(root, baserel, (Var *) left);
+    qual->value = (Expr *) right;
+    return true;
+  }
+
+  if (IsA(clause, ScalarArrayOpExpr)) {
+    ScalarArrayOpExpr *op = (ScalarArrayOpExpr *) clause;
+    Node *left = linitial(op->args);
+    Node *right = lsecond(op->args);
+    char *name = get_opname(op->opno);
+
+    if (!is_relation_column(baserel, left) || !is_scan_value(root, baserel, right) || name == NULL)
+      return false;
+
+    if (op->useOr && strcmp(name, "=") == 0)
+      qual->operator = "in";
+    else if (!op->useOr && strcmp(name, "<>") == 0)
+      qual->operator = "not in";
+    else
+      return false;
+
+    qual->column = column_name(root, baserel, (Var *) left);
+    qual->value = (Expr *) right;
+    return true;
+  }
+
+  if (IsA(clause, NullTest)) {
+    NullTest *test = (NullTest *) clause;
+
+    if (!is_relation_column(baserel, (Node *) test->arg) || test->argisrow)
+      return false;
+
+    qual->column = column_name(root, baserel, (Var *) test->arg);
+    qual->operator = test->nulltesttype == IS_NULL ? "is null" : "is not null";
+    qual->value = NULL;
+    return true;
+  }
+
+  return false;
+}
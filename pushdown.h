@@ -0,0 +1,22 @@
+#ifndef HOLYCORN_PUSHDOWN_H
+#define HOLYCORN_PUSHDOWN_H
+
+#if PG_VERSION_NUM >= 120000
+#include "nodes/pathnodes.h"
+#else
+#include "nodes/relation.h"
+#endif
+
+/*
+ * A restriction clause as seen by a wrapper: a column, an operator and the
+ * expression giving the value it is compared to (NULL for IS [NOT] NULL).
+ */
+typedef struct HolycornQual {
+  char  *column;
+  char  *operator;
+  Expr  *value;
+} HolycornQual;
+
+bool holycorn_deparse_qual(PlannerInfo *root, RelOptInfo *baserel, Expr *clause, HolycornQual *qual);
+
+#endif
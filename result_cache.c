@@ -0,0 +1,630 @@
+#include "postgres.h"
+
+#include <limits.h>
+
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#elif PG_VERSION_NUM >= 120000
+#include "utils/hashutils.h"
+#else
+#include "access/hash.h"
+#endif
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#if PG_VERSION_NUM >= 100000
+#include "port/atomics.h"
+#include "storage/condition_variable.h"
+#include "utils/dsa.h"
+#endif
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include "result_cache.h"
+
+int holycorn_result_cache_size = 0;
+int holycorn_result_cache_wait = 5000;
+
+#if PG_VERSION_NUM >= 100000
+
+#define RESULT_CACHE_LOADING 0
+#define RESULT_CACHE_READY   1
+
+/* Relations share generations by their OID modulo this */
+#define RESULT_CACHE_GENERATIONS 1024
+
+/*
+ * Entries are found by the hash of their key; the key itself is kept in the
+ * area to tell collisions apart. Rows are stored as consecutive MinimalTuples,
+ * each MAXALIGNed.
+ */
+typedef struct ResultCacheEntry {
+  uint32      hash;
+  int         state;
+  int         loader;      /* pid of the backend running the wrapper */
+  dsa_pointer key;
+  Size        key_len;
+  dsa_pointer rows;
+  Size        size;
+  TimestampTz expires_at;
+  TimestampTz last_used;
+} ResultCacheEntry;
+
+typedef struct ResultCacheShared {
+  LWLock            *lock;     /* protects the entries and the area */
+  int               tranche_id;
+  ConditionVariable published; /* broadcast when a load completes or is abandoned */
+  pg_atomic_uint32  generations[RESULT_CACHE_GENERATIONS]; /* bumped by writes */
+} ResultCacheShared;
+
+#define RESULT_CACHE_AREA(shared) ((char *) (shared) + MAXALIGN(sizeof(ResultCacheShared)))
+
+/* Key loaded by this backend, to abandon it if the loading scan is interrupted */
+typedef struct LoadingKey {
+  char             *key;
+  SubTransactionId subxid;
+} LoadingKey;
+
+static ResultCacheShared *cache_shared = NULL;
+static HTAB *cache_hash = NULL;
+static dsa_area *cache_area = NULL;
+static List *loading_keys = NIL;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static Size cache_area_size(void);
+static int cache_max_entries(void);
+static void cache_shmem_request(void);
+static void cache_shmem_startup(void);
+static bool cache_attach(void);
+static bool cache_entry_matches(ResultCacheEntry *entry, const char *key, Size key_len);
+static dsa_pointer cache_allocate(Size size, ResultCacheEntry *except);
+static bool cache_evict(ResultCacheEntry *except);
+static bool cache_wait(TimestampTz deadline);
+static void cache_remove(ResultCacheEntry *entry);
+static bool cache_forget(const char *key);
+static void cache_abandon_all(void);
+static void cache_xact_callback(XactEvent event, void *arg);
+static void cache_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+    SubTransactionId parentSubid, void *arg);
+static void cache_shmem_exit(int code, Datum arg);
+
+void holycorn_result_cache_init(void) {
+  DefineCustomIntVariable("holycorn.result_cache_size",
+      "Shared memory used to cache the rows of tables with the cache_ttl option.",
+      "Set to 0 to disable the cache. Requires shared_preload_libraries.",
+      &holycorn_result_cache_size,
+      0, 0, INT_MAX / 2,
+      PGC_POSTMASTER, GUC_UNIT_KB,
+      NULL, NULL, NULL);
+
+  DefineCustomIntVariable("holycorn.result_cache_wait",
+      "How long a scan waits for the rows another backend is loading into the cache.",
+      "The scan runs the wrapper itself once it has waited that long. 0 never waits.",
+      &holycorn_result_cache_wait,
+      5000, 0, INT_MAX,
+      PGC_USERSET, GUC_UNIT_MS,
+      NULL, NULL, NULL);
+
+  if (!process_shared_preload_libraries_in_progress || holycorn_result_cache_size == 0)
+    return;
+
+#if PG_VERSION_NUM >= 150000
+  prev_shmem_request_hook = shmem_request_hook;
+  shmem_request_hook = cache_shmem_request;
+#else
+  cache_shmem_request();
+#endif
+
+  prev_shmem_startup_hook = shmem_startup_hook;
+  shmem_startup_hook = cache_shmem_startup;
+}
+
+static Size cache_area_size(void) {
+  return Max((Size) holycorn_result_cache_size * 1024, dsa_minimum_size());
+}
+
+static int cache_max_entries(void) {
+  return Max(64, holycorn_result_cache_size / 16);
+}
+
+static void cache_shmem_request(void) {
+#if PG_VERSION_NUM >= 150000
+  if (prev_shmem_request_hook)
+    prev_shmem_request_hook();
+#endif
+
+  RequestAddinShmemSpace(add_size(MAXALIGN(sizeof(ResultCacheShared)) + cache_area_size(),
+        hash_estimate_size(cache_max_entries(), sizeof(ResultCacheEntry))));
+  RequestNamedLWLockTranche("holycorn result cache", 1);
+}
+
+static void cache_shmem_startup(void) {
+  HASHCTL info;
+  bool found;
+
+  if (prev_shmem_startup_hook)
+    prev_shmem_startup_hook();
+
+  LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+  cache_shared = ShmemInitStruct("holycorn result cache",
+      MAXALIGN(sizeof(ResultCacheShared)) + cache_area_size(), &found);
+
+  if (!found) {
+    dsa_area *area;
+
+    cache_shared->lock = &(GetNamedLWLockTranche("holycorn result cache"))->lock;
+    cache_shared->tranche_id = LWLockNewTrancheId();
+    ConditionVariableInit(&cache_shared->published);
+    for (int i = 0; i < RESULT_CACHE_GENERATIONS; i++)
+      pg_atomic_init_u32(&cache_shared->generations[i], 0);
+
+    /* The area never grows out of its space in the main shared memory */
+    area = dsa_create_in_place(RESULT_CACHE_AREA(cache_shared), cache_area_size(),
+        cache_shared->tranche_id, NULL);
+    dsa_set_size_limit(area, cache_area_size());
+    dsa_pin(area);
+    dsa_detach(area);
+  }
+
+  MemSet(&info, 0, sizeof(info));
+  info.keysize = sizeof(uint32);
+  info.entrysize = sizeof(ResultCacheEntry);
+  cache_hash = ShmemInitHash("holycorn result cache entries",
+      cache_max_entries(), cache_max_entries(),
+      &info, HASH_ELEM | HASH_BLOBS);
+
+  LWLockRelease(AddinShmemInitLock);
+}
+
+static bool cache_attach(void) {
+  MemoryContext oldcontext;
+
+  if (cache_shared == NULL || cache_hash == NULL)
+    return false;
+
+  if (cache_area != NULL)
+    return true;
+
+  oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+  LWLockRegisterTranche(cache_shared->tranche_id, "holycorn_result_cache");
+  cache_area = dsa_attach_in_place(RESULT_CACHE_AREA(cache_shared), NULL);
+  dsa_pin_mapping(cache_area);
+  on_shmem_exit(dsa_on_shmem_exit_release_in_place, PointerGetDatum(RESULT_CACHE_AREA(cache_shared)));
+
+  RegisterXactCallback(cache_xact_callback, NULL);
+  RegisterSubXactCallback(cache_subxact_callback, NULL);
+  before_shmem_exit(cache_shmem_exit, (Datum) 0);
+
+  MemoryContextSwitchTo(oldcontext);
+
+  return true;
+}
+
+bool holycorn_result_cache_enabled(void) {
+  return cache_shared != NULL && cache_hash != NULL;
+}
+
+/* Larger results aren't cached, so one table can't take the whole cache */
+Size holycorn_result_cache_max_entry(void) {
+  return cache_area_size() / 4;
+}
+
+/*
+ * Generation of the rows of relid, part of the keys of its entries. Writes to
+ * the relation bump it, so that scans no longer find the rows cached before:
+ * these are left to expire or be evicted.
+ */
+uint32 holycorn_result_cache_generation(Oid relid) {
+  if (!holycorn_result_cache_enabled())
+    return 0;
+
+  return pg_atomic_read_u32(&cache_shared->generations[relid % RESULT_CACHE_GENERATIONS]);
+}
+
+void holycorn_result_cache_invalidate(Oid relid) {
+  if (holycorn_result_cache_enabled())
+    pg_atomic_fetch_add_u32(&cache_shared->generations[relid % RESULT_CACHE_GENERATIONS], 1);
+}
+
+static bool cache_entry_matches(ResultCacheEntry *entry, const char *key, Size key_len) {
+  return entry->key_len == key_len &&
+    memcmp(dsa_get_address(cache_area, entry->key), key, key_len) == 0;
+}
+
+/* Allocates from the area, evicting the least recently used entries as needed */
+static dsa_pointer cache_allocate(Size size, ResultCacheEntry *except) {
+  for (;;) {
+    dsa_pointer pointer = dsa_allocate_extended(cache_area, Max(size, 1),
+        DSA_ALLOC_HUGE | DSA_ALLOC_NO_OOM);
+
+    if (DsaPointerIsValid(pointer))
+      return pointer;
+
+    if (!cache_evict(except))
+      return InvalidDsaPointer;
+  }
+}
+
+static bool cache_evict(ResultCacheEntry *except) {
+  HASH_SEQ_STATUS hash_seq;
+  ResultCacheEntry *entry;
+  ResultCacheEntry *victim = NULL;
+
+  hash_seq_init(&hash_seq, cache_hash);
+  while ((entry = hash_seq_search(&hash_seq)) != NULL) {
+    if (entry == except || entry->state != RESULT_CACHE_READY)
+      continue;
+
+    if (victim == NULL || entry->last_used < victim->last_used)
+      victim = entry;
+  }
+
+  if (victim == NULL)
+    return false;
+
+  cache_remove(victim);
+  return true;
+}
+
+static void cache_remove(ResultCacheEntry *entry) {
+  if (DsaPointerIsValid(entry->key))
+    dsa_free(cache_area, entry->key);
+  if (DsaPointerIsValid(entry->rows))
+    dsa_free(cache_area, entry->rows);
+
+  hash_search(cache_hash, &entry->hash, HASH_REMOVE, NULL);
+}
+
+/*
+ * Looks key up. Fresh rows are copied into the tuplestore (through slot).
+ * Otherwise the caller becomes the one backend running the wrapper for key,
+ * unless another backend already is, in which case this waits for its rows.
+ *
+ * Backends already running a wrapper for the cache never wait, so they can't
+ * wait for each other. The wait is bounded by holycorn.result_cache_wait: the
+ * loader may be a cursor its client stopped reading, or just slow.
+ */
+HolycornCacheLookup holycorn_result_cache_lookup(const char *key, Tuplestorestate *rows, TupleTableSlot *slot) {
+  Size key_len = strlen(key);
+  TimestampTz deadline = 0;
+  uint32 hash;
+
+  if (!cache_attach())
+    return HOLYCORN_CACHE_BYPASS;
+
+  hash = DatumGetUInt32(hash_any((const unsigned char *) key, key_len));
+
+  for (;;) {
+    TimestampTz now = GetCurrentTimestamp();
+    ResultCacheEntry *entry;
+
+    LWLockAcquire(cache_shared->lock, LW_EXCLUSIVE);
+
+    entry = (ResultCacheEntry *) hash_search(cache_hash, &hash, HASH_FIND, NULL);
+
+    if (entry != NULL && entry->state == RESULT_CACHE_LOADING) {
+      if (loading_keys != NIL || !cache_entry_matches(entry, key, key_len)) {
+        LWLockRelease(cache_shared->lock);
+        ConditionVariableCancelSleep();
+        return HOLYCORN_CACHE_BYPASS;
+      }
+
+      if (deadline == 0)
+        deadline = TimestampTzPlusMilliseconds(now, holycorn_result_cache_wait);
+
+#if PG_VERSION_NUM < 130000
+      /* Before the load can complete, so that its broadcast sets our latch */
+      ConditionVariablePrepareToSleep(&cache_shared->published);
+#endif
+      LWLockRelease(cache_shared->lock);
+
+      if (!cache_wait(deadline)) {
+        ConditionVariableCancelSleep();
+        return HOLYCORN_CACHE_BYPASS;
+      }
+      continue;
+    }
+
+    if (entry != NULL && cache_entry_matches(entry, key, key_len) && now < entry->expires_at) {
+      Size size = entry->size;
+      char *data = palloc(Max(size, 1));
+      Size offset = 0;
+
+      memcpy(data, dsa_get_address(cache_area, entry->rows), size);
+      entry->last_used = now;
+
+      LWLockRelease(cache_shared->lock);
+      ConditionVariableCancelSleep();
+
+      while (offset < size) {
+        MinimalTuple tuple = (MinimalTuple) (data + offset);
+
+        ExecStoreMinimalTuple(tuple, slot, false);
+        tuplestore_puttupleslot(rows, slot);
+        ExecClearTuple(slot);
+        offset += MAXALIGN(tuple->t_len);
+      }
+
+      pfree(data);
+      return HOLYCORN_CACHE_HIT;
+    }
+
+    /* Missing, expired, or another key with the same hash: load it */
+    if (entry != NULL) {
+      if (DsaPointerIsValid(entry->rows))
+        dsa_free(cache_area, entry->rows);
+      dsa_free(cache_area, entry->key);
+    } else {
+      bool found;
+
+      entry = (ResultCacheEntry *) hash_search(cache_hash, &hash, HASH_ENTER_NULL, &found);
+      if (entry == NULL && cache_evict(NULL))
+        entry = (ResultCacheEntry *) hash_search(cache_hash, &hash, HASH_ENTER_NULL, &found);
+    }
+
+    if (entry != NULL) {
+      entry->key = cache_allocate(key_len, entry);
+
+      if (DsaPointerIsValid(entry->key)) {
+        memcpy(dsa_get_address(cache_area, entry->key), key, key_len);
+        entry->key_len = key_len;
+        entry->state = RESULT_CACHE_LOADING;
+        entry->loader = MyProcPid;
+        entry->rows = InvalidDsaPointer;
+        entry->size = 0;
+        entry->expires_at = 0;
+        entry->last_used = now;
+      } else {
+        entry->rows = InvalidDsaPointer;
+        cache_remove(entry);
+        entry = NULL;
+      }
+    }
+
+    LWLockRelease(cache_shared->lock);
+    ConditionVariableCancelSleep();
+
+    if (entry == NULL)
+      return HOLYCORN_CACHE_BYPASS;
+
+    {
+      MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+      LoadingKey *loading = (LoadingKey *) palloc(sizeof(LoadingKey));
+
+      loading->key = pstrdup(key);
+      loading->subxid = GetCurrentSubTransactionId();
+      loading_keys = lappend(loading_keys, loading);
+
+      MemoryContextSwitchTo(oldcontext);
+    }
+
+    return HOLYCORN_CACHE_LOAD;
+  }
+}
+
+/*
+ * Waits for a load to complete or be abandoned, false once deadline has
+ * passed. ConditionVariableSleep() can't be bounded before PostgreSQL 13, so
+ * older versions wait on the latch instead.
+ */
+static bool cache_wait(TimestampTz deadline) {
+  TimestampTz now = GetCurrentTimestamp();
+  long timeout;
+
+  if (now >= deadline)
+    return false;
+
+  timeout = (long) ((deadline - now + 999) / 1000);
+
+#if PG_VERSION_NUM >= 130000
+  ConditionVariableTimedSleep(&cache_shared->published, timeout, PG_WAIT_EXTENSION);
+#else
+  if (WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, timeout, PG_WAIT_EXTENSION)
+      & WL_POSTMASTER_DEATH)
+    proc_exit(1);
+  ResetLatch(MyLatch);
+  CHECK_FOR_INTERRUPTS();
+#endif
+
+  return true;
+}
+
+/* Adds the row stored in slot to the rows being loaded */
+void holycorn_result_cache_append(StringInfo rows, TupleTableSlot *slot) {
+  MinimalTuple tuple = ExecCopySlotMinimalTuple(slot);
+  Size len = MAXALIGN(tuple->t_len);
+
+  enlargeStringInfo(rows, len);
+  memcpy(rows->data + rows->len, tuple, tuple->t_len);
+  memset(rows->data + rows->len + tuple->t_len, 0, len - tuple->t_len);
+  rows->len += len;
+  rows->data[rows->len] = '\0';
+
+  pfree(tuple);
+}
+
+/* Makes the rows loaded for key available to all backends for ttl seconds */
+void holycorn_result_cache_publish(const char *key, StringInfo rows, int ttl) {
+  Size key_len = strlen(key);
+  uint32 hash = DatumGetUInt32(hash_any((const unsigned char *) key, key_len));
+  ResultCacheEntry *entry;
+
+  if (!cache_forget(key))
+    return;
+
+  LWLockAcquire(cache_shared->lock, LW_EXCLUSIVE);
+
+  entry = (ResultCacheEntry *) hash_search(cache_hash, &hash, HASH_FIND, NULL);
+
+  if (entry != NULL && entry->state == RESULT_CACHE_LOADING && entry->loader == MyProcPid) {
+    dsa_pointer pointer = cache_allocate(rows->len, entry);
+
+    if (DsaPointerIsValid(pointer)) {
+      TimestampTz now = GetCurrentTimestamp();
+
+      memcpy(dsa_get_address(cache_area, pointer), rows->data, rows->len);
+      entry->rows = pointer;
+      entry->size = rows->len;
+      entry->state = RESULT_CACHE_READY;
+      entry->expires_at = TimestampTzPlusMilliseconds(now, (int64) ttl * 1000);
+      entry->last_used = now;
+    } else {
+      cache_remove(entry);
+    }
+  }
+
+  LWLockRelease(cache_shared->lock);
+  ConditionVariableBroadcast(&cache_shared->published);
+}
+
+/* Gives up loading key: the next backend looking it up will run the wrapper */
+void holycorn_result_cache_abandon(const char *key) {
+  Size key_len = strlen(key);
+  uint32 hash = DatumGetUInt32(hash_any((const unsigned char *) key, key_len));
+  ResultCacheEntry *entry;
+
+  if (!cache_forget(key))
+    return;
+
+  LWLockAcquire(cache_shared->lock, LW_EXCLUSIVE);
+
+  entry = (ResultCacheEntry *) hash_search(cache_hash, &hash, HASH_FIND, NULL);
+
+  if (entry != NULL && entry->state == RESULT_CACHE_LOADING && entry->loader == MyProcPid)
+    cache_remove(entry);
+
+  LWLockRelease(cache_shared->lock);
+  ConditionVariableBroadcast(&cache_shared->published);
+}
+
+static bool cache_forget(const char *key) {
+  ListCell *cell;
+
+  foreach(cell, loading_keys) {
+    LoadingKey *loading = (LoadingKey *) lfirst(cell);
+
+    if (strcmp(loading->key, key) == 0) {
+      loading_keys = list_delete_ptr(loading_keys, loading);
+      pfree(loading->key);
+      pfree(loading);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void cache_abandon_all(void) {
+  while (loading_keys != NIL) {
+    LoadingKey *loading = (LoadingKey *) linitial(loading_keys);
+
+    holycorn_result_cache_abandon(loading->key);
+  }
+}
+
+/*
+ * Scans that didn't complete never reach rbEndForeignScan: the keys they were
+ * loading are abandoned when their (sub)transaction ends, so waiting backends
+ * don't wait forever.
+ */
+static void cache_xact_callback(XactEvent event, void *arg) {
+  if (event == XACT_EVENT_COMMIT || event == XACT_EVENT_ABORT ||
+      event == XACT_EVENT_PARALLEL_COMMIT || event == XACT_EVENT_PARALLEL_ABORT)
+    cache_abandon_all();
+}
+
+static void cache_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+    SubTransactionId parentSubid, void *arg) {
+  ListCell *cell;
+
+  if (event == SUBXACT_EVENT_COMMIT_SUB) {
+    foreach(cell, loading_keys) {
+      LoadingKey *loading = (LoadingKey *) lfirst(cell);
+
+      if (loading->subxid == mySubid)
+        loading->subxid = parentSubid;
+    }
+  } else if (event == SUBXACT_EVENT_ABORT_SUB) {
+    bool abandoned;
+
+    do {
+      abandoned = false;
+
+      foreach(cell, loading_keys) {
+        LoadingKey *loading = (LoadingKey *) lfirst(cell);
+
+        if (loading->subxid == mySubid) {
+          holycorn_result_cache_abandon(loading->key);
+          abandoned = true;
+          break;
+        }
+      }
+    } while (abandoned);
+  }
+}
+
+static void cache_shmem_exit(int code, Datum arg) {
+  cache_abandon_all();
+}
+
+#else
+
+/* The result cache relies on DSA areas and condition variables (PostgreSQL 10) */
+void holycorn_result_cache_init(void) {
+  DefineCustomIntVariable("holycorn.result_cache_size",
+      "Shared memory used to cache the rows of tables with the cache_ttl option.",
+      "Not supported before PostgreSQL 10.",
+      &holycorn_result_cache_size,
+      0, 0, INT_MAX / 2,
+      PGC_POSTMASTER, GUC_UNIT_KB,
+      NULL, NULL, NULL);
+
+  DefineCustomIntVariable("holycorn.result_cache_wait",
+      "How long a scan waits for the rows another backend is loading into the cache.",
+      "Not supported before PostgreSQL 10.",
+      &holycorn_result_cache_wait,
+      5000, 0, INT_MAX,
+      PGC_USERSET, GUC_UNIT_MS,
+      NULL, NULL, NULL);
+}
+
+bool holycorn_result_cache_enabled(void) {
+  return false;
+}
+
+Size holycorn_result_cache_max_entry(void) {
+  return 0;
+}
+
+uint32 holycorn_result_cache_generation(Oid relid) {
+  return 0;
+}
+
+void holycorn_result_cache_invalidate(Oid relid) {
+}
+
+HolycornCacheLookup holycorn_result_cache_lookup(const char *key, Tuplestorestate *rows, TupleTableSlot *slot) {
+  return HOLYCORN_CACHE_BYPASS;
+}
+
+void holycorn_result_cache_append(StringInfo rows, TupleTableSlot *slot) {
+}
+
+void holycorn_result_cache_publish(const char *key, StringInfo rows, int ttl) {
+}
+
+void holycorn_result_cache_abandon(const char *key) {
+}
+
+#endif
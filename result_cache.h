@@ -0,0 +1,33 @@
+#ifndef HOLYCORN_RESULT_CACHE_H
+#define HOLYCORN_RESULT_CACHE_H
+
+#include "executor/tuptable.h"
+#include "lib/stringinfo.h"
+#include "utils/tuplestore.h"
+
+/*
+ * Rows produced by wrappers, shared by all backends for cache_ttl seconds.
+ * Entries are keyed by the wrapper, its options, the values of its quals and
+ * the columns it provides, and the generation of the table, which writes to
+ * the table bump.
+ */
+typedef enum HolycornCacheLookup {
+  HOLYCORN_CACHE_BYPASS,  /* run the wrapper without caching its rows */
+  HOLYCORN_CACHE_HIT,     /* the rows were copied into the tuplestore */
+  HOLYCORN_CACHE_LOAD     /* run the wrapper, then publish or abandon its rows */
+} HolycornCacheLookup;
+
+extern int holycorn_result_cache_size;
+extern int holycorn_result_cache_wait;
+
+void holycorn_result_cache_init(void);
+bool holycorn_result_cache_enabled(void);
+Size holycorn_result_cache_max_entry(void);
+uint32 holycorn_result_cache_generation(Oid relid);
+void holycorn_result_cache_invalidate(Oid relid);
+HolycornCacheLookup holycorn_result_cache_lookup(const char *key, Tuplestorestate *rows, TupleTableSlot *slot);
+void holycorn_result_cache_append(StringInfo rows, TupleTableSlot *slot);
+void holycorn_result_cache_publish(const char *key, StringInfo rows, int ttl);
+void holycorn_result_cache_abandon(const char *key);
+
+#endif
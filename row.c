@@ -0,0 +1,235 @@
+#include "postgres.h"
+
+#include "mruby.h"
+#include "mruby/array.h"
+#include "mruby/class.h"
+#include "mruby/data.h"
+#include "mruby/string.h"
+#include "mruby/variable.h"
+
+#include "access/htup_details.h"
+#include "datatype/timestamp.h"
+#include "converters.h"
+#include "row.h"
+
+static void row_free(mrb_state *mrb, void *ptr) {
+  mrb_free(mrb, ptr);
+}
+
+static const struct mrb_data_type row_type = {
+  "Holycorn::Row", row_free
+};
+
+/* The Row of value, or NULL for any other value */
+HolycornRow *holycorn_row_get(mrb_state *mrb, mrb_value value) {
+  if (mrb_type(value) != MRB_TT_DATA)
+    return NULL;
+
+  return (HolycornRow *) mrb_data_check_get_ptr(mrb, value, &row_type);
+}
+
+/*
+ * Strings set with #set_text and #set_bytes are kept, by column, in a hidden
+ * instance variable: the Row keeps them alive until the scan copies them.
+ */
+mrb_value holycorn_row_string(mrb_state *mrb, mrb_value row, mrb_int i) {
+  mrb_value strings = mrb_iv_get(mrb, row, mrb_intern_lit(mrb, "strings"));
+
+  return mrb_nil_p(strings) ? strings : mrb_ary_ref(mrb, strings, i);
+}
+
+static void row_keep(mrb_state *mrb, mrb_value self, HolycornRow *row, mrb_int i, mrb_value str) {
+  mrb_sym name = mrb_intern_lit(mrb, "strings");
+  mrb_value strings = mrb_iv_get(mrb, self, name);
+
+  if (mrb_nil_p(strings)) {
+    if (mrb_nil_p(str))
+      return;
+
+    strings = mrb_ary_new_capa(mrb, row->size);
+    mrb_iv_set(mrb, self, name, strings);
+  }
+
+  mrb_ary_set(mrb, strings, i, str);
+}
+
+/* The value at column index i, which the setter is about to replace */
+static HolycornRowValue *row_value(mrb_state *mrb, mrb_value self, mrb_int i) {
+  HolycornRow *row = (HolycornRow *) mrb_data_get_ptr(mrb, self, &row_type);
+
+  if (row == NULL)
+    mrb_raise(mrb, E_RUNTIME_ERROR, "uninitialized Holycorn::Row");
+  if (i < 0 || i >= row->size)
+    mrb_raisef(mrb, E_INDEX_ERROR, "index %S outside of the row (size %S)",
+        mrb_fixnum_value(i), mrb_fixnum_value(row->size));
+
+  if (row->values[i].kind == HOLYCORN_ROW_TEXT || row->values[i].kind == HOLYCORN_ROW_BYTES)
+    row_keep(mrb, self, row, i, mrb_nil_value());
+
+  return &row->values[i];
+}
+
+/* Holycorn::Row.new(size): a row of size NULL values */
+static mrb_value row_initialize(mrb_state *mrb, mrb_value self) {
+  mrb_int size;
+  HolycornRow *row;
+  Size header = MAXALIGN(sizeof(HolycornRow));
+
+  mrb_get_args(mrb, "i", &size);
+
+  if (size < 0 || size > MaxHeapAttributeNumber)
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid row size %S", mrb_fixnum_value(size));
+
+  row = (HolycornRow *) DATA_PTR(self);
+  if (row != NULL)
+    row_free(mrb, row);
+  mrb_data_init(self, NULL, &row_type);
+
+  row = (HolycornRow *) mrb_calloc(mrb, 1, header + sizeof(HolycornRowValue) * size);
+  row->size = size;
+  row->values = (HolycornRowValue *) ((char *) row + header);
+  mrb_data_init(self, row, &row_type);
+
+  return self;
+}
+
+static mrb_value row_size(mrb_state *mrb, mrb_value self) {
+  HolycornRow *row = (HolycornRow *) mrb_data_get_ptr(mrb, self, &row_type);
+
+  return mrb_fixnum_value(row ? row->size : 0);
+}
+
+static mrb_value row_set_null(mrb_state *mrb, mrb_value self) {
+  mrb_int i;
+
+  mrb_get_args(mrb, "i", &i);
+  row_value(mrb, self, i)->kind = HOLYCORN_ROW_NULL;
+
+  return self;
+}
+
+static mrb_value row_set_int(mrb_state *mrb, mrb_value self) {
+  mrb_int i, value;
+  HolycornRowValue *slot;
+
+  mrb_get_args(mrb, "ii", &i, &value);
+  slot = row_value(mrb, self, i);
+  slot->kind = HOLYCORN_ROW_INT;
+  slot->u.i = value;
+
+  return self;
+}
+
+static mrb_value row_set_float(mrb_state *mrb, mrb_value self) {
+  mrb_int i;
+  mrb_float value;
+  HolycornRowValue *slot;
+
+  mrb_get_args(mrb, "if", &i, &value);
+  slot = row_value(mrb, self, i);
+  slot->kind = HOLYCORN_ROW_FLOAT;
+  slot->u.f = value;
+
+  return self;
+}
+
+static mrb_value row_set_bool(mrb_state *mrb, mrb_value self) {
+  mrb_int i;
+  mrb_value value;
+  HolycornRowValue *slot;
+
+  mrb_get_args(mrb, "io", &i, &value);
+  slot = row_value(mrb, self, i);
+  slot->kind = HOLYCORN_ROW_BOOL;
+  slot->u.b = mrb_test(value);
+
+  return self;
+}
+
+/*
+ * #set_text(i, str, start = 0, len = rest) and #set_bytes: the value is the
+ * slice of str, which isn't copied until the scan takes the row. Slices of a
+ * buffer holding several values don't need a String each, but the buffer
+ * must be left unchanged until the batch the row belongs to is returned.
+ */
+static mrb_value row_set_string(mrb_state *mrb, mrb_value self, HolycornRowKind kind) {
+  mrb_int i, start = 0, len = 0;
+  mrb_value str;
+  HolycornRowValue *slot;
+  int argc = mrb_get_args(mrb, "iS|ii", &i, &str, &start, &len);
+
+  if (argc < 4)
+    len = RSTRING_LEN(str) - start;
+  if (start < 0 || len < 0 || start > RSTRING_LEN(str) || len > RSTRING_LEN(str) - start)
+    mrb_raisef(mrb, E_INDEX_ERROR, "slice %S, %S outside of the string (size %S)",
+        mrb_fixnum_value(start), mrb_fixnum_value(len), mrb_fixnum_value(RSTRING_LEN(str)));
+
+  slot = row_value(mrb, self, i);
+  row_keep(mrb, self, (HolycornRow *) DATA_PTR(self), i, str);
+  slot->kind = kind;
+  slot->u.str.start = start;
+  slot->u.str.len = len;
+
+  return self;
+}
+
+static mrb_value row_set_text(mrb_state *mrb, mrb_value self) {
+  return row_set_string(mrb, self, HOLYCORN_ROW_TEXT);
+}
+
+static mrb_value row_set_bytes(mrb_state *mrb, mrb_value self) {
+  return row_set_string(mrb, self, HOLYCORN_ROW_BYTES);
+}
+
+/*
+ * #set_time(i, time) or #set_time(i, seconds, usec = 0), seconds being since
+ * the Unix epoch: microseconds are kept, and no Time is needed. Instants out
+ * of the range of timestamps raise a RangeError.
+ */
+static mrb_value row_set_time(mrb_state *mrb, mrb_value self) {
+  mrb_int i, usec = 0;
+  mrb_value time;
+  HolycornRowValue *slot;
+  int64 usecs;
+  bool valid;
+  int argc = mrb_get_args(mrb, "io|i", &i, &time, &usec);
+
+  if (mrb_fixnum_p(time)) {
+    valid = holycorn_unix_usecs((int64) mrb_fixnum(time), (int64) usec, &usecs);
+  } else if (mrb_float_p(time) && argc < 3) {
+    valid = holycorn_unix_usecs_float(mrb_float(time), &usecs);
+  } else if (argc < 3 && mrb_class_defined(mrb, "Time") &&
+      mrb_obj_is_kind_of(mrb, time, mrb_class_get(mrb, "Time"))) {
+    valid = holycorn_unix_usecs((int64) mrb_int(mrb, mrb_funcall(mrb, time, "to_i", 0)),
+        (int64) mrb_int(mrb, mrb_funcall(mrb, time, "usec", 0)), &usecs);
+  } else {
+    mrb_raise(mrb, E_TYPE_ERROR, "set_time takes a Time, or seconds and microseconds");
+  }
+
+  if (!valid)
+    mrb_raise(mrb, E_RANGE_ERROR, "timestamp out of range");
+
+  slot = row_value(mrb, self, i);
+  slot->kind = HOLYCORN_ROW_TIME;
+  slot->u.usecs = usecs;
+
+  return self;
+}
+
+/* Defines Holycorn::Row in new VMs, before wrappers are loaded */
+void holycorn_row_define(mrb_state *mrb) {
+  struct RClass *holycorn, *row;
+
+  holycorn = mrb_define_module(mrb, "Holycorn");
+  row = mrb_define_class_under(mrb, holycorn, "Row", mrb->object_class);
+  MRB_SET_INSTANCE_TT(row, MRB_TT_DATA);
+  mrb_define_method(mrb, row, "initialize", row_initialize, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, row, "size", row_size, MRB_ARGS_NONE());
+  mrb_define_method(mrb, row, "set_null", row_set_null, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, row, "set_int", row_set_int, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, row, "set_float", row_set_float, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, row, "set_bool", row_set_bool, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, row, "set_text", row_set_text, MRB_ARGS_ARG(2, 2));
+  mrb_define_method(mrb, row, "set_bytes", row_set_bytes, MRB_ARGS_ARG(2, 2));
+  mrb_define_method(mrb, row, "set_time", row_set_time, MRB_ARGS_ARG(2, 1));
+}
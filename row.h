@@ -0,0 +1,45 @@
+#ifndef HOLYCORN_ROW_H
+#define HOLYCORN_ROW_H
+
+#include "mruby.h"
+
+/*
+ * Holycorn::Row, a row wrappers fill through typed setters rather than build
+ * as an Array or a Hash of Ruby values. Values are kept as C scalars, and
+ * strings as slices of the String they were set from, until the scan
+ * converts them into the slot.
+ */
+typedef enum HolycornRowKind {
+  HOLYCORN_ROW_NULL = 0,
+  HOLYCORN_ROW_INT,
+  HOLYCORN_ROW_FLOAT,
+  HOLYCORN_ROW_BOOL,
+  HOLYCORN_ROW_TEXT,
+  HOLYCORN_ROW_BYTES,
+  HOLYCORN_ROW_TIME
+} HolycornRowKind;
+
+typedef struct HolycornRowValue {
+  HolycornRowKind kind;
+  union {
+    mrb_int   i;
+    mrb_float f;
+    mrb_bool  b;
+    int64     usecs;    /* since the Unix epoch */
+    struct {
+      mrb_int start;    /* in the String of the column, see holycorn_row_string() */
+      mrb_int len;
+    } str;
+  } u;
+} HolycornRowValue;
+
+typedef struct HolycornRow {
+  mrb_int          size;
+  HolycornRowValue *values;
+} HolycornRow;
+
+void holycorn_row_define(mrb_state *mrb);
+HolycornRow *holycorn_row_get(mrb_state *mrb, mrb_value value);
+mrb_value holycorn_row_string(mrb_state *mrb, mrb_value row, mrb_int i);
+
+#endif
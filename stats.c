@@ -0,0 +1,293 @@
+#include "postgres.h"
+
+#include <limits.h>
+
+#include "access/htup_details.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/tuplestore.h"
+#include "stats.h"
+
+#define WRAPPER_NAME_LEN 256
+#define STAT_WRAPPERS_COLS 10
+
+bool holycorn_track_timing = false;
+static int holycorn_stat_max_wrappers = 100;
+
+/* Cumulative counters of a wrapper (class or path), in shared memory */
+typedef struct HolycornStatsEntry {
+  char    wrapper[WRAPPER_NAME_LEN];  /* hash key, truncated */
+  slock_t mutex;                      /* protects the counters */
+  int64   scans;
+  int64   rows;
+  int64   batches;
+  double  vm_startup_time;
+  double  constructor_time;
+  double  fetch_time;
+  double  conversion_time;
+  int64   peak_heap;
+  int64   peak_objects;
+} HolycornStatsEntry;
+
+typedef struct HolycornStatsShared {
+  LWLock  *lock;  /* protects the hash table itself */
+} HolycornStatsShared;
+
+/* Only set up when loaded through shared_preload_libraries */
+static HolycornStatsShared *stats_shared = NULL;
+static HTAB *stats_hash = NULL;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+PG_FUNCTION_INFO_V1(holycorn_stat_wrappers);
+PG_FUNCTION_INFO_V1(holycorn_stat_wrappers_reset);
+
+static Size stats_memsize(void);
+static void stats_shmem_request(void);
+static void stats_shmem_startup(void);
+
+void holycorn_stats_init(void) {
+  DefineCustomBoolVariable("holycorn.track_timing",
+      "Measures the time spent in wrappers for holycorn_stat_wrappers.",
+      "EXPLAIN ANALYZE measures it regardless of this setting.",
+      &holycorn_track_timing,
+      false,
+      PGC_SUSET, 0,
+      NULL, NULL, NULL);
+
+  if (!process_shared_preload_libraries_in_progress)
+    return;
+
+  DefineCustomIntVariable("holycorn.stat_max_wrappers",
+      "Maximum number of wrappers tracked by holycorn_stat_wrappers.",
+      NULL,
+      &holycorn_stat_max_wrappers,
+      100, 1, INT_MAX / 2,
+      PGC_POSTMASTER, 0,
+      NULL, NULL, NULL);
+
+#if PG_VERSION_NUM >= 150000
+  prev_shmem_request_hook = shmem_request_hook;
+  shmem_request_hook = stats_shmem_request;
+#else
+  stats_shmem_request();
+#endif
+
+  prev_shmem_startup_hook = shmem_startup_hook;
+  shmem_startup_hook = stats_shmem_startup;
+}
+
+static Size stats_memsize(void) {
+  return add_size(MAXALIGN(sizeof(HolycornStatsShared)),
+      hash_estimate_size(holycorn_stat_max_wrappers, sizeof(HolycornStatsEntry)));
+}
+
+static void stats_shmem_request(void) {
+#if PG_VERSION_NUM >= 150000
+  if (prev_shmem_request_hook)
+    prev_shmem_request_hook();
+#endif
+
+  RequestAddinShmemSpace(stats_memsize());
+#if PG_VERSION_NUM >= 90600
+  RequestNamedLWLockTranche("holycorn", 1);
+#else
+  RequestAddinLWLocks(1);
+#endif
+}
+
+static void stats_shmem_startup(void) {
+  HASHCTL info;
+  bool found;
+
+  if (prev_shmem_startup_hook)
+    prev_shmem_startup_hook();
+
+  LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+  stats_shared = ShmemInitStruct("holycorn stats", sizeof(HolycornStatsShared), &found);
+  if (!found) {
+#if PG_VERSION_NUM >= 90600
+    stats_shared->lock = &(GetNamedLWLockTranche("holycorn"))->lock;
+#else
+    stats_shared->lock = LWLockAssign();
+#endif
+  }
+
+  MemSet(&info, 0, sizeof(info));
+  info.keysize = WRAPPER_NAME_LEN;
+  info.entrysize = sizeof(HolycornStatsEntry);
+  stats_hash = ShmemInitHash("holycorn wrapper stats",
+      holycorn_stat_max_wrappers, holycorn_stat_max_wrappers,
+      &info,
+#if PG_VERSION_NUM >= 140000
+      HASH_ELEM | HASH_STRINGS
+#else
+      HASH_ELEM
+#endif
+      );
+
+  LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Adds the counters of a completed scan to its wrapper's entry. Once
+ * holycorn.stat_max_wrappers wrappers are tracked, new ones are ignored.
+ */
+void holycorn_stats_report(const char *wrapper, HolycornScanStats *stats) {
+  char key[WRAPPER_NAME_LEN];
+  volatile HolycornStatsEntry *entry;
+
+  if (stats_shared == NULL || stats_hash == NULL)
+    return;
+
+  MemSet(key, 0, sizeof(key));
+  strlcpy(key, wrapper, sizeof(key));
+
+  LWLockAcquire(stats_shared->lock, LW_SHARED);
+
+  entry = (HolycornStatsEntry *) hash_search(stats_hash, key, HASH_FIND, NULL);
+
+  if (entry == NULL) {
+    bool found;
+
+    /* Upgrade to an exclusive lock to create the entry */
+    LWLockRelease(stats_shared->lock);
+    LWLockAcquire(stats_shared->lock, LW_EXCLUSIVE);
+
+    entry = (HolycornStatsEntry *) hash_search(stats_hash, key, HASH_ENTER_NULL, &found);
+
+    if (entry == NULL) {
+      LWLockRelease(stats_shared->lock);
+      return;
+    }
+
+    if (!found) {
+      HolycornStatsEntry *created = (HolycornStatsEntry *) entry;
+
+      MemSet(((char *) created) + WRAPPER_NAME_LEN, 0, sizeof(HolycornStatsEntry) - WRAPPER_NAME_LEN);
+      SpinLockInit(&created->mutex);
+    }
+  }
+
+  SpinLockAcquire(&entry->mutex);
+  entry->scans += 1;
+  entry->rows += stats->rows;
+  entry->batches += stats->batches;
+  entry->vm_startup_time += stats->vm_startup_time;
+  entry->constructor_time += stats->constructor_time;
+  entry->fetch_time += stats->fetch_time;
+  entry->conversion_time += stats->conversion_time;
+  if (entry->peak_heap < (int64) stats->peak_heap)
+    entry->peak_heap = (int64) stats->peak_heap;
+  if (entry->peak_objects < stats->peak_objects)
+    entry->peak_objects = stats->peak_objects;
+  SpinLockRelease(&entry->mutex);
+
+  LWLockRelease(stats_shared->lock);
+}
+
+static void stats_check_loaded(void) {
+  if (stats_shared == NULL || stats_hash == NULL)
+    ereport(ERROR,
+        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+         errmsg("[holycorn] holycorn_stat_wrappers requires holycorn to be loaded via shared_preload_libraries")));
+}
+
+Datum holycorn_stat_wrappers(PG_FUNCTION_ARGS) {
+  ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+  TupleDesc tupdesc;
+  Tuplestorestate *tupstore;
+  MemoryContext per_query_ctx;
+  MemoryContext oldcontext;
+  HASH_SEQ_STATUS hash_seq;
+  HolycornStatsEntry *entry;
+
+  stats_check_loaded();
+
+  if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+    ereport(ERROR,
+        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+         errmsg("set-valued function called in context that cannot accept a set")));
+  if (!(rsinfo->allowedModes & SFRM_Materialize))
+    ereport(ERROR,
+        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+         errmsg("materialize mode required, but it is not allowed in this context")));
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    elog(ERROR, "return type must be a row type");
+
+  per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+  oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+  tupdesc = CreateTupleDescCopy(tupdesc);
+  tupstore = tuplestore_begin_heap(true, false, work_mem);
+  rsinfo->returnMode = SFRM_Materialize;
+  rsinfo->setResult = tupstore;
+  rsinfo->setDesc = tupdesc;
+
+  MemoryContextSwitchTo(oldcontext);
+
+  LWLockAcquire(stats_shared->lock, LW_SHARED);
+
+  hash_seq_init(&hash_seq, stats_hash);
+  while ((entry = hash_seq_search(&hash_seq)) != NULL) {
+    Datum values[STAT_WRAPPERS_COLS];
+    bool nulls[STAT_WRAPPERS_COLS];
+    volatile HolycornStatsEntry *e = entry;
+    HolycornStatsEntry copy;
+
+    SpinLockAcquire(&e->mutex);
+    copy = *entry;
+    SpinLockRelease(&e->mutex);
+
+    MemSet(nulls, 0, sizeof(nulls));
+    values[0] = CStringGetTextDatum(copy.wrapper);
+    values[1] = Int64GetDatum(copy.scans);
+    values[2] = Int64GetDatum(copy.rows);
+    values[3] = Int64GetDatum(copy.batches);
+    values[4] = Float8GetDatum(copy.vm_startup_time);
+    values[5] = Float8GetDatum(copy.constructor_time);
+    values[6] = Float8GetDatum(copy.fetch_time);
+    values[7] = Float8GetDatum(copy.conversion_time);
+    values[8] = Int64GetDatum(copy.peak_heap);
+    values[9] = Int64GetDatum(copy.peak_objects);
+
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+  }
+
+  LWLockRelease(stats_shared->lock);
+
+#if PG_VERSION_NUM < 110000
+  tuplestore_donestoring(tupstore);
+#endif
+
+  return (Datum) 0;
+}
+
+Datum holycorn_stat_wrappers_reset(PG_FUNCTION_ARGS) {
+  HASH_SEQ_STATUS hash_seq;
+  HolycornStatsEntry *entry;
+
+  stats_check_loaded();
+
+  LWLockAcquire(stats_shared->lock, LW_EXCLUSIVE);
+
+  hash_seq_init(&hash_seq, stats_hash);
+  while ((entry = hash_seq_search(&hash_seq)) != NULL)
+    hash_search(stats_hash, entry->wrapper, HASH_REMOVE, NULL);
+
+  LWLockRelease(stats_shared->lock);
+
+  PG_RETURN_VOID();
+}
@@ -0,0 +1,47 @@
+#ifndef HOLYCORN_STATS_H
+#define HOLYCORN_STATS_H
+
+#include "portability/instr_time.h"
+
+/*
+ * What a scan spent in its wrapper. Times are in milliseconds and only
+ * measured when timing is enabled, either by EXPLAIN (ANALYZE, TIMING) or by
+ * holycorn.track_timing.
+ */
+typedef struct HolycornScanStats {
+  bool    timing;
+  int64   rows;              /* rows returned by the wrapper */
+  int64   batches;           /* non-empty #each_batch results */
+  double  vm_startup_time;   /* acquiring a VM and loading the wrapper */
+  double  constructor_time;  /* .new (and .partitions) */
+  double  fetch_time;        /* #each, #each_batch and #partition */
+  double  conversion_time;   /* Ruby values to datums */
+  Size    peak_heap;         /* bytes allocated by the VM */
+  int64   peak_objects;      /* live objects in the VM */
+} HolycornScanStats;
+
+extern bool holycorn_track_timing;
+
+void holycorn_stats_init(void);
+void holycorn_stats_report(const char *wrapper, HolycornScanStats *stats);
+
+static inline void holycorn_stats_start(HolycornScanStats *stats, instr_time *start) {
+  if (stats->timing)
+    INSTR_TIME_SET_CURRENT(*start);
+  else
+    INSTR_TIME_SET_ZERO(*start);
+}
+
+/* Adds the time elapsed since holycorn_stats_start() to counter */
+static inline void holycorn_stats_accum(HolycornScanStats *stats, double *counter, instr_time start) {
+  instr_time end;
+
+  if (!stats->timing)
+    return;
+
+  INSTR_TIME_SET_CURRENT(end);
+  INSTR_TIME_SUBTRACT(end, start);
+  *counter += INSTR_TIME_GET_MILLISEC(end);
+}
+
+#endif
@@ -0,0 +1,72 @@
+#include "postgres.h"
+
+#include "mruby.h"
+#include "mruby/class.h"
+#include "mruby/compile.h"
+#include "mruby/variable.h"
+#include "streaming.h"
+#include "vm_pool.h"
+
+/*
+ * Loaded into VMs the first time they run a block-form #each. Fiber.yield
+ * can't suspend a block called by a method written in C (such as some
+ * iterators of gems): the rows are then buffered until #each returns.
+ */
+static const char stream_source[] =
+  "module Holycorn\n"
+  "  class Stream\n"
+  "    def initialize(wrapper, size)\n"
+  "      @size = size\n"
+  "      @rows = []\n"
+  "      @suspend = true\n"
+  "      @fiber = Fiber.new do\n"
+  "        wrapper.each do |r|\n"
+  "          @rows << r\n"
+  "          suspend if @suspend && @rows.size >= @size\n"
+  "        end\n"
+  "        nil\n"
+  "      end\n"
+  "    end\n"
+  "\n"
+  "    def next_batch\n"
+  "      return nil unless @fiber.alive?\n"
+  "      @fiber.resume\n"
+  "      rows = @rows\n"
+  "      @rows = []\n"
+  "      rows.empty? ? nil : rows\n"
+  "    end\n"
+  "\n"
+  "    def suspend\n"
+  "      Fiber.yield\n"
+  "    rescue FiberError\n"
+  "      @suspend = false\n"
+  "    end\n"
+  "  end\n"
+  "end\n";
+
+/* Fibers come with the mruby-fiber gem, which builds may leave out */
+bool holycorn_stream_available(mrb_state *mrb) {
+  return mrb_class_defined(mrb, "Fiber");
+}
+
+/*
+ * A Holycorn::Stream running wrapper.each, whose #next_batch returns the next
+ * batch_size rows (nil at the end). Whatever #each returns is ignored.
+ */
+mrb_value holycorn_stream_new(mrb_state *mrb, mrb_value wrapper, int batch_size) {
+  struct RClass *holycorn;
+  mrb_value stream;
+
+  if (!mrb_class_defined(mrb, "Holycorn") ||
+      !mrb_const_defined(mrb, mrb_obj_value(mrb_module_get(mrb, "Holycorn")), mrb_intern_lit(mrb, "Stream"))) {
+    mrb_load_string(mrb, stream_source);
+    holycorn_check_exception(mrb, "loading Holycorn::Stream");
+  }
+
+  holycorn = mrb_module_get(mrb, "Holycorn");
+  stream = mrb_funcall(mrb, mrb_obj_value(mrb_class_get_under(mrb, holycorn, "Stream")), "new", 2,
+      wrapper, mrb_fixnum_value(batch_size));
+  holycorn_check_exception(mrb, "starting #each");
+
+  return stream;
+}
@@ -0,0 +1,14 @@
+#ifndef HOLYCORN_STREAMING_H
+#define HOLYCORN_STREAMING_H
+
+#include "mruby.h"
+
+/*
+ * Wrappers may produce their rows by calling the block given to #each. A
+ * Holycorn::Stream runs that #each in a Fiber, which buffers the rows and is
+ * suspended once per batch rather than once per row.
+ */
+bool holycorn_stream_available(mrb_state *mrb);
+mrb_value holycorn_stream_new(mrb_state *mrb, mrb_value wrapper, int batch_size);
+
+#endif
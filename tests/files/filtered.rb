@@ -0,0 +1,18 @@
+# A block-form each filtering out every row, returning the collection it iterated over
+class Filtered
+  def self.yields_rows
+    true
+  end
+
+  def initialize(env = {})
+    @records = [[1, false], [2, false]]
+  end
+
+  def each
+    @records.each do |id, visible|
+      yield [id] if visible
+    end
+  end
+
+  self
+end
@@ -0,0 +1,24 @@
+# Rows given as Holycorn::Row objects, next to an Array row
+class Rows
+  def initialize(env = {})
+    @done = false
+  end
+
+  def rewind(env)
+    @done = false
+  end
+
+  def each_batch(n)
+    return nil if @done
+    @done = true
+
+    buffer = 'alphabeta'
+    [
+      Holycorn::Row.new(3).set_int(0, 1).set_text(1, buffer, 0, 5).set_time(2, 1_500_000_000, 123_456),
+      Holycorn::Row.new(3).set_int(0, 2).set_text(1, buffer, 5, 4).set_time(2, Time.at(1_500_000_000, 654_321)),
+      [3, nil, Time.at(1_500_000_000, 5)],
+    ]
+  end
+
+  self
+end
@@ -6,3 +6,63 @@ FROM
   holycorn_tables.holycorn_redis_table
 ORDER BY
   key
+;
+SELECT
+   key
+ , value
+FROM
+  holycorn_tables.holycorn_redis_table
+WHERE
+  key IN ('foo', 'missing')
+ORDER BY
+  key
+;
+SELECT
+   id
+ , name
+ , score
+ , active
+FROM
+  holycorn_tables.holycorn_file_table
+ORDER BY
+  id
+;
+SELECT
+   member
+ , score
+FROM
+  holycorn_tables.holycorn_zset_table
+WHERE
+  key = 'leaderboard'
+ORDER BY
+  score DESC
+LIMIT 2
+;
+SELECT
+  btrim(plan) AS plan
+FROM
+  holycorn_tables.explain($$
+    SELECT member, score FROM holycorn_tables.holycorn_zset_table
+    WHERE key = 'leaderboard' ORDER BY score DESC LIMIT 2
+  $$) AS plan
+WHERE
+  current_setting('server_version_num')::integer >= 120000
+  AND plan ~ '^\s*(->\s+)?(Sort|Limit)\M|Wrapper (Order|Limit):'
+;
+SELECT
+   id
+ , name
+ , to_char(at AT TIME ZONE 'UTC', 'YYYY-MM-DD HH24:MI:SS.US') AS at
+FROM
+  holycorn_tables.holycorn_rows_table
+ORDER BY
+  id
+;
+SELECT
+  count(*) AS filtered
+FROM
+  holycorn_tables.holycorn_filtered_table
+;
+INSERT INTO holycorn_tables.holycorn_redis_table (key, value) VALUES ('qux', '4');
+UPDATE holycorn_tables.holycorn_redis_table SET value = '5' WHERE key = 'qux';
+DELETE FROM holycorn_tables.holycorn_redis_table WHERE key = 'qux' RETURNING key, value
@@ -2,3 +2,47 @@ CREATE EXTENSION holycorn;
 CREATE SCHEMA holycorn_tables;
 CREATE SERVER holycorn_server
   FOREIGN DATA WRAPPER holycorn;
+CREATE FOREIGN TABLE holycorn_tables.holycorn_file_table
+  ( id integer
+  , name text
+  , score float8
+  , active boolean
+  )
+  SERVER holycorn_server
+  OPTIONS ( wrapper_class 'HolycornFile'
+          , path '/holycorn/tests/files/scores.csv'
+          , header 'true'
+          );
+CREATE FOREIGN TABLE holycorn_tables.holycorn_zset_table
+  ( key text
+  , member text
+  , score float8
+  )
+  SERVER holycorn_server
+  OPTIONS ( wrapper_class 'HolycornRedis'
+          , host '127.0.0.1'
+          , port '6379'
+          , db '1'
+          , type 'zset'
+          );
+CREATE FOREIGN TABLE holycorn_tables.holycorn_rows_table
+  ( id integer
+  , name text
+  , at timestamptz
+  )
+  SERVER holycorn_server
+  OPTIONS ( wrapper_path '/holycorn/tests/files/rows.rb' );
+CREATE FOREIGN TABLE holycorn_tables.holycorn_filtered_table
+  ( id integer
+  )
+  SERVER holycorn_server
+  OPTIONS ( wrapper_path '/holycorn/tests/files/filtered.rb' );
+CREATE FUNCTION holycorn_tables.explain(query text) RETURNS SETOF text AS $$
+DECLARE
+  line text;
+BEGIN
+  FOR line IN EXECUTE 'EXPLAIN (COSTS OFF) ' || query LOOP
+    RETURN NEXT line;
+  END LOOP;
+END
+$$ LANGUAGE plpgsql;
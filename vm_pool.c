@@ -0,0 +1,363 @@
+#include "postgres.h"
+
+#include <limits.h>
+#include "mruby.h"
+#include "mruby/string.h"
+
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include "row.h"
+#include "vm_pool.h"
+
+int holycorn_vm_pool_size = 4;
+int holycorn_vm_idle_timeout = 300;
+int holycorn_vm_prewarm = 0;
+int holycorn_vm_memory_limit = 0;
+
+static dlist_head vm_pool = DLIST_STATIC_INIT(vm_pool);
+
+/* Parent of the memory contexts of all VMs */
+static MemoryContext vm_pool_context = NULL;
+
+static HolycornVM *vm_open(void);
+static void *vm_allocf(mrb_state *mrb, void *p, size_t size, void *ud);
+static void vm_evict_idle(void);
+static void vm_abandon(HolycornVM *vm);
+static void vm_xact_callback(XactEvent event, void *arg);
+static void vm_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+    SubTransactionId parentSubid, void *arg);
+
+void holycorn_vm_pool_init(void) {
+  DefineCustomIntVariable("holycorn.vm_pool_size",
+      "Maximum number of idle mruby VMs kept by each backend.",
+      "Set to 0 to open and close a VM for every scan.",
+      &holycorn_vm_pool_size,
+      4, 0, 1024,
+      PGC_USERSET, 0,
+      NULL, NULL, NULL);
+
+  DefineCustomIntVariable("holycorn.vm_idle_timeout",
+      "Idle mruby VMs unused for longer than this are closed.",
+      "Set to 0 to keep idle VMs until the backend exits.",
+      &holycorn_vm_idle_timeout,
+      300, 0, INT_MAX,
+      PGC_USERSET, GUC_UNIT_S,
+      NULL, NULL, NULL);
+
+  DefineCustomIntVariable("holycorn.vm_prewarm",
+      "Number of mruby VMs opened when loaded through shared_preload_libraries.",
+      NULL,
+      &holycorn_vm_prewarm,
+      0, 0, 1024,
+      PGC_POSTMASTER, 0,
+      NULL, NULL, NULL);
+
+  DefineCustomIntVariable("holycorn.vm_memory_limit",
+      "Maximum memory a mruby VM can allocate while running a wrapper.",
+      "Set to 0 for no limit. Can be overridden by the memory_limit table option.",
+      &holycorn_vm_memory_limit,
+      0, 0, INT_MAX,
+      PGC_USERSET, GUC_UNIT_KB,
+      NULL, NULL, NULL);
+
+  vm_pool_context = AllocSetContextCreate(TopMemoryContext, "holycorn VM pool",
+#if PG_VERSION_NUM >= 90600
+      ALLOCSET_SMALL_SIZES);
+#else
+      ALLOCSET_SMALL_MINSIZE, ALLOCSET_SMALL_INITSIZE, ALLOCSET_SMALL_MAXSIZE);
+#endif
+
+  RegisterXactCallback(vm_xact_callback, NULL);
+  RegisterSubXactCallback(vm_subxact_callback, NULL);
+
+  /*
+   * VMs opened in the postmaster are inherited by every backend it forks, so
+   * the first scans of a session don't pay for loading the gems.
+   */
+  if (process_shared_preload_libraries_in_progress) {
+    for (int i = 0; i < holycorn_vm_prewarm; i++) {
+      HolycornVM *vm = vm_open();
+      dlist_push_tail(&vm_pool, &vm->node);
+    }
+  }
+}
+
+static HolycornVM *vm_open(void) {
+  MemoryContext context = AllocSetContextCreate(vm_pool_context, "holycorn VM",
+#if PG_VERSION_NUM >= 90600
+      ALLOCSET_DEFAULT_SIZES);
+#else
+      ALLOCSET_DEFAULT_MINSIZE, ALLOCSET_DEFAULT_INITSIZE, ALLOCSET_DEFAULT_MAXSIZE);
+#endif
+  HolycornVM *vm = (HolycornVM *) MemoryContextAllocZero(context, sizeof(HolycornVM));
+
+  vm->context = context;
+  vm->mrb = mrb_open_allocf(vm_allocf, vm);
+  if (vm->mrb == NULL) {
+    MemoryContextDelete(context);
+    elog(ERROR, "[holycorn] could not open a mruby VM");
+  }
+  holycorn_row_define(vm->mrb);
+  vm->key = NULL;
+  vm->in_use = false;
+  vm->last_used = 0;
+
+  return vm;
+}
+
+/*
+ * The VM's allocator: memory comes from the VM's context, so it shows up in
+ * MemoryContextStats and can't outlive the VM. Each block is prefixed with
+ * its size, to account for the VM's heap and enforce memory_limit.
+ *
+ * Going over the limit raises an error right away rather than letting mruby
+ * raise NoMemoryError, which aborts the process when no Ruby code is running.
+ * The VM is left in an unknown state and is dropped without mrb_close() when
+ * the transaction aborts.
+ */
+#define VM_ALLOC_HEADER MAXALIGN(sizeof(Size))
+
+static void *vm_allocf(mrb_state *mrb, void *p, size_t size, void *ud) {
+  HolycornVM *vm = (HolycornVM *) ud;
+  char *old_block = p ? (char *) p - VM_ALLOC_HEADER : NULL;
+  Size old_size = old_block ? *(Size *) old_block : 0;
+  char *block;
+
+  if (size == 0) {
+    vm->heap_size -= old_size;
+    if (old_block)
+      pfree(old_block);
+    return NULL;
+  }
+
+  if (vm->memory_limit > 0 && size > old_size && vm->heap_size - old_size + size > vm->memory_limit) {
+    vm->broken = true;
+    ereport(ERROR,
+        (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+         errmsg("[holycorn] wrapper exceeded its memory limit of %lu kB",
+           (unsigned long) (vm->memory_limit / 1024)),
+         errhint("Raise the memory_limit option of the table or holycorn.vm_memory_limit.")));
+  }
+
+  /* Out of memory is reported to mruby (as a NULL) like malloc would */
+#if PG_VERSION_NUM >= 90500
+  block = MemoryContextAllocExtended(vm->context, size + VM_ALLOC_HEADER, MCXT_ALLOC_HUGE | MCXT_ALLOC_NO_OOM);
+  if (block == NULL)
+    return NULL;
+#else
+  block = MemoryContextAllocHuge(vm->context, size + VM_ALLOC_HEADER);
+#endif
+
+  if (old_block) {
+    memcpy(block + VM_ALLOC_HEADER, p, Min(size, old_size));
+    pfree(old_block);
+  }
+
+  *(Size *) block = size;
+  vm->heap_size = vm->heap_size - old_size + size;
+  if (vm->heap_size > vm->heap_peak)
+    vm->heap_peak = vm->heap_size;
+
+  return block + VM_ALLOC_HEADER;
+}
+
+/* Close VMs that have been idle for longer than holycorn.vm_idle_timeout */
+static void vm_evict_idle(void) {
+  dlist_mutable_iter iter;
+  TimestampTz now;
+
+  if (holycorn_vm_idle_timeout <= 0)
+    return;
+
+  now = GetCurrentTimestamp();
+
+  dlist_foreach_modify(iter, &vm_pool) {
+    HolycornVM *vm = dlist_container(HolycornVM, node, iter.cur);
+
+    /* Prewarmed VMs have never been used and are kept around */
+    if (vm->in_use || vm->key == NULL)
+      continue;
+
+    if (TimestampDifferenceExceeds(vm->last_used, now, holycorn_vm_idle_timeout * 1000))
+      holycorn_vm_discard(vm);
+  }
+}
+
+/*
+ * Hands out an idle VM for the wrapper identified by key (or a new one). The
+ * VM can then allocate up to memory_limit kB (0 for no limit).
+ */
+HolycornVM *holycorn_vm_acquire(const char *key, int memory_limit) {
+  dlist_iter iter;
+  HolycornVM *vm = NULL;
+  HolycornVM *unbound = NULL;
+
+  vm_evict_idle();
+
+  /* Idle VMs are kept most-recently-used first */
+  dlist_foreach(iter, &vm_pool) {
+    HolycornVM *candidate = dlist_container(HolycornVM, node, iter.cur);
+
+    if (candidate->in_use)
+      continue;
+
+    if (candidate->key == NULL) {
+      if (unbound == NULL)
+        unbound = candidate;
+    } else if (strcmp(candidate->key, key) == 0) {
+      vm = candidate;
+      break;
+    }
+  }
+
+  if (vm == NULL && unbound != NULL) {
+    vm = unbound;
+    vm->key = MemoryContextStrdup(vm->context, key);
+  }
+
+  if (vm == NULL) {
+    vm = vm_open();
+    vm->key = MemoryContextStrdup(vm->context, key);
+    dlist_push_head(&vm_pool, &vm->node);
+  }
+
+  vm->in_use = true;
+  vm->memory_limit = (Size) memory_limit * 1024;
+  vm->subxid = GetCurrentSubTransactionId();
+  vm->arena_idx = mrb_gc_arena_save(vm->mrb);
+
+  return vm;
+}
+
+void holycorn_vm_release(HolycornVM *vm) {
+  dlist_iter iter;
+  int idle = 0;
+
+  /* Drop everything the scan created so the next one starts from a clean VM */
+  vm->mrb->exc = NULL;
+  mrb_gc_arena_restore(vm->mrb, vm->arena_idx);
+  mrb_full_gc(vm->mrb);
+
+  vm->in_use = false;
+  vm->memory_limit = 0;
+  vm->last_used = GetCurrentTimestamp();
+
+  dlist_move_head(&vm_pool, &vm->node);
+
+  dlist_foreach(iter, &vm_pool) {
+    HolycornVM *candidate = dlist_container(HolycornVM, node, iter.cur);
+
+    if (!candidate->in_use)
+      idle++;
+  }
+
+  /* Keep at most holycorn.vm_pool_size idle VMs, closing the least recently used */
+  while (idle > holycorn_vm_pool_size) {
+    dlist_reverse_iter riter;
+    HolycornVM *victim = NULL;
+
+    dlist_reverse_foreach(riter, &vm_pool) {
+      HolycornVM *candidate = dlist_container(HolycornVM, node, riter.cur);
+
+      if (!candidate->in_use) {
+        victim = candidate;
+        break;
+      }
+    }
+
+    holycorn_vm_discard(victim);
+    idle--;
+  }
+}
+
+void holycorn_vm_discard(HolycornVM *vm) {
+  if (vm->broken) {
+    vm_abandon(vm);
+    return;
+  }
+
+  dlist_delete(&vm->node);
+  vm->memory_limit = 0;
+  mrb_close(vm->mrb);
+  MemoryContextDelete(vm->context);
+}
+
+/*
+ * Frees a VM without running mruby's finalizers, for VMs an error interrupted
+ * in the middle of an allocation. Resources held by Ruby objects (such as
+ * sockets) are only reclaimed when the backend exits.
+ */
+static void vm_abandon(HolycornVM *vm) {
+  dlist_delete(&vm->node);
+  MemoryContextDelete(vm->context);
+}
+
+/*
+ * Raises a PostgreSQL error if the last call into the VM left a Ruby exception
+ * behind. The VM is closed at abort time, so its state doesn't matter anymore.
+ */
+void holycorn_check_exception(mrb_state *mrb, const char *context) {
+  mrb_value exception, message;
+
+  if (mrb->exc == NULL)
+    return;
+
+  exception = mrb_obj_value(mrb->exc);
+  mrb->exc = NULL;
+
+  message = mrb_funcall(mrb, exception, "inspect", 0);
+  if (!mrb_string_p(message) || mrb->exc != NULL) {
+    mrb->exc = NULL;
+    message = mrb_str_new_lit(mrb, "(unknown exception)");
+  }
+
+  ereport(ERROR,
+      (errcode(ERRCODE_FDW_ERROR),
+       errmsg("[holycorn] Ruby exception while %s", context),
+       errdetail("%.*s", (int) RSTRING_LEN(message), RSTRING_PTR(message))));
+}
+
+/*
+ * A scan interrupted by an error never reaches rbEndForeignScan: its VM may be
+ * in any state, so it is closed rather than returned to the pool.
+ */
+static void vm_xact_callback(XactEvent event, void *arg) {
+  dlist_mutable_iter iter;
+
+  if (event != XACT_EVENT_ABORT
+#if PG_VERSION_NUM >= 90500
+      && event != XACT_EVENT_PARALLEL_ABORT
+#endif
+     )
+    return;
+
+  dlist_foreach_modify(iter, &vm_pool) {
+    HolycornVM *vm = dlist_container(HolycornVM, node, iter.cur);
+
+    if (vm->in_use)
+      holycorn_vm_discard(vm);
+  }
+}
+
+static void vm_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+    SubTransactionId parentSubid, void *arg) {
+  dlist_mutable_iter iter;
+
+  if (event != SUBXACT_EVENT_ABORT_SUB && event != SUBXACT_EVENT_COMMIT_SUB)
+    return;
+
+  dlist_foreach_modify(iter, &vm_pool) {
+    HolycornVM *vm = dlist_container(HolycornVM, node, iter.cur);
+
+    if (!vm->in_use || vm->subxid != mySubid)
+      continue;
+
+    if (event == SUBXACT_EVENT_ABORT_SUB)
+      holycorn_vm_discard(vm);
+    else
+      vm->subxid = parentSubid;
+  }
+}
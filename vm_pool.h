@@ -0,0 +1,39 @@
+#ifndef HOLYCORN_VM_POOL_H
+#define HOLYCORN_VM_POOL_H
+
+#include "mruby.h"
+#include "lib/ilist.h"
+#include "utils/timestamp.h"
+
+/*
+ * A pooled mruby interpreter. Idle VMs are kept per backend and handed back to
+ * scans of the same wrapper (same class/path and same options), so gems and
+ * wrapper scripts don't have to be loaded again for every query.
+ */
+typedef struct HolycornVM {
+  dlist_node       node;
+  MemoryContext    context;    /* everything allocated by the interpreter */
+  mrb_state        *mrb;
+  char             *key;       /* NULL until bound to a wrapper (prewarmed VMs) */
+  bool             in_use;
+  SubTransactionId subxid;     /* subtransaction that acquired the VM */
+  TimestampTz      last_used;
+  int              arena_idx;  /* GC arena index to restore on release */
+  Size             heap_size;  /* bytes currently allocated by the VM */
+  Size             heap_peak;  /* highest heap_size since the last reset */
+  Size             memory_limit; /* heap_size allowed for the current user, 0 for none */
+  bool             broken;     /* interrupted by an error from its allocator */
+} HolycornVM;
+
+extern int holycorn_vm_pool_size;
+extern int holycorn_vm_idle_timeout;
+extern int holycorn_vm_prewarm;
+extern int holycorn_vm_memory_limit;
+
+void holycorn_vm_pool_init(void);
+HolycornVM *holycorn_vm_acquire(const char *key, int memory_limit);
+void holycorn_vm_release(HolycornVM *vm);
+void holycorn_vm_discard(HolycornVM *vm);
+void holycorn_check_exception(mrb_state *mrb, const char *context);
+
+#endif
@@ -0,0 +1,301 @@
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/proc.h"
+#include "storage/shm_toc.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+#include "utils/snapmgr.h"
+#include "worker.h"
+
+int holycorn_worker_queue_size = 1024;
+
+#if PG_VERSION_NUM >= 100000
+
+#define WORKER_MAGIC      0x486f6c79
+#define WORKER_KEY_SHARED 1
+#define WORKER_KEY_SPEC   2
+#define WORKER_KEY_QUEUE  3
+#define WORKER_KEY_GUC    4
+#define WORKER_ERROR_LEN  1024
+
+/* Start-up parameters and outcome of a worker, in its DSM segment */
+typedef struct HolycornWorkerShared {
+  Oid     database;
+  Oid     authenticated_user;       /* who the worker connects as */
+  Oid     user;                     /* current user of the scan, and its context */
+  int     sec_context;
+  slock_t mutex;                    /* protects what follows */
+  bool    done;                     /* all the rows were sent */
+  bool    failed;
+  char    error[WORKER_ERROR_LEN];  /* message of the error that stopped it */
+} HolycornWorkerShared;
+
+struct HolycornWorker {
+  dsm_segment             *seg;
+  HolycornWorkerShared    *shared;
+  shm_mq_handle           *mqh;
+  BackgroundWorkerHandle  *handle;
+};
+
+void holycorn_worker_init(void) {
+  DefineCustomIntVariable("holycorn.worker_queue_size",
+      "Size of the queue through which a worker streams rows to its scan.",
+      "The wrapper is paused while the queue is full.",
+      &holycorn_worker_queue_size,
+      1024, 64, MaxAllocSize / 1024,
+      PGC_USERSET, GUC_UNIT_KB,
+      NULL, NULL, NULL);
+}
+
+/*
+ * Starts a worker running the wrapper of a scan, spec being what
+ * holycorn_worker_scan() needs to know about it. The worker runs with the
+ * settings and the current user of this session.
+ */
+HolycornWorker *holycorn_worker_launch(const char *spec) {
+  HolycornWorker *worker = (HolycornWorker *) palloc0(sizeof(HolycornWorker));
+  Size queue_size = (Size) holycorn_worker_queue_size * 1024;
+  Size spec_len = strlen(spec) + 1;
+  Size guc_len = EstimateGUCStateSpace();
+  shm_toc_estimator estimator;
+  shm_toc *toc;
+  Size segsize;
+  char *shared_spec;
+  char *gucstate;
+  shm_mq *mq;
+  BackgroundWorker bgw;
+
+  shm_toc_initialize_estimator(&estimator);
+  shm_toc_estimate_chunk(&estimator, sizeof(HolycornWorkerShared));
+  shm_toc_estimate_chunk(&estimator, spec_len);
+  shm_toc_estimate_chunk(&estimator, queue_size);
+  shm_toc_estimate_chunk(&estimator, guc_len);
+  shm_toc_estimate_keys(&estimator, 4);
+  segsize = shm_toc_estimate(&estimator);
+
+  worker->seg = dsm_create(segsize, 0);
+  toc = shm_toc_create(WORKER_MAGIC, dsm_segment_address(worker->seg), segsize);
+
+  worker->shared = (HolycornWorkerShared *) shm_toc_allocate(toc, sizeof(HolycornWorkerShared));
+  worker->shared->database = MyDatabaseId;
+  worker->shared->authenticated_user = GetAuthenticatedUserId();
+  GetUserIdAndSecContext(&worker->shared->user, &worker->shared->sec_context);
+  SpinLockInit(&worker->shared->mutex);
+  worker->shared->done = false;
+  worker->shared->failed = false;
+  worker->shared->error[0] = '\0';
+  shm_toc_insert(toc, WORKER_KEY_SHARED, worker->shared);
+
+  shared_spec = (char *) shm_toc_allocate(toc, spec_len);
+  memcpy(shared_spec, spec, spec_len);
+  shm_toc_insert(toc, WORKER_KEY_SPEC, shared_spec);
+
+  gucstate = (char *) shm_toc_allocate(toc, guc_len);
+  SerializeGUCState(guc_len, gucstate);
+  shm_toc_insert(toc, WORKER_KEY_GUC, gucstate);
+
+  mq = shm_mq_create(shm_toc_allocate(toc, queue_size), queue_size);
+  shm_toc_insert(toc, WORKER_KEY_QUEUE, mq);
+  shm_mq_set_receiver(mq, MyProc);
+  worker->mqh = shm_mq_attach(mq, worker->seg, NULL);
+
+  memset(&bgw, 0, sizeof(bgw));
+  bgw.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+  bgw.bgw_start_time = BgWorkerStart_ConsistentState;
+  bgw.bgw_restart_time = BGW_NEVER_RESTART;
+  snprintf(bgw.bgw_library_name, BGW_MAXLEN, "holycorn");
+  snprintf(bgw.bgw_function_name, BGW_MAXLEN, "holycorn_worker_main");
+  snprintf(bgw.bgw_name, BGW_MAXLEN, "holycorn worker for PID %d", MyProcPid);
+#if PG_VERSION_NUM >= 110000
+  snprintf(bgw.bgw_type, BGW_MAXLEN, "holycorn worker");
+#endif
+  bgw.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(worker->seg));
+  bgw.bgw_notify_pid = MyProcPid;
+
+  if (!RegisterDynamicBackgroundWorker(&bgw, &worker->handle))
+    ereport(ERROR,
+        (errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+         errmsg("[holycorn] could not register a background worker"),
+         errhint("You may need to increase max_worker_processes.")));
+
+  /* Receiving fails rather than waits if the worker dies before attaching */
+  shm_mq_set_handle(worker->mqh, worker->handle);
+
+  return worker;
+}
+
+/*
+ * Next row sent by the worker, valid until the next call. NULL once it sent
+ * them all; errors of the worker are raised here.
+ */
+MinimalTuple holycorn_worker_receive(HolycornWorker *worker) {
+  Size nbytes;
+  void *data;
+  bool done, failed;
+  char error[WORKER_ERROR_LEN];
+
+  if (shm_mq_receive(worker->mqh, &nbytes, &data, false) == SHM_MQ_SUCCESS)
+    return (MinimalTuple) data;
+
+  /* The worker detached from the queue: it's done, or it stopped */
+  SpinLockAcquire(&worker->shared->mutex);
+  done = worker->shared->done;
+  failed = worker->shared->failed;
+  memcpy(error, worker->shared->error, WORKER_ERROR_LEN);
+  SpinLockRelease(&worker->shared->mutex);
+
+  if (failed)
+    ereport(ERROR,
+        (errcode(ERRCODE_FDW_ERROR),
+         errmsg("[holycorn] worker: %s", error)));
+  if (!done)
+    ereport(ERROR,
+        (errcode(ERRCODE_FDW_ERROR),
+         errmsg("[holycorn] worker exited before sending all the rows")));
+
+  return NULL;
+}
+
+void holycorn_worker_stop(HolycornWorker *worker) {
+  shm_mq_detach(worker->mqh);
+  TerminateBackgroundWorker(worker->handle);
+  dsm_detach(worker->seg);
+  pfree(worker);
+}
+
+/* Sends a row to the scan, waiting for room in the queue. False once the scan is gone. */
+bool holycorn_worker_send(shm_mq_handle *mqh, MinimalTuple tuple) {
+#if PG_VERSION_NUM >= 150000
+  return shm_mq_send(mqh, tuple->t_len, tuple, false, false) == SHM_MQ_SUCCESS;
+#else
+  return shm_mq_send(mqh, tuple->t_len, tuple, false) == SHM_MQ_SUCCESS;
+#endif
+}
+
+void holycorn_worker_main(Datum main_arg) {
+  dsm_segment *seg;
+  shm_toc *toc;
+  HolycornWorkerShared *shared;
+  char *spec;
+  char *gucstate;
+  shm_mq *mq;
+  shm_mq_handle *mqh;
+
+  pqsignal(SIGTERM, die);
+  BackgroundWorkerUnblockSignals();
+
+  CurrentResourceOwner = ResourceOwnerCreate(NULL, "holycorn worker");
+
+  seg = dsm_attach(DatumGetUInt32(main_arg));
+  if (seg == NULL)
+    ereport(ERROR,
+        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+         errmsg("[holycorn] could not map the shared memory segment of the worker")));
+
+  toc = shm_toc_attach(WORKER_MAGIC, dsm_segment_address(seg));
+  if (toc == NULL)
+    ereport(ERROR,
+        (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+         errmsg("[holycorn] invalid magic number in the shared memory segment of the worker")));
+
+  shared = (HolycornWorkerShared *) shm_toc_lookup(toc, WORKER_KEY_SHARED, false);
+  spec = (char *) shm_toc_lookup(toc, WORKER_KEY_SPEC, false);
+  mq = (shm_mq *) shm_toc_lookup(toc, WORKER_KEY_QUEUE, false);
+  gucstate = (char *) shm_toc_lookup(toc, WORKER_KEY_GUC, false);
+
+  shm_mq_set_sender(mq, MyProc);
+  mqh = shm_mq_attach(mq, seg, NULL);
+
+#if PG_VERSION_NUM >= 110000
+  BackgroundWorkerInitializeConnectionByOid(shared->database, shared->authenticated_user, 0);
+#else
+  BackgroundWorkerInitializeConnectionByOid(shared->database, shared->authenticated_user);
+#endif
+
+  /* Errors are passed on to the scan, which raises them */
+  PG_TRY();
+  {
+    /*
+     * Values are converted under the session's DateStyle, TimeZone and other
+     * settings, and the wrapper runs as the session's current user (which
+     * may be a role it can't log in as, set by SET ROLE or a SECURITY
+     * DEFINER function), as in parallel workers.
+     */
+    StartTransactionCommand();
+    RestoreGUCState(gucstate);
+    CommitTransactionCommand();
+    SetUserIdAndSecContext(shared->user, shared->sec_context);
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    pgstat_report_activity(STATE_RUNNING, "holycorn wrapper");
+
+    holycorn_worker_scan(spec, mqh);
+
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+    pgstat_report_activity(STATE_IDLE, NULL);
+  }
+  PG_CATCH();
+  {
+    ErrorData *edata;
+
+    MemoryContextSwitchTo(TopMemoryContext);
+    edata = CopyErrorData();
+
+    SpinLockAcquire(&shared->mutex);
+    shared->failed = true;
+    strlcpy(shared->error, edata->message ? edata->message : "unknown error", WORKER_ERROR_LEN);
+    SpinLockRelease(&shared->mutex);
+
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+
+  SpinLockAcquire(&shared->mutex);
+  shared->done = true;
+  SpinLockRelease(&shared->mutex);
+
+  shm_mq_detach(mqh);
+  dsm_detach(seg);
+  proc_exit(0);
+}
+
+#else
+
+/* Workers rely on bgw_function_name and shm_toc lookups (PostgreSQL 10) */
+void holycorn_worker_init(void) {
+}
+
+HolycornWorker *holycorn_worker_launch(const char *spec) {
+  ereport(ERROR,
+      (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+       errmsg("[holycorn] execution 'worker' requires PostgreSQL 10 or later")));
+  return NULL;
+}
+
+MinimalTuple holycorn_worker_receive(HolycornWorker *worker) {
+  return NULL;
+}
+
+void holycorn_worker_stop(HolycornWorker *worker) {
+}
+
+void holycorn_worker_main(Datum main_arg) {
+}
+
+bool holycorn_worker_send(shm_mq_handle *mqh, MinimalTuple tuple) {
+  return false;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef HOLYCORN_WORKER_H
+#define HOLYCORN_WORKER_H
+
+#include "access/htup.h"
+#include "storage/shm_mq.h"
+
+/*
+ * Scans of tables with execution 'worker' run their wrapper in a dynamic
+ * background worker, which streams the rows to the scan through a shm_mq
+ * ring buffer: the wrapper runs ahead of the scan until the queue is full.
+ */
+typedef struct HolycornWorker HolycornWorker;
+
+extern int holycorn_worker_queue_size;
+
+void holycorn_worker_init(void);
+HolycornWorker *holycorn_worker_launch(const char *spec);
+MinimalTuple holycorn_worker_receive(HolycornWorker *worker);
+void holycorn_worker_stop(HolycornWorker *worker);
+
+/* Worker side */
+PGDLLEXPORT void holycorn_worker_main(Datum main_arg);
+bool holycorn_worker_send(shm_mq_handle *mqh, MinimalTuple tuple);
+
+/* Runs the wrapper of a scan, sending its rows; defined in holycorn.c */
+void holycorn_worker_scan(const char *spec, shm_mq_handle *mqh);
+
+#endif